@@ -0,0 +1,226 @@
+// Measuring the cost of checking this host's mounts
+//
+// `mount_status_monitor benchmark` runs complete check cycles against the
+// host's real mount table with each probe backend and number of parallel
+// checks, and reports how long individual checks and whole cycles took, how
+// quickly checks were started and the CPU used by the monitor and by the check
+// processes. Nothing is logged, alerted on or exported, so it can be run on a
+// production host before choosing --poll-interval, --concurrency and
+// --collect-statfs for that class of machine.
+//
+// The state of the mounts is kept from one combination to the next, as the
+// daemon keeps it from one cycle to the next. A hung mount costs the full
+// check timeout in the first cycle of the first combination and only a
+// non-blocking poll afterwards, and never has more than one check stuck on it
+// however many combinations are run.
+
+use std::collections::HashMap;
+use std::io;
+use std::path::PathBuf;
+use std::time::{Duration, Instant};
+
+use argparse::{ArgumentParser, Store};
+use rayon;
+
+use crate::clock::SystemClock;
+use crate::errors::*;
+use crate::get_mounts::SystemMounts;
+use crate::microbench::format_duration;
+use crate::probe::{ProcessProber, CHECK_TIMEOUT};
+use crate::stats::{self, seconds};
+use crate::{check_mounts, MountState, StatusKind};
+
+const BACKENDS: &[&str] = &["stat", "statfs"];
+
+pub fn run(args: Vec<String>) -> Result<()> {
+    let mut backends = BACKENDS.join(",");
+    let mut concurrency = "1,4,16".to_owned();
+    let mut cycles: usize = 5;
+
+    {
+        let mut ap = ArgumentParser::new();
+        ap.set_description(
+            "Repeatedly check this host's mounts with each probe backend and concurrency and report the cost",
+        );
+
+        ap.refer(&mut backends).add_option(
+            &["--backends"],
+            Store,
+            "Comma-separated probe backends: stat (the default check) and statfs (as with --collect-statfs)",
+        );
+
+        ap.refer(&mut concurrency).add_option(
+            &["--concurrency"],
+            Store,
+            "Comma-separated numbers of mounts to check in parallel (0 for one per CPU)",
+        );
+
+        ap.refer(&mut cycles).add_option(
+            &["--cycles"],
+            Store,
+            "Number of check cycles to run for each combination",
+        );
+
+        let mut args = args;
+        args[0] = "mount_status_monitor benchmark".to_owned();
+        if let Err(rc) = ap.parse(args, &mut io::stdout(), &mut io::stderr()) {
+            ::std::process::exit(rc);
+        }
+    }
+
+    let backends: Vec<&str> = backends.split(',').map(str::trim).collect();
+    for backend in &backends {
+        if !BACKENDS.contains(backend) {
+            return Err(format!(
+                "Unknown probe backend {:?}; expected one of {}",
+                backend,
+                BACKENDS.join(", ")
+            )
+            .into());
+        }
+    }
+    let concurrency = concurrency
+        .split(',')
+        .map(|n| {
+            n.trim()
+                .parse()
+                .chain_err(|| format!("Invalid concurrency {:?}", n))
+        })
+        .collect::<Result<Vec<usize>>>()?;
+    let cycles = cycles.max(1);
+
+    println!(
+        "{:<7} {:>7} {:>7} {:>9} {:>9} {:>9} {:>9} {:>9} {:>9} {:>5} {:>10} {:>9} {:>9}",
+        "backend",
+        "threads",
+        "mounts",
+        "p50",
+        "p90",
+        "p99",
+        "max",
+        "cycle",
+        "cycle max",
+        "hung",
+        "checks/s",
+        "cpu self",
+        "cpu checks"
+    );
+
+    let mut mount_statuses = HashMap::<PathBuf, MountState>::new();
+    for backend in &backends {
+        let prober = ProcessProber {
+            statfs_helper: if *backend == "statfs" {
+                Some(
+                    ::std::env::current_exe()
+                        .chain_err(|| "Unable to locate our own executable")?,
+                )
+            } else {
+                None
+            },
+            namespace_helper: None,
+            timeout: CHECK_TIMEOUT,
+        };
+
+        for &threads in &concurrency {
+            let pool = rayon::ThreadPoolBuilder::new()
+                .num_threads(threads)
+                .build()
+                .chain_err(|| format!("Unable to start {} check threads", threads))?;
+            let result = pool.install(|| measure(&mut mount_statuses, &prober, cycles));
+            report(backend, pool.current_num_threads(), &result);
+        }
+    }
+
+    Ok(())
+}
+
+struct Measurement {
+    mounts: usize,
+    // Sorted durations of every check which completed or timed out:
+    latencies: Vec<Duration>,
+    // Sorted durations of each whole cycle:
+    cycles: Vec<Duration>,
+    hung: usize,
+    self_cpu: Duration,
+    checks_cpu: Duration,
+}
+
+fn measure(
+    mount_statuses: &mut HashMap<PathBuf, MountState>,
+    prober: &ProcessProber,
+    cycles: usize,
+) -> Measurement {
+    let mut latencies = Vec::new();
+    let mut cycle_times = Vec::with_capacity(cycles);
+    let mut hung = 0;
+
+    let usage_before = stats::resource_usage();
+    for _ in 0..cycles {
+        let cycle_start_time = Instant::now();
+        let outcomes = check_mounts(
+            mount_statuses,
+            &SystemMounts,
+            prober,
+            &SystemClock,
+            false,
+            false,
+        );
+        cycle_times.push(cycle_start_time.elapsed());
+
+        latencies.extend(outcomes.iter().filter_map(|o| o.check_duration));
+        hung = mount_statuses
+            .values()
+            .filter(|state| state.status.kind() == StatusKind::Hung)
+            .count();
+    }
+    let usage_after = stats::resource_usage();
+
+    latencies.sort();
+    cycle_times.sort();
+
+    Measurement {
+        mounts: mount_statuses.len(),
+        latencies,
+        cycles: cycle_times,
+        hung,
+        self_cpu: (usage_after.user_cpu + usage_after.system_cpu)
+            - (usage_before.user_cpu + usage_before.system_cpu),
+        checks_cpu: (usage_after.children_user_cpu + usage_after.children_system_cpu)
+            - (usage_before.children_user_cpu + usage_before.children_system_cpu),
+    }
+}
+
+fn report(backend: &str, threads: usize, measurement: &Measurement) {
+    let total_cycle_time: Duration = measurement.cycles.iter().sum();
+    let checks_per_second = if total_cycle_time > Duration::from_secs(0) {
+        measurement.latencies.len() as f64 / seconds(total_cycle_time)
+    } else {
+        0.0
+    };
+
+    println!(
+        "{:<7} {:>7} {:>7} {:>9} {:>9} {:>9} {:>9} {:>9} {:>9} {:>5} {:>10.0} {:>9} {:>9}",
+        backend,
+        threads,
+        measurement.mounts,
+        percentile(&measurement.latencies, 50.0),
+        percentile(&measurement.latencies, 90.0),
+        percentile(&measurement.latencies, 99.0),
+        percentile(&measurement.latencies, 100.0),
+        format_duration(measurement.cycles[measurement.cycles.len() / 2]),
+        format_duration(measurement.cycles[measurement.cycles.len() - 1]),
+        measurement.hung,
+        checks_per_second,
+        format_duration(measurement.self_cpu),
+        format_duration(measurement.checks_cpu)
+    );
+}
+
+// Nearest-rank percentile of sorted samples:
+fn percentile(sorted: &[Duration], p: f64) -> String {
+    if sorted.is_empty() {
+        return "-".to_owned();
+    }
+    let rank = ((p / 100.0) * sorted.len() as f64).ceil() as usize;
+    format_duration(sorted[rank.max(1).min(sorted.len()) - 1])
+}
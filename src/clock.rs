@@ -0,0 +1,74 @@
+// The source of time for scheduling and state tracking
+//
+// The timeout, hung-check and reminder logic all work in terms of seconds to
+// hours, which makes exercising them against the real clock impractical. The
+// checking and scheduling code therefore asks a Clock for the time and to
+// sleep. The daemon uses the system clock; simulations use a virtual clock
+// where sleeping simply moves time forward, so a multi-hour outage can be
+// played through in milliseconds.
+
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::thread;
+use std::time::{Duration, Instant, SystemTime};
+
+pub trait Clock: Send + Sync {
+    /// Monotonic time for measuring intervals
+    fn now(&self) -> Instant;
+
+    /// Wall-clock time for timestamps
+    fn system_time(&self) -> SystemTime;
+
+    fn sleep(&self, duration: Duration);
+}
+
+pub struct SystemClock;
+
+impl Clock for SystemClock {
+    fn now(&self) -> Instant {
+        Instant::now()
+    }
+
+    fn system_time(&self) -> SystemTime {
+        SystemTime::now()
+    }
+
+    fn sleep(&self, duration: Duration) {
+        thread::sleep(duration)
+    }
+}
+
+/// A clock which only moves when something sleeps
+pub struct VirtualClock {
+    origin: Instant,
+    system_origin: SystemTime,
+    elapsed_nanos: AtomicU64,
+}
+
+impl VirtualClock {
+    pub fn new() -> VirtualClock {
+        VirtualClock {
+            origin: Instant::now(),
+            system_origin: SystemTime::now(),
+            elapsed_nanos: AtomicU64::new(0),
+        }
+    }
+
+    fn elapsed(&self) -> Duration {
+        Duration::from_nanos(self.elapsed_nanos.load(Ordering::SeqCst))
+    }
+}
+
+impl Clock for VirtualClock {
+    fn now(&self) -> Instant {
+        self.origin + self.elapsed()
+    }
+
+    fn system_time(&self) -> SystemTime {
+        self.system_origin + self.elapsed()
+    }
+
+    fn sleep(&self, duration: Duration) {
+        let nanos = duration.as_secs() * 1_000_000_000 + u64::from(duration.subsec_nanos());
+        self.elapsed_nanos.fetch_add(nanos, Ordering::SeqCst);
+    }
+}
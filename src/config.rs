@@ -0,0 +1,223 @@
+// Settings which can be changed without restarting the monitor
+//
+// Restarting throws away everything we know about each mount, including the
+// hung checks we keep track of precisely so that a dead mount never has more
+// than one check stuck on it. --config FILE names a file holding the settings
+// which make sense to change on a running monitor, one per line:
+//
+//   # Lines starting with # are ignored
+//   poll-interval = 30
+//   check-timeout = 5
+//   exclude-fstype = tmpfs
+//   exclude-mount = /var/lib/docker
+//   event-sink = json:/var/log/mount_status.jsonl
+//
+// The keys are the names of the corresponding command line options, which
+// supply the value of any key missing from the file. List keys may be
+// repeated, and any occurrence in the file replaces the command line's list.
+//
+// The file is read again whenever the monitor receives SIGHUP. The new policy
+// is compared with the one in force, and each difference is logged and applied
+// to the running scheduler, prober and sinks before the next cycle. The state
+// of every mount is kept, so hung checks stay attached to their mounts and
+// still prevent new checks from piling up behind them. A file which cannot be
+// read or parsed is rejected as a whole and the current policy stays in force.
+
+use std::collections::HashSet;
+use std::fmt::Display;
+use std::fs;
+use std::io;
+use std::path::Path;
+use std::str::FromStr;
+
+use log::LevelFilter;
+
+use crate::errors::*;
+use crate::get_mounts::{MountPoint, MountSource};
+use crate::schedule::OverrunPolicy;
+
+#[derive(Clone, Debug, PartialEq)]
+pub struct Policy {
+    pub poll_interval: u64,
+    pub overrun_policy: OverrunPolicy,
+    pub check_timeout: u64,
+    pub exclude_fstypes: Vec<String>,
+    // Mounts at or below these paths are not checked:
+    pub exclude_mounts: Vec<String>,
+    pub event_sinks: Vec<String>,
+    pub print_bad_mounts: bool,
+    pub log_level: LevelFilter,
+    pub log_reminder_interval: u64,
+}
+
+impl Policy {
+    /// Read a config file on top of the command line settings
+    pub fn load(path: &Path, defaults: &Policy) -> Result<Policy> {
+        let contents = fs::read_to_string(path)
+            .chain_err(|| format!("Unable to read config file {}", path.display()))?;
+        // The problem is reported on the same line as the file's name:
+        Policy::parse(&contents, defaults)
+            .map_err(|e| format!("Invalid config file {}: {}", path.display(), e).into())
+    }
+
+    fn parse(contents: &str, defaults: &Policy) -> Result<Policy> {
+        let mut policy = defaults.clone();
+        // Lists which have been replaced rather than inherited:
+        let mut replaced = HashSet::new();
+
+        for (number, line) in contents.lines().enumerate() {
+            let line = line.trim();
+            if line.is_empty() || line.starts_with('#') {
+                continue;
+            }
+            let (key, value) = match line.find('=') {
+                Some(i) => (line[..i].trim(), line[i + 1..].trim()),
+                None => bail!("line {}: expected KEY = VALUE", number + 1),
+            };
+            match key {
+                "poll-interval" => policy.poll_interval = parse_value(key, value, number + 1)?,
+                "overrun-policy" => policy.overrun_policy = parse_value(key, value, number + 1)?,
+                "check-timeout" => policy.check_timeout = parse_value(key, value, number + 1)?,
+                "print-bad-mounts" => {
+                    policy.print_bad_mounts = parse_value(key, value, number + 1)?
+                }
+                "log-level" => policy.log_level = parse_value(key, value, number + 1)?,
+                "log-reminder-interval" => {
+                    policy.log_reminder_interval = parse_value(key, value, number + 1)?
+                }
+                "exclude-fstype" | "exclude-mount" | "event-sink" => {
+                    let values = match key {
+                        "exclude-fstype" => &mut policy.exclude_fstypes,
+                        "exclude-mount" => &mut policy.exclude_mounts,
+                        _ => &mut policy.event_sinks,
+                    };
+                    if replaced.insert(key) {
+                        values.clear();
+                    }
+                    // An empty value just clears the list:
+                    if !value.is_empty() {
+                        values.push(value.to_owned());
+                    }
+                }
+                _ => bail!("line {}: unknown setting {:?}", number + 1, key),
+            }
+        }
+
+        if policy.check_timeout == 0 {
+            bail!("check-timeout must be at least one second");
+        }
+
+        Ok(policy)
+    }
+
+    /// Describe each setting which differs in the new policy
+    pub fn changes(&self, new: &Policy) -> Vec<String> {
+        let mut changes = Vec::new();
+        {
+            let mut compare = |key: &str, old: String, new: String| {
+                if old != new {
+                    changes.push(format!("{} changed from {} to {}", key, old, new));
+                }
+            };
+            compare(
+                "poll-interval",
+                self.poll_interval.to_string(),
+                new.poll_interval.to_string(),
+            );
+            compare(
+                "overrun-policy",
+                format!("{:?}", self.overrun_policy).to_lowercase(),
+                format!("{:?}", new.overrun_policy).to_lowercase(),
+            );
+            compare(
+                "check-timeout",
+                self.check_timeout.to_string(),
+                new.check_timeout.to_string(),
+            );
+            compare(
+                "exclude-fstype",
+                list(&self.exclude_fstypes),
+                list(&new.exclude_fstypes),
+            );
+            compare(
+                "exclude-mount",
+                list(&self.exclude_mounts),
+                list(&new.exclude_mounts),
+            );
+            compare(
+                "event-sink",
+                list(&self.event_sinks),
+                list(&new.event_sinks),
+            );
+            compare(
+                "print-bad-mounts",
+                self.print_bad_mounts.to_string(),
+                new.print_bad_mounts.to_string(),
+            );
+            compare(
+                "log-level",
+                self.log_level.to_string().to_lowercase(),
+                new.log_level.to_string().to_lowercase(),
+            );
+            compare(
+                "log-reminder-interval",
+                self.log_reminder_interval.to_string(),
+                new.log_reminder_interval.to_string(),
+            );
+        }
+        changes
+    }
+
+    /// Whether a mount should be left out of the checks
+    pub fn excludes(&self, mount_point: &MountPoint) -> bool {
+        excluded(mount_point, &self.exclude_fstypes, &self.exclude_mounts)
+    }
+}
+
+/// Whether a mount has one of the filesystem types or is at or below one of
+/// the paths
+pub fn excluded(mount_point: &MountPoint, fs_types: &[String], paths: &[String]) -> bool {
+    if fs_types.contains(&mount_point.fs_type) {
+        return true;
+    }
+    // Mounts in other namespaces match by the path their container sees as
+    // well as the one we see:
+    let inner_path = mount_point.namespace.as_ref().map(|n| n.path.as_path());
+    paths.iter().any(|prefix| {
+        mount_point.path.starts_with(prefix)
+            || inner_path.map_or(false, |path| path.starts_with(prefix))
+    })
+}
+
+fn parse_value<T: FromStr>(key: &str, value: &str, line: usize) -> Result<T>
+where
+    T::Err: Display,
+{
+    value
+        .parse()
+        .map_err(|e| format!("line {}: invalid {} {:?}: {}", line, key, value, e).into())
+}
+
+fn list(values: &[String]) -> String {
+    if values.is_empty() {
+        "(none)".to_owned()
+    } else {
+        values.join(",")
+    }
+}
+
+/// The mounts from another source which the policy does not exclude
+pub struct FilteredMounts<'a> {
+    pub inner: &'a dyn MountSource,
+    pub policy: &'a Policy,
+}
+
+impl<'a> MountSource for FilteredMounts<'a> {
+    fn mount_points(&self) -> io::Result<Vec<MountPoint>> {
+        let mut mount_points = self.inner.mount_points()?;
+        if !self.policy.exclude_fstypes.is_empty() || !self.policy.exclude_mounts.is_empty() {
+            mount_points.retain(|mount_point| !self.policy.excludes(mount_point));
+        }
+        Ok(mount_points)
+    }
+}
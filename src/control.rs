@@ -0,0 +1,250 @@
+// Local control socket
+//
+// --control-socket PATH listens on a Unix domain socket so other tools can ask
+// whether a mount is safe to touch instead of touching it and risking a hang.
+// Each connection sends a single command line and receives the reply before
+// the connection is closed:
+//
+//   status [PATH]   one JSON object per mount, or just for PATH, describing
+//                   the state found by its most recent check
+//   recheck         start a cycle now rather than waiting for the next tick
+//
+// Status replies never trigger checks: they are read from the immutable views
+// in snapshot.rs, which are updated as each check completes, and the full
+// reply is cached until any mount changes, so a burst of queries costs no more
+// than copying bytes. Recheck requests only set a flag which wakes the
+// scheduler, so any number of them made while a cycle is running or pending are
+// served by a single extra cycle.
+//
+// Connections are handled one at a time with short timeouts so a stuck client
+// can delay the others by at most a few seconds and can never delay checks.
+//
+// Anyone who can connect can make us run cycles, so the socket is created
+// readable and writable by our own user only, or also by the group given with
+// --control-socket-group. A socket left behind by a previous run is replaced,
+// but not one which still has a listener, and nothing which isn't a socket is
+// ever removed.
+
+use std::ffi::CString;
+use std::fmt::Write as FmtWrite;
+use std::fs;
+use std::io::{self, BufRead, BufReader, Read, Write};
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::fs::{FileTypeExt, PermissionsExt};
+use std::os::unix::net::{UnixListener, UnixStream};
+use std::path::Path;
+use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::Duration;
+
+use libc;
+
+use crate::errors::*;
+use crate::events::{json_string, timestamp};
+use crate::schedule::Wakeup;
+use crate::snapshot::{MountView, StatusBoard};
+use crate::stats::seconds;
+use crate::windows::{QUANTILES, WINDOWS};
+
+const CLIENT_TIMEOUT: Duration = Duration::from_secs(2);
+// Nobody needs a longer command than a path:
+const MAX_REQUEST_BYTES: u64 = 8192;
+
+/// The socket thread's state
+pub struct Control {
+    board: Arc<StatusBoard>,
+    wakeup: Arc<Wakeup>,
+    // The last full status reply and the board version it was rendered from:
+    cached_status: Mutex<Option<((u64, u64), Arc<String>)>>,
+}
+
+impl Control {
+    /// Listen on the socket, replacing any left behind by a previous run
+    pub fn start(
+        path: &Path,
+        group: Option<&str>,
+        board: Arc<StatusBoard>,
+        wakeup: Arc<Wakeup>,
+    ) -> Result<()> {
+        let gid = match group {
+            Some(group) => Some(group_id(group)?),
+            None => None,
+        };
+
+        if let Ok(metadata) = fs::symlink_metadata(path) {
+            if !metadata.file_type().is_socket() {
+                bail!("{} exists and is not a socket", path.display());
+            }
+            if UnixStream::connect(path).is_ok() {
+                bail!("{} is already in use by another process", path.display());
+            }
+            fs::remove_file(path)
+                .chain_err(|| format!("Unable to remove stale socket {}", path.display()))?;
+        }
+
+        // The socket must never be reachable with looser permissions, even
+        // briefly, so it is created with them rather than changed afterwards:
+        let old_umask = unsafe { libc::umask(0o177) };
+        let listener = UnixListener::bind(path);
+        unsafe { libc::umask(old_umask) };
+        let listener = listener.chain_err(|| format!("Unable to listen on {}", path.display()))?;
+
+        if let Some(gid) = gid {
+            let c_path = CString::new(path.as_os_str().as_bytes())
+                .chain_err(|| format!("Invalid socket path {}", path.display()))?;
+            if unsafe { libc::chown(c_path.as_ptr(), !0, gid) } != 0 {
+                return Err(io::Error::last_os_error())
+                    .chain_err(|| format!("Unable to change the group of {}", path.display()));
+            }
+            fs::set_permissions(path, fs::Permissions::from_mode(0o660))
+                .chain_err(|| format!("Unable to change the mode of {}", path.display()))?;
+        }
+
+        let control = Control {
+            board,
+            wakeup,
+            cached_status: Mutex::new(None),
+        };
+
+        thread::Builder::new()
+            .name("control".to_owned())
+            .spawn(move || {
+                for stream in listener.incoming() {
+                    match stream {
+                        Ok(stream) => {
+                            if let Err(e) = control.serve(stream) {
+                                debug!("Control socket client failed: {}", e);
+                            }
+                        }
+                        Err(e) => error!("Unable to accept control socket connection: {}", e),
+                    }
+                }
+            })
+            .chain_err(|| "Unable to start the control socket thread")?;
+
+        Ok(())
+    }
+
+    fn status(&self) -> Arc<String> {
+        let snapshot = self.board.load();
+        let changes = snapshot.changes();
+
+        let mut cached_status = self.cached_status.lock().unwrap();
+        if let Some((cached_changes, ref reply)) = *cached_status {
+            if cached_changes == changes {
+                return reply.clone();
+            }
+        }
+
+        let mut reply = String::new();
+        for (mount_point, slot) in snapshot.mounts.iter() {
+            reply.push_str(&render(mount_point, slot.load().as_ref().as_ref()));
+        }
+        let reply = Arc::new(reply);
+        *cached_status = Some((changes, reply.clone()));
+        reply
+    }
+
+    fn serve(&self, stream: UnixStream) -> io::Result<()> {
+        stream.set_read_timeout(Some(CLIENT_TIMEOUT))?;
+        stream.set_write_timeout(Some(CLIENT_TIMEOUT))?;
+
+        let mut request = String::new();
+        BufReader::new((&stream).take(MAX_REQUEST_BYTES)).read_line(&mut request)?;
+        let request = request.trim_end_matches(|c| c == '\n' || c == '\r');
+        let (command, argument) = match request.find(' ') {
+            Some(i) => (&request[..i], Some(&request[i + 1..])),
+            None => (request, None),
+        };
+
+        let mut stream = stream;
+        match (command, argument) {
+            ("status", None) => stream.write_all(self.status().as_bytes()),
+            ("status", Some(path)) => {
+                let snapshot = self.board.load();
+                match snapshot.mounts.get(Path::new(path)) {
+                    Some(slot) => {
+                        let line = render(Path::new(path), slot.load().as_ref().as_ref());
+                        stream.write_all(line.as_bytes())
+                    }
+                    None => reply_error(&mut stream, "unknown mountpoint"),
+                }
+            }
+            ("recheck", None) => {
+                self.wakeup.request();
+                stream.write_all(b"{\"recheck\":\"queued\"}\n")
+            }
+            _ => reply_error(&mut stream, "expected status [PATH] or recheck"),
+        }
+    }
+}
+
+// A group name, or a numeric group ID:
+fn group_id(group: &str) -> Result<libc::gid_t> {
+    if let Ok(gid) = group.parse() {
+        return Ok(gid);
+    }
+    let name = CString::new(group).chain_err(|| format!("Invalid group name {}", group))?;
+    // Called once at startup, before anything else could use getgrnam(3):
+    let entry = unsafe { libc::getgrnam(name.as_ptr()) };
+    if entry.is_null() {
+        bail!("Unknown group {}", group);
+    }
+    Ok(unsafe { (*entry).gr_gid })
+}
+
+fn reply_error(stream: &mut UnixStream, message: &str) -> io::Result<()> {
+    writeln!(stream, "{{\"error\":{}}}", json_string(message))
+}
+
+fn render(mount_point: &Path, view: Option<&MountView>) -> String {
+    let view = match view {
+        Some(view) => view,
+        // A mount whose check could not even be started:
+        None => {
+            return format!(
+                "{{\"mountpoint\":{},\"status\":\"unknown\"}}\n",
+                json_string(&mount_point.to_string_lossy())
+            )
+        }
+    };
+
+    let mut line = format!(
+        "{{\"mountpoint\":{},\"fstype\":{},\"source\":{},\"status\":\"{}\",\"checked\":{:.3}",
+        json_string(&mount_point.to_string_lossy()),
+        json_string(&view.fs_type),
+        json_string(&view.source),
+        view.status.name(),
+        timestamp(view.checked)
+    );
+    if let Some(last_success) = view.last_success {
+        let _ = write!(line, ",\"last_success\":{:.3}", timestamp(last_success));
+    }
+    if let Some(duration) = view.last_check_duration {
+        let _ = write!(line, ",\"check_duration_seconds\":{:.6}", seconds(duration));
+    }
+    if let Some(hung_since) = view.hung_since {
+        let _ = write!(line, ",\"hung_since\":{:.3}", timestamp(hung_since));
+    }
+    if let Some(ref totals) = view.windows {
+        line.push_str(",\"windows\":{");
+        for (i, (window, totals)) in WINDOWS.iter().zip(totals.iter()).enumerate() {
+            if i > 0 {
+                line.push(',');
+            }
+            let _ = write!(line, "\"{}\":{{\"checks\":{}", window.name, totals.checks);
+            if let Some(availability) = totals.availability() {
+                let _ = write!(line, ",\"availability\":{:.6}", availability);
+            }
+            for &(_, q) in QUANTILES {
+                if let Some(value) = totals.quantile(q) {
+                    let _ = write!(line, ",\"p{}\":{:.6}", (q * 100.0) as u32, value);
+                }
+            }
+            line.push('}');
+        }
+        line.push('}');
+    }
+    line.push_str("}\n");
+    line
+}
@@ -0,0 +1,353 @@
+// Machine-readable event output
+//
+// Each cycle produces one event per check and one for every mount whose state
+// changed. The whole cycle's events are handed to a writer thread as a single
+// batch through a bounded queue; if the writer falls behind (e.g. a statsd
+// server on the far side of a dead network) batches are dropped rather than
+// delaying the checks. Every sink writes a batch in as few operations as
+// possible: one write(2) for a file, and as few datagrams as will hold the
+// batch for the UDP protocols, rather than one per mount.
+//
+// Sinks are specified as TYPE:DESTINATION:
+//
+//   json:/var/log/mount_status.jsonl   JSON lines appended to a file ("-" for stdout)
+//   statsd:127.0.0.1:8125              StatsD over UDP
+//   influx:127.0.0.1:8089              InfluxDB line protocol over UDP
+
+use std::fmt::Write as FmtWrite;
+use std::fs;
+use std::io::{self, Write};
+use std::net::{SocketAddr, ToSocketAddrs, UdpSocket};
+use std::sync::atomic::Ordering;
+use std::sync::mpsc;
+use std::thread;
+use std::time::{SystemTime, UNIX_EPOCH};
+
+use crate::errors::*;
+use crate::stats;
+use crate::{CheckOutcome, StatusKind};
+
+// Comfortably below the usual Ethernet MTU once IP and UDP headers are added:
+const MAX_DATAGRAM_SIZE: usize = 1432;
+
+pub trait EventSink: Send {
+    fn write_batch(&mut self, events: &[CheckOutcome]) -> io::Result<()>;
+}
+
+pub fn parse_sink(spec: &str) -> Result<Box<dyn EventSink>> {
+    let mut parts = spec.splitn(2, ':');
+    let (kind, destination) = match (parts.next(), parts.next()) {
+        (Some(kind), Some(destination)) if !destination.is_empty() => (kind, destination),
+        _ => {
+            return Err(
+                format!("Event sink {:?} must be in the form TYPE:DESTINATION", spec).into(),
+            )
+        }
+    };
+
+    match kind {
+        "json" => Ok(Box::new(JsonLinesSink::new(destination)?)),
+        "statsd" => Ok(Box::new(DatagramSink::new(destination, format_statsd)?)),
+        "influx" => Ok(Box::new(DatagramSink::new(destination, format_influx)?)),
+        _ => Err(format!(
+            "Unknown event sink type {:?}; expected json, statsd or influx",
+            kind
+        )
+        .into()),
+    }
+}
+
+/// Start a pipeline for --event-sink specifications, if there are any
+pub fn start_pipeline(specs: &[String], queue_depth: usize) -> Result<Option<EventPipeline>> {
+    if specs.is_empty() {
+        return Ok(None);
+    }
+    let sinks = specs
+        .iter()
+        .map(|spec| parse_sink(spec))
+        .collect::<Result<Vec<_>>>()?;
+    EventPipeline::start(sinks, queue_depth).map(Some)
+}
+
+pub struct EventPipeline {
+    sender: mpsc::SyncSender<Vec<CheckOutcome>>,
+    writer: thread::JoinHandle<()>,
+}
+
+impl EventPipeline {
+    pub fn start(mut sinks: Vec<Box<dyn EventSink>>, queue_depth: usize) -> Result<EventPipeline> {
+        let (sender, receiver) = mpsc::sync_channel::<Vec<CheckOutcome>>(queue_depth);
+
+        let writer = thread::Builder::new()
+            .name("event-sinks".into())
+            .spawn(move || {
+                for batch in receiver {
+                    for sink in &mut sinks {
+                        if let Err(e) = sink.write_batch(&batch) {
+                            warn!("Unable to write {} events: {}", batch.len(), e);
+                        }
+                    }
+                }
+            })
+            .chain_err(|| "Unable to start the event writer thread")?;
+
+        Ok(EventPipeline { sender, writer })
+    }
+
+    /// Queue a cycle's events without blocking
+    pub fn submit(&self, batch: Vec<CheckOutcome>) {
+        if let Err(mpsc::TrySendError::Full(batch)) = self.sender.try_send(batch) {
+            let dropped = stats::EVENT_BATCHES_DROPPED.fetch_add(1, Ordering::Relaxed) + 1;
+            warn!(
+                "Event sinks are not keeping up; dropped {} events ({} batches so far)",
+                batch.len(),
+                dropped
+            );
+        }
+    }
+
+    /// Deliver everything which has been queued and stop the writer
+    pub fn finish(self) {
+        drop(self.sender);
+        let _ = self.writer.join();
+    }
+}
+
+struct JsonLinesSink {
+    output: Box<dyn Write + Send>,
+}
+
+impl JsonLinesSink {
+    fn new(destination: &str) -> Result<JsonLinesSink> {
+        let output: Box<dyn Write + Send> = if destination == "-" {
+            Box::new(io::stdout())
+        } else {
+            Box::new(
+                fs::OpenOptions::new()
+                    .create(true)
+                    .append(true)
+                    .open(destination)
+                    .chain_err(|| format!("Unable to open {}", destination))?,
+            )
+        };
+        Ok(JsonLinesSink { output })
+    }
+}
+
+impl EventSink for JsonLinesSink {
+    fn write_batch(&mut self, events: &[CheckOutcome]) -> io::Result<()> {
+        let mut buffer = String::new();
+        for event in events {
+            let prefix = format!(
+                "{{\"timestamp\":{:.3},\"mountpoint\":{},\"fstype\":{},\"source\":{}",
+                timestamp(event.timestamp),
+                json_string(&event.mount_point.to_string_lossy()),
+                json_string(&event.fs_type),
+                json_string(&event.source)
+            );
+
+            if let Some(duration) = event.check_duration {
+                let _ = writeln!(
+                    buffer,
+                    "{},\"event\":\"check\",\"status\":\"{}\",\"duration_seconds\":{:.6}}}",
+                    prefix,
+                    event.current.name(),
+                    stats::seconds(duration)
+                );
+            }
+
+            if event.previous != event.current {
+                let _ = writeln!(
+                    buffer,
+                    "{},\"event\":\"transition\",\"from\":\"{}\",\"to\":\"{}\"}}",
+                    prefix,
+                    event.previous.name(),
+                    event.current.name()
+                );
+            }
+        }
+
+        self.output.write_all(buffer.as_bytes())?;
+        self.output.flush()
+    }
+}
+
+pub fn json_string(value: &str) -> String {
+    let mut quoted = String::with_capacity(value.len() + 2);
+    quoted.push('"');
+    for c in value.chars() {
+        match c {
+            '"' => quoted.push_str("\\\""),
+            '\\' => quoted.push_str("\\\\"),
+            '\n' => quoted.push_str("\\n"),
+            c if (c as u32) < 0x20 => {
+                let _ = write!(quoted, "\\u{:04x}", c as u32);
+            }
+            c => quoted.push(c),
+        }
+    }
+    quoted.push('"');
+    quoted
+}
+
+// Sends one line per record, packing as many lines into each datagram as fit:
+struct DatagramSink {
+    socket: UdpSocket,
+    format: fn(&CheckOutcome, &mut Vec<String>),
+}
+
+impl DatagramSink {
+    fn new(destination: &str, format: fn(&CheckOutcome, &mut Vec<String>)) -> Result<DatagramSink> {
+        let address: SocketAddr = destination
+            .to_socket_addrs()
+            .chain_err(|| format!("Unable to resolve {}", destination))?
+            .next()
+            .ok_or_else(|| format!("{} did not resolve to any address", destination))?;
+
+        let local_address = if address.is_ipv4() {
+            "0.0.0.0:0"
+        } else {
+            "[::]:0"
+        };
+        let socket = UdpSocket::bind(local_address).chain_err(|| "Unable to create UDP socket")?;
+        socket
+            .connect(address)
+            .chain_err(|| format!("Unable to connect to {}", destination))?;
+
+        Ok(DatagramSink { socket, format })
+    }
+}
+
+impl EventSink for DatagramSink {
+    fn write_batch(&mut self, events: &[CheckOutcome]) -> io::Result<()> {
+        let mut lines = Vec::new();
+        for event in events {
+            (self.format)(event, &mut lines);
+        }
+
+        let mut datagram = String::with_capacity(MAX_DATAGRAM_SIZE);
+        for line in lines {
+            if !datagram.is_empty() && datagram.len() + 1 + line.len() > MAX_DATAGRAM_SIZE {
+                self.socket.send(datagram.as_bytes())?;
+                datagram.clear();
+            }
+            if !datagram.is_empty() {
+                datagram.push('\n');
+            }
+            datagram.push_str(&line);
+        }
+        if !datagram.is_empty() {
+            self.socket.send(datagram.as_bytes())?;
+        }
+        Ok(())
+    }
+}
+
+fn format_statsd(event: &CheckOutcome, lines: &mut Vec<String>) {
+    let name = statsd_name(&event.mount_point.to_string_lossy());
+
+    if let Some(duration) = event.check_duration {
+        lines.push(format!(
+            "mount_status_monitor.mount.{}.check_duration:{}|ms",
+            name,
+            duration.as_secs() * 1000 + u64::from(duration.subsec_millis())
+        ));
+    }
+
+    lines.push(format!(
+        "mount_status_monitor.mount.{}.up:{}|g",
+        name,
+        if event.current == StatusKind::Alive {
+            1
+        } else {
+            0
+        }
+    ));
+
+    if event.previous != event.current {
+        lines.push(format!(
+            "mount_status_monitor.transitions.{}:1|c",
+            event.current.name()
+        ));
+    }
+}
+
+// StatsD has no labels so the path becomes part of the metric name:
+fn statsd_name(mount_point: &str) -> String {
+    let name: String = mount_point
+        .trim_matches('/')
+        .chars()
+        .map(|c| {
+            if c.is_ascii_alphanumeric() || c == '-' {
+                c
+            } else {
+                '_'
+            }
+        })
+        .collect();
+    if name.is_empty() {
+        "root".to_owned()
+    } else {
+        name
+    }
+}
+
+fn format_influx(event: &CheckOutcome, lines: &mut Vec<String>) {
+    let tags = format!(
+        "mountpoint={},fstype={},source={}",
+        influx_tag(&event.mount_point.to_string_lossy()),
+        influx_tag(&event.fs_type),
+        influx_tag(&event.source)
+    );
+    let nanoseconds = event
+        .timestamp
+        .duration_since(UNIX_EPOCH)
+        .map(|d| d.as_secs() * 1_000_000_000 + u64::from(d.subsec_nanos()))
+        .unwrap_or(0);
+
+    if let Some(duration) = event.check_duration {
+        lines.push(format!(
+            "mount_check,{} status=\"{}\",up={}i,duration_seconds={} {}",
+            tags,
+            event.current.name(),
+            if event.current == StatusKind::Alive {
+                1
+            } else {
+                0
+            },
+            stats::seconds(duration),
+            nanoseconds
+        ));
+    }
+
+    if event.previous != event.current {
+        lines.push(format!(
+            "mount_transition,{} from=\"{}\",to=\"{}\" {}",
+            tags,
+            event.previous.name(),
+            event.current.name(),
+            nanoseconds
+        ));
+    }
+}
+
+fn influx_tag(value: &str) -> String {
+    if value.is_empty() {
+        // Influx rejects empty tag values:
+        return "none".to_owned();
+    }
+    let mut escaped = String::with_capacity(value.len());
+    for c in value.chars() {
+        if c == ',' || c == '=' || c == ' ' {
+            escaped.push('\\');
+        }
+        escaped.push(c);
+    }
+    escaped
+}
+
+pub fn timestamp(time: SystemTime) -> f64 {
+    time.duration_since(UNIX_EPOCH)
+        .map(stats::seconds)
+        .unwrap_or(0.0)
+}
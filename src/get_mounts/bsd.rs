@@ -9,6 +9,8 @@ use std::slice;
 
 use libc::{c_int, statfs};
 
+use super::MountPoint;
+
 pub static MNT_NOWAIT: i32 = 2;
 
 extern "C" {
@@ -16,7 +18,7 @@ extern "C" {
     fn getmntinfo(mntbufp: *mut *mut statfs, flags: c_int) -> c_int;
 }
 
-pub fn get_mount_points() -> Result<Vec<PathBuf>> {
+pub fn get_mount_points() -> Result<Vec<MountPoint>> {
     let mut raw_mounts_ptr: *mut statfs = ptr::null_mut();
 
     let rc = unsafe { getmntinfo(&mut raw_mounts_ptr, MNT_NOWAIT) };
@@ -44,7 +46,16 @@ pub fn get_mount_points() -> Result<Vec<PathBuf>> {
         .iter()
         .map(|m| unsafe {
             let bytes = CStr::from_ptr(&m.f_mntonname[0]).to_bytes();
-            PathBuf::from(OsStr::from_bytes(bytes).to_owned())
+            MountPoint {
+                path: PathBuf::from(OsStr::from_bytes(bytes).to_owned()),
+                fs_type: CStr::from_ptr(&m.f_fstypename[0])
+                    .to_string_lossy()
+                    .into_owned(),
+                source: CStr::from_ptr(&m.f_mntfromname[0])
+                    .to_string_lossy()
+                    .into_owned(),
+                namespace: None,
+            }
         })
         .collect();
 
@@ -1,11 +1,16 @@
-// Wrapper for the Linux getmntent() API which returns a list of mountpoints
+// Wrapper for the Linux getmntent() API which returns a list of mountpoints,
+// plus a parser for the mountinfo format used to look inside other namespaces
 
 use std::ffi::CStr;
-use std::ffi::OsStr;
-use std::io::Result;
+use std::ffi::CString;
+use std::ffi::{OsStr, OsString};
+use std::fs;
+use std::io::{Error, ErrorKind, Result};
 use std::mem;
-use std::os::unix::ffi::OsStrExt;
-use std::path::PathBuf;
+use std::os::unix::ffi::{OsStrExt, OsStringExt};
+use std::path::{Path, PathBuf};
+
+use super::MountPoint;
 
 use libc::c_char;
 use libc::c_int;
@@ -34,28 +39,27 @@ extern "C" {
     fn endmntent(fp: *mut FILE) -> c_int;
 }
 
-pub fn get_mount_points() -> Result<Vec<PathBuf>> {
-    let mut mount_points: Vec<PathBuf> = Vec::new();
-
+pub fn get_mount_points() -> Result<Vec<MountPoint>> {
     // The Linux API is somewhat baroque: rather than exposing the kernel's view of the world
     // you are expected to provide it with a mounts file which traditionally might have been
     // something like /etc/mtab but should be /proc/self/mounts (n.b. /proc/mounts is just a
     // symlink to /proc/self/mounts).
-    let mount_filename = "/proc/self/mounts\0";
+    read_mount_table(Path::new("/proc/self/mounts"))
+}
+
+/// Parse a file in the fstab(5) format used by /proc/self/mounts
+pub fn read_mount_table(mount_filename: &Path) -> Result<Vec<MountPoint>> {
+    let mut mount_points: Vec<MountPoint> = Vec::new();
+
+    let c_filename = CString::new(mount_filename.as_os_str().as_bytes())
+        .map_err(|e| Error::new(ErrorKind::InvalidInput, e))?;
     let flags = "r\0";
 
-    let mount_file_handle = unsafe {
-        setmntent(
-            mount_filename.as_ptr() as *const _,
-            flags.as_ptr() as *const _,
-        )
-    };
+    let mount_file_handle = unsafe { setmntent(c_filename.as_ptr(), flags.as_ptr() as *const _) };
 
-    assert!(
-        !mount_file_handle.is_null(),
-        "Attempting to read mounts from {} failed!",
-        &mount_filename[..mount_filename.len() - 1]
-    );
+    if mount_file_handle.is_null() {
+        return Err(Error::last_os_error());
+    }
 
     loop {
         let mount_entry = unsafe { getmntent(mount_file_handle) };
@@ -63,9 +67,19 @@ pub fn get_mount_points() -> Result<Vec<PathBuf>> {
             break;
         }
 
-        let bytes = unsafe { CStr::from_ptr((*mount_entry).mnt_dir).to_bytes() };
-        let mount_point = PathBuf::from(OsStr::from_bytes(bytes).to_owned());
-        mount_points.push(mount_point);
+        let (dir, fs_type, source) = unsafe {
+            (
+                CStr::from_ptr((*mount_entry).mnt_dir).to_bytes(),
+                CStr::from_ptr((*mount_entry).mnt_type),
+                CStr::from_ptr((*mount_entry).mnt_fsname),
+            )
+        };
+        mount_points.push(MountPoint {
+            path: PathBuf::from(OsStr::from_bytes(dir).to_owned()),
+            fs_type: fs_type.to_string_lossy().into_owned(),
+            source: source.to_string_lossy().into_owned(),
+            namespace: None,
+        });
     }
 
     let rc = unsafe { endmntent(mount_file_handle) };
@@ -79,3 +93,87 @@ pub fn get_mount_points() -> Result<Vec<PathBuf>> {
 
     Ok(mount_points)
 }
+
+/// An entry from /proc/PID/mountinfo, which unlike the mounts file identifies
+/// the filesystem behind each mount
+#[derive(Clone, Debug, PartialEq)]
+pub struct MountInfo {
+    pub mount_point: MountPoint,
+    // The st_dev of the filesystem as major:minor:
+    pub device: String,
+    // The directory within the filesystem which is mounted, e.g. the source of
+    // a bind mount:
+    pub root: PathBuf,
+}
+
+/// Parse a file in the format of /proc/PID/mountinfo (see proc(5))
+pub fn read_mountinfo(mountinfo_filename: &Path) -> Result<Vec<MountInfo>> {
+    let contents = fs::read(mountinfo_filename)?;
+
+    contents
+        .split(|&b| b == b'\n')
+        .filter(|line| !line.is_empty())
+        .map(|line| {
+            parse_mountinfo_line(line).ok_or_else(|| {
+                Error::new(
+                    ErrorKind::InvalidData,
+                    format!(
+                        "Unable to parse {}: {:?}",
+                        mountinfo_filename.display(),
+                        String::from_utf8_lossy(line)
+                    ),
+                )
+            })
+        })
+        .collect()
+}
+
+fn parse_mountinfo_line(line: &[u8]) -> Option<MountInfo> {
+    // mount ID, parent ID, major:minor, root, mount point, options, any number
+    // of optional fields, a "-" separator, filesystem type, source, superblock
+    // options:
+    let mut fields = line.split(|&b| b == b' ');
+    let device = fields.nth(2)?;
+    let root = fields.next()?;
+    let path = fields.next()?;
+    let mut fields = fields.skip_while(|&field| field != b"-").skip(1);
+    let fs_type = fields.next()?;
+    let source = fields.next()?;
+
+    Some(MountInfo {
+        mount_point: MountPoint {
+            path: PathBuf::from(OsString::from_vec(unescape(path))),
+            fs_type: String::from_utf8_lossy(&unescape(fs_type)).into_owned(),
+            source: String::from_utf8_lossy(&unescape(source)).into_owned(),
+            namespace: None,
+        },
+        device: String::from_utf8_lossy(device).into_owned(),
+        root: PathBuf::from(OsString::from_vec(unescape(root))),
+    })
+}
+
+// The kernel writes spaces, tabs, newlines and backslashes as octal escapes:
+fn unescape(field: &[u8]) -> Vec<u8> {
+    let mut unescaped = Vec::with_capacity(field.len());
+    let mut i = 0;
+    while i < field.len() {
+        let octal = field.get(i + 1..i + 4).and_then(|digits| {
+            if field[i] == b'\\' && digits.iter().all(|d| (b'0'..=b'7').contains(d)) {
+                Some(digits.iter().fold(0u16, |n, d| n * 8 + u16::from(d - b'0')))
+            } else {
+                None
+            }
+        });
+        match octal {
+            Some(byte) if byte <= 0xff => {
+                unescaped.push(byte as u8);
+                i += 4;
+            }
+            _ => {
+                unescaped.push(field[i]);
+                i += 1;
+            }
+        }
+    }
+    unescaped
+}
@@ -1,9 +1,48 @@
+use std::io;
+use std::path::PathBuf;
+
 #[cfg(target_os = "linux")]
 mod linux;
 #[cfg(target_os = "linux")]
-pub use self::linux::get_mount_points;
+pub use self::linux::{get_mount_points, read_mount_table, read_mountinfo};
 
 #[cfg(all(unix, not(target_os = "linux")))]
 mod bsd;
 #[cfg(all(unix, not(target_os = "linux")))]
 pub use self::bsd::get_mount_points;
+
+#[derive(Clone, Debug, PartialEq)]
+pub struct MountPoint {
+    pub path: PathBuf,
+    pub fs_type: String,
+    // The device or remote export, e.g. /dev/sda1 or nfs-server:/export:
+    pub source: String,
+    // Set for mounts which only exist in another mount namespace, in which
+    // case path is where the monitor can see them under /proc:
+    pub namespace: Option<NamespacedPath>,
+}
+
+/// How to reach a mount in another mount namespace, such as a container's
+#[derive(Clone, Debug, PartialEq)]
+pub struct NamespacedPath {
+    // The namespace's inode number, as shown by readlink /proc/PID/ns/mnt:
+    pub namespace: u64,
+    // A process in that namespace through which it can be entered:
+    pub pid: u32,
+    // The mountpoint as seen from inside the namespace:
+    pub path: PathBuf,
+}
+
+/// Where check_mounts() learns which mounts exist
+pub trait MountSource {
+    fn mount_points(&self) -> io::Result<Vec<MountPoint>>;
+}
+
+/// The mount table of the running system
+pub struct SystemMounts;
+
+impl MountSource for SystemMounts {
+    fn mount_points(&self) -> io::Result<Vec<MountPoint>> {
+        get_mount_points()
+    }
+}
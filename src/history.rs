@@ -0,0 +1,579 @@
+// A record of every check on local disk
+//
+// After an incident the question is usually when a mount started to slow down
+// or fail, which the logs only answer for changes of state and the metrics
+// only at the resolution they were scraped. With --history-file PATH every
+// check result is also appended to a file of fixed-width records which is used
+// as a ring: once --history-size is reached the oldest records are
+// overwritten, so the file never grows. `mount_status_monitor history` reads
+// it back, filtered by mount and time.
+//
+// The file is an array of little-endian u64 words. The header is 8 words:
+//
+//   0  magic "MSMHST01"
+//   1  layout version (1)
+//   2  capacity in records
+//   3  number of records ever written; record N is in slot N % capacity
+//   4-7  reserved
+//
+// followed by records of 4 words:
+//
+//   0  N + 1, or 0 for a slot never written and u64::MAX while being written
+//   1  milliseconds since the epoch when the check finished
+//   2  FNV-1a hash of the mountpoint's path, as in the status table
+//   3  bits 0-31: check duration in microseconds, or 0xffffffff if no check
+//                 was started because an earlier one is still hung
+//      bits 32-39: state after the check, coded as in the status table
+//      bits 40-47: state before the check
+//
+// Records are written through a shared memory mapping, so appending one costs
+// a few memory writes, and a background thread flushes the file to disk every
+// SYNC_INTERVAL rather than after each record. The mapping survives the
+// monitor crashing, so only a crash of the whole machine can lose the most
+// recent records. A reader checks each record's number before and after
+// reading it so a record overwritten as it is read is skipped.
+//
+// Paths are only stored as hashes. Each one is written once to PATH.names,
+// one "HASH PATH" line per mount, which is compacted on startup once it grows
+// large.
+
+use std::collections::{HashMap, HashSet};
+use std::fs;
+use std::io::{self, BufRead, BufReader, Write};
+use std::mem;
+#[cfg(any(target_os = "linux", target_os = "freebsd"))]
+use std::os::unix::io::AsRawFd;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{fence, Ordering};
+use std::sync::Arc;
+use std::thread;
+use std::time::{Duration, SystemTime};
+
+use argparse::{ArgumentParser, Collect, Store, StoreOption, StoreTrue};
+use libc;
+
+use crate::errors::*;
+use crate::status_table::{epoch_millis, path_hash, state_code, state_name, Mapping};
+use crate::CheckOutcome;
+
+const MAGIC: u64 = 0x3130_5453_484d_534d; // "MSMHST01" read as little-endian
+const VERSION: u64 = 1;
+const HEADER_WORDS: usize = 8;
+const RECORD_WORDS: usize = 4;
+const MIN_RECORDS: u64 = 1024;
+
+const H_MAGIC: usize = 0;
+const H_VERSION: usize = 1;
+const H_CAPACITY: usize = 2;
+const H_NEXT: usize = 3;
+
+const R_NUMBER: usize = 0;
+const R_TIMESTAMP: usize = 1;
+const R_HASH: usize = 2;
+const R_RESULT: usize = 3;
+
+const WRITING: u64 = ::std::u64::MAX;
+const NO_CHECK: u64 = 0xffff_ffff;
+
+const SYNC_INTERVAL: Duration = Duration::from_secs(10);
+
+// The names file is rewritten on startup once it is larger than this:
+const MAX_NAMES_BYTES: u64 = 1 << 20;
+
+fn names_path(path: &Path) -> PathBuf {
+    let mut names_path = path.as_os_str().to_owned();
+    names_path.push(".names");
+    PathBuf::from(names_path)
+}
+
+// The file's size in words for a capacity:
+fn file_words(capacity: u64) -> usize {
+    HEADER_WORDS + capacity as usize * RECORD_WORDS
+}
+
+/// The monitor's side of the file
+pub struct History {
+    mapping: Arc<Mapping>,
+    capacity: u64,
+    next: u64,
+    names: fs::File,
+    // Mountpoints which are already in the names file:
+    named: HashSet<u64>,
+}
+
+impl History {
+    /// Open the file, continuing from where the last monitor stopped if it
+    /// has the same size
+    pub fn open(path: &Path, size_bytes: u64) -> Result<History> {
+        let capacity = ((size_bytes / mem::size_of::<u64>() as u64)
+            .saturating_sub(HEADER_WORDS as u64)
+            / RECORD_WORDS as u64)
+            .max(MIN_RECORDS);
+        let len = file_words(capacity);
+
+        let file = fs::OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .open(path)
+            .chain_err(|| format!("Unable to open history file {}", path.display()))?;
+        let existing_len = file
+            .metadata()
+            .chain_err(|| format!("Unable to stat {}", path.display()))?
+            .len();
+
+        let reusable = existing_len == (len * mem::size_of::<u64>()) as u64;
+        if !reusable {
+            file.set_len(0)
+                .and_then(|_| file.set_len((len * mem::size_of::<u64>()) as u64))
+                .chain_err(|| format!("Unable to size {}", path.display()))?;
+            // Allocating the blocks now means writing a record never has to
+            // wait for the filesystem to find space. Not every filesystem can,
+            // and macOS has no posix_fallocate(3) at all:
+            #[cfg(any(target_os = "linux", target_os = "freebsd"))]
+            unsafe {
+                libc::posix_fallocate(
+                    file.as_raw_fd(),
+                    0,
+                    (len * mem::size_of::<u64>()) as libc::off_t,
+                );
+            }
+        }
+        let mapping = Mapping::new(&file, len, true)
+            .chain_err(|| format!("Unable to map {}", path.display()))?;
+
+        let next = {
+            let header = mapping.words();
+            if reusable
+                && header[H_MAGIC].load(Ordering::Acquire) == MAGIC
+                && header[H_VERSION].load(Ordering::Relaxed) == VERSION
+                && header[H_CAPACITY].load(Ordering::Relaxed) == capacity
+            {
+                header[H_NEXT].load(Ordering::Relaxed)
+            } else {
+                for word in header {
+                    word.store(0, Ordering::Relaxed);
+                }
+                header[H_VERSION].store(VERSION, Ordering::Relaxed);
+                header[H_CAPACITY].store(capacity, Ordering::Relaxed);
+                header[H_MAGIC].store(MAGIC, Ordering::Release);
+                0
+            }
+        };
+
+        let (names, named) = open_names(&names_path(path), &mapping, capacity, next)?;
+
+        let mapping = Arc::new(mapping);
+        let sync_mapping = mapping.clone();
+        thread::Builder::new()
+            .name("history-sync".into())
+            .spawn(move || loop {
+                thread::sleep(SYNC_INTERVAL);
+                if let Err(e) = sync_mapping.sync() {
+                    warn!("Unable to write the check history to disk: {}", e);
+                }
+            })
+            .chain_err(|| "Unable to start the history sync thread")?;
+
+        Ok(History {
+            mapping,
+            capacity,
+            next,
+            names,
+            named,
+        })
+    }
+
+    /// Append a cycle's results
+    pub fn record(&mut self, outcomes: &[CheckOutcome]) {
+        let words = self.mapping.words();
+        for outcome in outcomes {
+            let hash = path_hash(&outcome.mount_point);
+            if self.named.insert(hash) {
+                let line = format!(
+                    "{:016x} {}\n",
+                    hash,
+                    outcome.mount_point.to_string_lossy().replace('\n', "\\n")
+                );
+                if let Err(e) = self.names.write_all(line.as_bytes()) {
+                    warn!("Unable to record the name of a mount in the history: {}", e);
+                }
+            }
+
+            let duration = match outcome.check_duration {
+                Some(d) => {
+                    (d.as_secs() * 1_000_000 + u64::from(d.subsec_micros())).min(NO_CHECK - 1)
+                }
+                None => NO_CHECK,
+            };
+            let result =
+                duration | state_code(outcome.current) << 32 | state_code(outcome.previous) << 40;
+
+            let base = HEADER_WORDS + (self.next % self.capacity) as usize * RECORD_WORDS;
+            words[base + R_NUMBER].store(WRITING, Ordering::Relaxed);
+            fence(Ordering::Release);
+            words[base + R_TIMESTAMP].store(epoch_millis(outcome.timestamp), Ordering::Relaxed);
+            words[base + R_HASH].store(hash, Ordering::Relaxed);
+            words[base + R_RESULT].store(result, Ordering::Relaxed);
+            words[base + R_NUMBER].store(self.next + 1, Ordering::Release);
+            self.next += 1;
+        }
+        words[H_NEXT].store(self.next, Ordering::Release);
+    }
+}
+
+// Read the names file, rewriting it with only the mounts still in the history
+// if it has grown large:
+fn open_names(
+    path: &Path,
+    mapping: &Mapping,
+    capacity: u64,
+    next: u64,
+) -> Result<(fs::File, HashSet<u64>)> {
+    let names = read_names(path);
+    let size = fs::metadata(path).map(|m| m.len()).unwrap_or(0);
+    let mut named: HashSet<u64> = names.keys().cloned().collect();
+
+    if size > MAX_NAMES_BYTES {
+        let mut referenced = HashSet::new();
+        for number in next.saturating_sub(capacity)..next {
+            if let Some(record) = read_record(mapping.words(), capacity, number) {
+                referenced.insert(record.hash);
+            }
+        }
+        let mut temporary_path = path.as_os_str().to_owned();
+        temporary_path.push(".tmp");
+        let mut contents = String::new();
+        for (hash, name) in &names {
+            if referenced.contains(hash) {
+                contents.push_str(&format!("{:016x} {}\n", hash, name));
+            }
+        }
+        fs::write(&temporary_path, contents)
+            .and_then(|_| fs::rename(&temporary_path, path))
+            .chain_err(|| format!("Unable to compact {}", path.display()))?;
+        named = referenced;
+    }
+
+    let file = fs::OpenOptions::new()
+        .append(true)
+        .create(true)
+        .open(path)
+        .chain_err(|| format!("Unable to open {}", path.display()))?;
+    Ok((file, named))
+}
+
+fn read_names(path: &Path) -> HashMap<u64, String> {
+    let mut names = HashMap::new();
+    if let Ok(file) = fs::File::open(path) {
+        for line in BufReader::new(file).lines() {
+            let line = match line {
+                Ok(line) => line,
+                Err(_) => break,
+            };
+            let mut fields = line.splitn(2, ' ');
+            if let (Some(hash), Some(name)) = (fields.next(), fields.next()) {
+                if let Ok(hash) = u64::from_str_radix(hash, 16) {
+                    names.insert(hash, name.to_owned());
+                }
+            }
+        }
+    }
+    names
+}
+
+/// A single check read back from the file
+#[derive(Clone, Copy, Debug)]
+pub struct Record {
+    // Milliseconds since the epoch:
+    pub timestamp: u64,
+    pub hash: u64,
+    // None if no new check was started:
+    pub duration_us: Option<u64>,
+    pub state: u64,
+    pub previous: u64,
+}
+
+// Read record number N, if it is still in the file:
+fn read_record(
+    words: &[::std::sync::atomic::AtomicU64],
+    capacity: u64,
+    number: u64,
+) -> Option<Record> {
+    let base = HEADER_WORDS + (number % capacity) as usize * RECORD_WORDS;
+    if words[base + R_NUMBER].load(Ordering::Acquire) != number + 1 {
+        return None;
+    }
+    let timestamp = words[base + R_TIMESTAMP].load(Ordering::Relaxed);
+    let hash = words[base + R_HASH].load(Ordering::Relaxed);
+    let result = words[base + R_RESULT].load(Ordering::Relaxed);
+    fence(Ordering::Acquire);
+    if words[base + R_NUMBER].load(Ordering::Relaxed) != number + 1 {
+        return None;
+    }
+    let duration = result & NO_CHECK;
+    Some(Record {
+        timestamp,
+        hash,
+        duration_us: if duration == NO_CHECK {
+            None
+        } else {
+            Some(duration)
+        },
+        state: (result >> 32) & 0xff,
+        previous: (result >> 40) & 0xff,
+    })
+}
+
+/// A history file opened for reading, while the monitor may still be writing
+pub struct Reader {
+    mapping: Mapping,
+    capacity: u64,
+    names: HashMap<u64, String>,
+}
+
+impl Reader {
+    pub fn open(path: &Path) -> Result<Reader> {
+        let handle =
+            fs::File::open(path).chain_err(|| format!("Unable to open {}", path.display()))?;
+        let len = handle
+            .metadata()
+            .chain_err(|| format!("Unable to stat {}", path.display()))?
+            .len() as usize
+            / mem::size_of::<u64>();
+        if len < HEADER_WORDS {
+            return Err(format!("{} is not a check history file", path.display()).into());
+        }
+        let mapping = Mapping::new(&handle, len, false)
+            .chain_err(|| format!("Unable to map {}", path.display()))?;
+        let capacity = {
+            let words = mapping.words();
+            let capacity = words[H_CAPACITY].load(Ordering::Relaxed);
+            if words[H_MAGIC].load(Ordering::Acquire) != MAGIC
+                || words[H_VERSION].load(Ordering::Relaxed) != VERSION
+                || capacity == 0
+                || file_words(capacity) > len
+            {
+                return Err(format!(
+                    "{} is not a version {} check history file",
+                    path.display(),
+                    VERSION
+                )
+                .into());
+            }
+            capacity
+        };
+        Ok(Reader {
+            mapping,
+            capacity,
+            names: read_names(&names_path(path)),
+        })
+    }
+
+    /// The hashes of the mounts at or below any of the paths, or None to
+    /// select everything if there are none
+    pub fn select(&self, mounts: &[String]) -> Option<HashSet<u64>> {
+        // Mounts are matched by name, so those without one can't be selected:
+        if mounts.is_empty() {
+            return None;
+        }
+        Some(
+            self.names
+                .iter()
+                .filter(|&(_, name)| {
+                    mounts
+                        .iter()
+                        .any(|mount| Path::new(name).starts_with(mount))
+                })
+                .map(|(&hash, _)| hash)
+                .collect(),
+        )
+    }
+
+    pub fn name(&self, hash: u64) -> String {
+        self.names
+            .get(&hash)
+            .cloned()
+            .unwrap_or_else(|| format!("#{:016x}", hash))
+    }
+
+    /// The records from a time in milliseconds since the epoch onwards, in
+    /// the order they were written
+    pub fn records_since<'a>(&'a self, since: u64) -> impl Iterator<Item = Record> + 'a {
+        let words = self.mapping.words();
+        let capacity = self.capacity;
+        // Records are in the order they were written, so the first one in
+        // range can be found by bisection. Records being overwritten sort first:
+        let next = words[H_NEXT].load(Ordering::Acquire);
+        let (mut low, mut high) = (next.saturating_sub(capacity), next);
+        while low < high {
+            let middle = low + (high - low) / 2;
+            match read_record(words, capacity, middle) {
+                Some(record) if record.timestamp >= since => high = middle,
+                _ => low = middle + 1,
+            }
+        }
+        (low..next).filter_map(move |number| read_record(words, capacity, number))
+    }
+}
+
+/// The history subcommand
+pub fn run(args: Vec<String>) -> Result<()> {
+    let mut file = "/var/lib/mount_status_monitor/history".to_owned();
+    let mut mounts: Vec<String> = Vec::new();
+    let mut since: Option<String> = None;
+    let mut until: Option<String> = None;
+    let mut slower_than: Option<f64> = None;
+    let mut changes_only = false;
+
+    {
+        let mut ap = ArgumentParser::new();
+        ap.set_description(
+            "Show the results of past checks recorded by the monitor's --history-file",
+        );
+
+        ap.refer(&mut file)
+            .add_option(&["--file"], Store, "The monitor's --history-file");
+
+        ap.refer(&mut mounts).add_option(
+            &["--mount"],
+            Collect,
+            "Only show mounts at or below this path (may be repeated)",
+        );
+
+        ap.refer(&mut since).add_option(
+            &["--since"],
+            StoreOption,
+            "Only show checks from this time on: seconds since the epoch, or how long ago such as 90s, 15m, 6h or 2d",
+        );
+
+        ap.refer(&mut until).add_option(
+            &["--until"],
+            StoreOption,
+            "Only show checks up to this time, in the same form as --since",
+        );
+
+        ap.refer(&mut slower_than).add_option(
+            &["--slower-than"],
+            StoreOption,
+            "Only show checks which took longer than this many seconds or were still hung",
+        );
+
+        ap.refer(&mut changes_only).add_option(
+            &["--changes"],
+            StoreTrue,
+            "Only show checks which changed the state of their mount",
+        );
+
+        let mut args = args;
+        args[0] = "mount_status_monitor history".to_owned();
+        if let Err(rc) = ap.parse(args, &mut io::stdout(), &mut io::stderr()) {
+            ::std::process::exit(rc);
+        }
+    }
+
+    let now = SystemTime::now();
+    let since = match since {
+        Some(ref since) => parse_time(since, now)?,
+        None => 0,
+    };
+    let until = match until {
+        Some(ref until) => parse_time(until, now)?,
+        None => ::std::u64::MAX,
+    };
+    let slower_than_us = slower_than.map(|seconds| (seconds * 1e6) as u64);
+
+    let reader = Reader::open(Path::new(&file))?;
+    let selected = reader.select(&mounts);
+
+    let stdout = io::stdout();
+    let mut output = io::BufWriter::new(stdout.lock());
+    for record in reader.records_since(since) {
+        if record.timestamp > until {
+            break;
+        }
+        if let Some(ref selected) = selected {
+            if !selected.contains(&record.hash) {
+                continue;
+            }
+        }
+        if changes_only && record.state == record.previous {
+            continue;
+        }
+        if let Some(slower_than_us) = slower_than_us {
+            if record.duration_us.map_or(false, |us| us <= slower_than_us) {
+                continue;
+            }
+        }
+
+        let name = reader.name(record.hash);
+        let duration = match record.duration_us {
+            Some(us) => format!("{}.{:06}", us / 1_000_000, us % 1_000_000),
+            None => "-".to_owned(),
+        };
+        let mut line = format!(
+            "{}\t{}\t{}\t{}",
+            format_timestamp(record.timestamp),
+            name,
+            state_name(record.state),
+            duration
+        );
+        if record.state != record.previous {
+            line.push_str(&format!("\twas {}", state_name(record.previous)));
+        }
+        if writeln!(output, "{}", line).is_err() {
+            // Most likely a closed pipe, e.g. from head:
+            return Ok(());
+        }
+    }
+    Ok(())
+}
+
+// Seconds since the epoch, or a duration before now such as 15m, in
+// milliseconds since the epoch:
+pub fn parse_time(value: &str, now: SystemTime) -> Result<u64> {
+    let invalid = || -> Error { format!("Invalid time {:?}", value).into() };
+    let unit = match value.chars().last() {
+        Some('s') => 1,
+        Some('m') => 60,
+        Some('h') => 3600,
+        Some('d') => 86400,
+        _ => {
+            let seconds: f64 = value.parse().map_err(|_| invalid())?;
+            return Ok((seconds * 1000.0) as u64);
+        }
+    };
+    let amount: f64 = value[..value.len() - 1].parse().map_err(|_| invalid())?;
+    Ok(epoch_millis(now).saturating_sub((amount * unit as f64 * 1000.0) as u64))
+}
+
+// An ISO 8601 time in UTC, converted from the day count with the civil
+// calendar algorithm since we have no date library:
+fn format_timestamp(millis: u64) -> String {
+    let seconds = millis / 1000;
+    let days = (seconds / 86400) as i64 + 719_468;
+    let era = days.div_euclid(146_097);
+    let day_of_era = days - era * 146_097;
+    let year_of_era =
+        (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146_096) / 365;
+    let day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    let shifted_month = (5 * day_of_year + 2) / 153;
+    let day = day_of_year - (153 * shifted_month + 2) / 5 + 1;
+    let month = if shifted_month < 10 {
+        shifted_month + 3
+    } else {
+        shifted_month - 9
+    };
+    let year = year_of_era + era * 400 + if month <= 2 { 1 } else { 0 };
+
+    format!(
+        "{:04}-{:02}-{:02}T{:02}:{:02}:{:02}.{:03}Z",
+        year,
+        month,
+        day,
+        seconds % 86400 / 3600,
+        seconds % 3600 / 60,
+        seconds % 60,
+        millis % 1000
+    )
+}
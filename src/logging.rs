@@ -0,0 +1,282 @@
+// Syslog setup which can never stall the mount checks
+//
+// Sending to /dev/log blocks when the syslog daemon falls behind, and that
+// happens most often during the very storage incidents we're trying to
+// report. Log records are therefore formatted by the caller and handed to a
+// dedicated writer thread through a bounded channel (std's sync_channel).
+// Its sender is kept behind a mutex, since SyncSender is not Sync on older
+// compilers, but the lock is only held for a non-blocking try_send(). If the
+// queue is full the record is dropped and counted instead of waiting. The
+// writer reconnects to syslog whenever a send fails, and reports how many
+// records were lost once it is able to write again.
+//
+// A widespread storage failure is also when syslog is least able to cope with
+// a flood of messages, so everything we log first passes through a token
+// bucket: up to --log-rate-limit lines per second on average with short bursts
+// allowed. Lines over the limit are counted and summarised in a single
+// warning once the bucket refills.
+
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::mpsc;
+use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use log;
+use syslog;
+
+use crate::errors::*;
+use crate::stats::seconds;
+
+// How many seconds' worth of lines may be sent in a single burst:
+const BURST_SECONDS: f64 = 5.0;
+
+// How long to wait between attempts to reconnect to syslog:
+const RECONNECT_INTERVAL: Duration = Duration::from_secs(1);
+
+// How long flush() will wait for queued records to be written:
+const FLUSH_TIMEOUT: Duration = Duration::from_secs(2);
+
+static DROPPED_RECORDS: AtomicUsize = AtomicUsize::new(0);
+
+/// The number of records which could not be sent to syslog
+pub fn dropped_records() -> usize {
+    DROPPED_RECORDS.load(Ordering::Relaxed)
+}
+
+pub fn init(level: log::LevelFilter, lines_per_second: u32, queue_size: usize) -> Result<()> {
+    let logger = AsyncSyslogLogger::start(queue_size)?;
+
+    log::set_boxed_logger(Box::new(RateLimitedLogger::new(logger, lines_per_second)))
+        .chain_err(|| "Unable to install the syslog logger")?;
+    log::set_max_level(level);
+
+    Ok(())
+}
+
+type SyslogWriter = syslog::Logger<syslog::LoggerBackend, syslog::Formatter3164>;
+
+fn connect() -> syslog::Result<SyslogWriter> {
+    syslog::unix(syslog::Formatter3164 {
+        facility: syslog::Facility::LOG_USER,
+        hostname: None,
+        process: env!("CARGO_PKG_NAME").to_owned(),
+        pid: std::process::id() as i32,
+    })
+}
+
+pub struct AsyncSyslogLogger {
+    sender: Mutex<mpsc::SyncSender<(log::Level, String)>>,
+    // Records which have been queued but not yet written:
+    pending: Arc<AtomicUsize>,
+}
+
+impl AsyncSyslogLogger {
+    pub fn start(queue_size: usize) -> Result<AsyncSyslogLogger> {
+        // We try to connect immediately so a misconfigured host is obvious
+        // but a syslog daemon which is merely down shouldn't stop us starting:
+        let writer = match connect() {
+            Ok(writer) => Some(writer),
+            Err(e) => {
+                eprintln!("Unable to connect to syslog (will keep retrying): {}", e);
+                None
+            }
+        };
+
+        let (sender, receiver) = mpsc::sync_channel(queue_size);
+        let pending = Arc::new(AtomicUsize::new(0));
+        let writer_pending = pending.clone();
+
+        thread::Builder::new()
+            .name("syslog-writer".into())
+            .spawn(move || run_writer(writer, &receiver, &writer_pending))
+            .chain_err(|| "Unable to start the syslog writer thread")?;
+
+        Ok(AsyncSyslogLogger {
+            sender: Mutex::new(sender),
+            pending,
+        })
+    }
+}
+
+impl log::Log for AsyncSyslogLogger {
+    fn enabled(&self, metadata: &log::Metadata) -> bool {
+        metadata.level() <= log::max_level()
+    }
+
+    fn log(&self, record: &log::Record) {
+        let message = format!("{}", record.args());
+
+        // SyncSender is only Sync on recent compilers. The lock is never held
+        // for longer than the try_send(), which does not block:
+        self.pending.fetch_add(1, Ordering::SeqCst);
+        let queued = self
+            .sender
+            .lock()
+            .unwrap()
+            .try_send((record.level(), message));
+        if queued.is_err() {
+            self.pending.fetch_sub(1, Ordering::SeqCst);
+            DROPPED_RECORDS.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    fn flush(&self) {
+        let deadline = Instant::now() + FLUSH_TIMEOUT;
+        while self.pending.load(Ordering::SeqCst) > 0 && Instant::now() < deadline {
+            thread::sleep(Duration::from_millis(10));
+        }
+    }
+}
+
+fn run_writer(
+    mut writer: Option<SyslogWriter>,
+    receiver: &mpsc::Receiver<(log::Level, String)>,
+    pending: &AtomicUsize,
+) {
+    let mut next_connect_attempt = Instant::now();
+    let mut reported_drops = 0;
+
+    for (level, message) in receiver.iter() {
+        if writer.is_none() && Instant::now() >= next_connect_attempt {
+            writer = connect().ok();
+            next_connect_attempt = Instant::now() + RECONNECT_INTERVAL;
+        }
+
+        let sent = match writer {
+            Some(ref mut writer) => {
+                let dropped = DROPPED_RECORDS.load(Ordering::Relaxed);
+                if dropped > reported_drops {
+                    let _ = writer.warning(format!(
+                        "Dropped {} log messages because syslog was unavailable or not keeping up",
+                        dropped - reported_drops
+                    ));
+                    reported_drops = dropped;
+                }
+
+                match level {
+                    log::Level::Error => writer.err(message),
+                    log::Level::Warn => writer.warning(message),
+                    log::Level::Info => writer.info(message),
+                    log::Level::Debug | log::Level::Trace => writer.debug(message),
+                }
+                .is_ok()
+            }
+            None => false,
+        };
+
+        if !sent {
+            // The socket may have been closed by a restarted syslog daemon so
+            // we'll reconnect for the next record:
+            writer = None;
+            DROPPED_RECORDS.fetch_add(1, Ordering::Relaxed);
+        }
+
+        pending.fetch_sub(1, Ordering::SeqCst);
+    }
+}
+
+/// Allows lines_per_second on average, with bursts of BURST_SECONDS' worth
+pub struct TokenBucket {
+    rate: f64,
+    capacity: f64,
+    tokens: f64,
+    last_refill: Instant,
+    // Lines refused since the last call to take_suppressed:
+    suppressed: u64,
+}
+
+impl TokenBucket {
+    pub fn new(lines_per_second: u32, now: Instant) -> TokenBucket {
+        let rate = f64::from(lines_per_second);
+        TokenBucket {
+            rate,
+            capacity: rate * BURST_SECONDS,
+            tokens: rate * BURST_SECONDS,
+            last_refill: now,
+            suppressed: 0,
+        }
+    }
+
+    pub fn try_take(&mut self, now: Instant) -> bool {
+        let elapsed = seconds(now.duration_since(self.last_refill));
+        self.tokens = (self.tokens + elapsed * self.rate).min(self.capacity);
+        self.last_refill = now;
+
+        if self.tokens >= 1.0 {
+            self.tokens -= 1.0;
+            true
+        } else {
+            self.suppressed += 1;
+            false
+        }
+    }
+
+    /// The number of lines refused since the last call
+    pub fn take_suppressed(&mut self) -> u64 {
+        std::mem::replace(&mut self.suppressed, 0)
+    }
+}
+
+pub struct RateLimitedLogger<L: log::Log> {
+    inner: L,
+    // None when rate limiting is disabled:
+    bucket: Option<Mutex<TokenBucket>>,
+}
+
+impl<L: log::Log> RateLimitedLogger<L> {
+    pub fn new(inner: L, lines_per_second: u32) -> RateLimitedLogger<L> {
+        RateLimitedLogger {
+            inner,
+            bucket: if lines_per_second > 0 {
+                Some(Mutex::new(TokenBucket::new(
+                    lines_per_second,
+                    Instant::now(),
+                )))
+            } else {
+                None
+            },
+        }
+    }
+}
+
+impl<L: log::Log> log::Log for RateLimitedLogger<L> {
+    fn enabled(&self, metadata: &log::Metadata) -> bool {
+        self.inner.enabled(metadata)
+    }
+
+    fn log(&self, record: &log::Record) {
+        if !self.enabled(record.metadata()) {
+            return;
+        }
+
+        if let Some(ref bucket) = self.bucket {
+            let suppressed = {
+                let mut bucket = bucket.lock().unwrap();
+                if !bucket.try_take(Instant::now()) {
+                    return;
+                }
+                bucket.take_suppressed()
+            };
+
+            if suppressed > 0 {
+                self.inner.log(
+                    &log::Record::builder()
+                        .level(log::Level::Warn)
+                        .target(record.target())
+                        .args(format_args!(
+                            "Suppressed {} log messages which exceeded the rate limit",
+                            suppressed
+                        ))
+                        .build(),
+                );
+            }
+        }
+
+        self.inner.log(record);
+    }
+
+    fn flush(&self) {
+        self.inner.flush()
+    }
+}
@@ -36,7 +36,6 @@ extern crate error_chain;
 #[cfg(feature = "with_prometheus")]
 extern crate hostname;
 
-#[cfg(feature = "with_prometheus")]
 #[macro_use]
 extern crate lazy_static;
 
@@ -44,21 +43,53 @@ extern crate lazy_static;
 #[macro_use]
 extern crate prometheus;
 
-use std::collections::HashMap;
+use std::collections::hash_map::Entry;
+use std::collections::{HashMap, HashSet};
 use std::path::{Path, PathBuf};
 use std::process;
 use std::str;
-use std::thread;
-use std::time::{Duration, Instant};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant, SystemTime};
 
-use argparse::{ArgumentParser, Print, Store, StoreOption, StoreTrue};
+use argparse::{ArgumentParser, Collect, Print, Store, StoreOption, StoreTrue};
 use rayon::prelude::*;
-use wait_timeout::ChildExt;
 
+mod benchmark;
+mod clock;
+mod config;
+mod control;
 mod errors;
+mod events;
 mod get_mounts;
+mod history;
+mod logging;
+#[cfg(feature = "with_prometheus")]
+mod metrics;
+mod microbench;
+mod namespaces;
+mod plugin;
+mod probe;
+#[cfg(feature = "with_prometheus")]
+mod push;
+mod replay;
+mod scale_test;
+mod schedule;
+mod signals;
+mod simulator;
+mod snapshot;
+mod state_file;
+mod statfs;
+mod stats;
+mod status_table;
+#[cfg(feature = "with_prometheus")]
+mod textfile;
+mod top;
+mod transitions;
+mod windows;
 
 use crate::errors::*;
+use crate::get_mounts::{MountPoint, MountSource};
 
 #[derive(Debug)]
 enum MountStatus {
@@ -66,7 +97,7 @@ enum MountStatus {
     CheckFailed(i32),
     CheckSignaled(i32),
     CheckRunning {
-        process: process::Child,
+        process: Box<dyn probe::PendingCheck>,
         start_time: Instant,
     },
 }
@@ -79,22 +110,208 @@ impl MountStatus {
             false
         }
     }
+
+    fn kind(&self) -> StatusKind {
+        match *self {
+            MountStatus::Alive => StatusKind::Alive,
+            MountStatus::CheckFailed(_) => StatusKind::Failed,
+            MountStatus::CheckSignaled(_) => StatusKind::Signaled,
+            MountStatus::CheckRunning { .. } => StatusKind::Hung,
+        }
+    }
+}
+
+// A MountStatus without the associated data, for reporting state changes:
+#[derive(Clone, Copy, Debug, PartialEq)]
+enum StatusKind {
+    Alive,
+    Failed,
+    Signaled,
+    Hung,
+}
+
+impl StatusKind {
+    fn name(&self) -> &'static str {
+        match *self {
+            StatusKind::Alive => "alive",
+            StatusKind::Failed => "failed",
+            StatusKind::Signaled => "signaled",
+            StatusKind::Hung => "hung",
+        }
+    }
+}
+
+// What happened to a single mount during a call to check_mounts():
+#[derive(Clone, Debug)]
+struct CheckOutcome {
+    mount_point: PathBuf,
+    fs_type: String,
+    source: String,
+    previous: StatusKind,
+    current: StatusKind,
+    // None if no new check was started because an earlier one is still running:
+    check_duration: Option<Duration>,
+    timestamp: SystemTime,
+}
+
+impl CheckOutcome {
+    fn new(
+        mount_point: &Path,
+        mount_state: &MountState,
+        previous: StatusKind,
+        check_duration: Option<Duration>,
+        timestamp: SystemTime,
+    ) -> CheckOutcome {
+        CheckOutcome {
+            mount_point: mount_point.to_owned(),
+            fs_type: mount_state.fs_type.clone(),
+            source: mount_state.source.clone(),
+            previous,
+            current: mount_state.status.kind(),
+            check_duration,
+            timestamp,
+        }
+    }
+}
+
+#[derive(Debug)]
+struct MountState {
+    fs_type: String,
+    source: String,
+    status: MountStatus,
+    last_success: Option<SystemTime>,
+    last_check_duration: Option<Duration>,
+    filesystem_stats: Option<statfs::FilesystemStats>,
+    namespace: Option<get_mounts::NamespacedPath>,
+    // What readers outside the check loop see; see snapshot.rs:
+    view: snapshot::MountSlot,
+    windows: Option<Box<windows::MountWindows>>,
+}
+
+impl MountState {
+    fn new(
+        fs_type: String,
+        source: String,
+        namespace: Option<get_mounts::NamespacedPath>,
+    ) -> MountState {
+        MountState {
+            fs_type,
+            source,
+            namespace,
+            status: MountStatus::Alive,
+            last_success: None,
+            last_check_duration: None,
+            filesystem_stats: None,
+            view: Arc::new(snapshot::Published::new(None)),
+            windows: None,
+        }
+    }
 }
 
 quick_main! { real_main }
 
 fn real_main() -> Result<()> {
+    // When capacity collection is enabled the check is a copy of ourselves:
+    {
+        let args: Vec<_> = std::env::args_os().take(6).collect();
+        if args.len() == 3 && args[1] == statfs::PROBE_ARGUMENT {
+            process::exit(statfs::run_probe(Path::new(&args[2])));
+        }
+        if args.len() > 1 && args[1] == namespaces::PROBE_ARGUMENT {
+            process::exit(namespaces::run_probe(&args[2..]));
+        }
+    }
+
+    // Subcommands are dispatched before the daemon's own options are parsed:
+    if let Some(subcommand) = std::env::args_os().nth(1) {
+        if subcommand == "benchmark" {
+            return benchmark::run(std::env::args().skip(1).collect());
+        } else if subcommand == "check" {
+            return plugin::run(std::env::args().skip(1).collect());
+        } else if subcommand == "history" {
+            return history::run(std::env::args().skip(1).collect());
+        } else if subcommand == "lookup" {
+            return status_table::run(std::env::args().skip(1).collect());
+        } else if subcommand == "microbench" {
+            return microbench::run(std::env::args().skip(1).collect());
+        } else if subcommand == "replay" {
+            return replay::run(std::env::args().skip(1).collect());
+        } else if subcommand == "scale-test" {
+            return scale_test::run(std::env::args().skip(1).collect());
+        } else if subcommand == "simulate" {
+            return simulator::run(std::env::args().skip(1).collect());
+        } else if subcommand == "top" {
+            return top::run(std::env::args().skip(1).collect());
+        }
+    }
+
     struct Options {
+        config: Option<PathBuf>,
         once_only: bool,
         poll_interval: u64,
+        overrun_policy: schedule::OverrunPolicy,
+        check_timeout: u64,
+        exclude_fstypes: Vec<String>,
+        exclude_mounts: Vec<String>,
         prometheus_push_gateway: Option<String>,
+        textfile_output: Option<PathBuf>,
+        push_timeout: u64,
+        push_max_retry_interval: u64,
+        mount_labels: String,
+        ephemeral_mount_prefixes: Vec<String>,
+        max_mount_series: usize,
         print_bad_mounts: bool,
+        collect_statfs: bool,
+        mount_namespaces: bool,
+        concurrency: usize,
+        control_socket: Option<PathBuf>,
+        control_socket_group: Option<String>,
+        status_table: Option<PathBuf>,
+        availability_windows: bool,
+        history_file: Option<PathBuf>,
+        history_size: u64,
+        state_file: Option<PathBuf>,
+        event_sinks: Vec<String>,
+        event_queue_depth: usize,
+        log_level: log::LevelFilter,
+        log_rate_limit: u32,
+        log_reminder_interval: u64,
+        log_queue_size: usize,
+        stats: bool,
     }
     let mut options = Options {
+        config: None,
         once_only: false,
         poll_interval: 60,
+        overrun_policy: schedule::OverrunPolicy::Skip,
+        check_timeout: probe::CHECK_TIMEOUT.as_secs(),
+        exclude_fstypes: Vec::new(),
+        exclude_mounts: Vec::new(),
         prometheus_push_gateway: None,
+        textfile_output: None,
+        push_timeout: 10,
+        push_max_retry_interval: 300,
+        mount_labels: "mountpoint,fstype,source".to_owned(),
+        ephemeral_mount_prefixes: Vec::new(),
+        max_mount_series: 500,
         print_bad_mounts: false,
+        collect_statfs: false,
+        mount_namespaces: false,
+        concurrency: 0,
+        control_socket: None,
+        control_socket_group: None,
+        status_table: None,
+        availability_windows: false,
+        history_file: None,
+        history_size: 64,
+        state_file: None,
+        event_sinks: Vec::new(),
+        event_queue_depth: 16,
+        log_level: log::LevelFilter::Info,
+        log_rate_limit: 20,
+        log_reminder_interval: 3600,
+        log_queue_size: 1024,
+        stats: false,
     };
 
     {
@@ -112,12 +329,54 @@ fn real_main() -> Result<()> {
             "Show version",
         );
 
+        ap.refer(&mut options.config).add_option(
+            &["--config"],
+            StoreOption,
+            "Read the settings which can be changed without a restart from this file, and read it again on SIGHUP",
+        );
+
         if cfg!(feature = "with_prometheus") {
             ap.refer(&mut options.prometheus_push_gateway).add_option(
                 &["--prometheus-push-gateway"],
                 StoreOption,
                 "Location of the Prometheus push-gateway server to send metrics to",
             );
+
+            ap.refer(&mut options.textfile_output).add_option(
+                &["--textfile-output"],
+                StoreOption,
+                "Write metrics to this .prom file for the node_exporter textfile collector",
+            );
+
+            ap.refer(&mut options.push_timeout).add_option(
+                &["--push-timeout"],
+                Store,
+                "Number of seconds to allow each push-gateway request before giving up",
+            );
+
+            ap.refer(&mut options.push_max_retry_interval).add_option(
+                &["--push-max-retry-interval"],
+                Store,
+                "Maximum number of seconds to wait between retries of a failed push",
+            );
+
+            ap.refer(&mut options.mount_labels).add_option(
+                &["--mount-labels"],
+                Store,
+                "Comma-separated labels to attach to per-mount metrics (mountpoint, fstype, source) or an empty string to disable them",
+            );
+
+            ap.refer(&mut options.ephemeral_mount_prefixes).add_option(
+                &["--ephemeral-mount-prefix"],
+                Collect,
+                "Report mounts below this directory as a single group (may be repeated; replaces the default container runtime directories)",
+            );
+
+            ap.refer(&mut options.max_mount_series).add_option(
+                &["--max-mount-series"],
+                Store,
+                "Maximum number of per-mount metric series to export",
+            );
         }
 
         ap.refer(&mut options.poll_interval).add_option(
@@ -126,6 +385,30 @@ fn real_main() -> Result<()> {
             "Number of seconds to wait before checking mounts",
         );
 
+        ap.refer(&mut options.overrun_policy).add_option(
+            &["--overrun-policy"],
+            Store,
+            "What to do with cycles missed while a slow cycle overran the poll interval: skip or queue (run them back-to-back)",
+        );
+
+        ap.refer(&mut options.check_timeout).add_option(
+            &["--check-timeout"],
+            Store,
+            "Number of seconds a check may take before the mount is considered hung",
+        );
+
+        ap.refer(&mut options.exclude_fstypes).add_option(
+            &["--exclude-fstype"],
+            Collect,
+            "Do not check mounts of this filesystem type (may be repeated)",
+        );
+
+        ap.refer(&mut options.exclude_mounts).add_option(
+            &["--exclude-mount"],
+            Collect,
+            "Do not check mounts at or below this path (may be repeated)",
+        );
+
         ap.refer(&mut options.once_only).add_option(
             &["-1", "--once-only"],
             StoreTrue,
@@ -138,107 +421,548 @@ fn real_main() -> Result<()> {
             "Print bad mounts on standard output",
         );
 
+        ap.refer(&mut options.collect_statfs).add_option(
+            &["--collect-statfs"],
+            StoreTrue,
+            "Collect filesystem capacity and inode usage as part of each check",
+        );
+
+        if cfg!(target_os = "linux") {
+            ap.refer(&mut options.mount_namespaces).add_option(
+                &["--mount-namespaces"],
+                StoreTrue,
+                "Also check mounts which only exist in other mount namespaces, such as those of containers",
+            );
+        }
+
+        ap.refer(&mut options.concurrency).add_option(
+            &["--concurrency"],
+            Store,
+            "Number of mounts to check in parallel (0 for one per CPU; see the benchmark subcommand)",
+        );
+
+        ap.refer(&mut options.control_socket).add_option(
+            &["--control-socket"],
+            StoreOption,
+            "Serve mount status and accept recheck requests on this Unix domain socket",
+        );
+
+        ap.refer(&mut options.control_socket_group).add_option(
+            &["--control-socket-group"],
+            StoreOption,
+            "Also allow members of this group to use the control socket, which is otherwise only usable by our own user",
+        );
+
+        ap.refer(&mut options.status_table).add_option(
+            &["--status-table"],
+            StoreOption,
+            "Publish mount states in this memory-mapped file for the lookup subcommand and other readers",
+        );
+
+        ap.refer(&mut options.availability_windows).add_option(
+            &["--availability-windows"],
+            StoreTrue,
+            "Keep each mount's availability and check duration percentiles over the last 5 minutes, hour and day",
+        );
+
+        ap.refer(&mut options.history_file).add_option(
+            &["--history-file"],
+            StoreOption,
+            "Record the result of every check in this file on local disk for the history subcommand",
+        );
+
+        ap.refer(&mut options.history_size).add_option(
+            &["--history-size"],
+            Store,
+            "Size of the history file in MiB, after which the oldest checks are overwritten",
+        );
+
+        ap.refer(&mut options.state_file).add_option(
+            &["--state-file"],
+            StoreOption,
+            "Save the state of each mount in this file and resume from it after a restart, adopting checks which are still hung",
+        );
+
+        ap.refer(&mut options.event_sinks).add_option(
+            &["--event-sink"],
+            Collect,
+            "Send check results and state changes to json:FILE, statsd:HOST:PORT or influx:HOST:PORT (may be repeated)",
+        );
+
+        ap.refer(&mut options.event_queue_depth).add_option(
+            &["--event-queue-depth"],
+            Store,
+            "Number of cycles of events to buffer before dropping them",
+        );
+
+        ap.refer(&mut options.log_level).add_option(
+            &["--log-level"],
+            Store,
+            "Minimum level of messages sent to syslog (error, warn, info, debug or trace)",
+        );
+
+        ap.refer(&mut options.log_rate_limit).add_option(
+            &["--log-rate-limit"],
+            Store,
+            "Maximum average number of lines per second sent to syslog (0 for no limit)",
+        );
+
+        ap.refer(&mut options.log_reminder_interval).add_option(
+            &["--log-reminder-interval"],
+            Store,
+            "Number of seconds between summaries of mounts which are still failing",
+        );
+
+        ap.refer(&mut options.log_queue_size).add_option(
+            &["--log-queue-size"],
+            Store,
+            "Number of log messages to buffer while syslog is slow before dropping them",
+        );
+
+        ap.refer(&mut options.stats).add_option(
+            &["--stats"],
+            StoreTrue,
+            "Print timings and resource usage of the monitor itself on standard error when sent SIGUSR1",
+        );
+
         ap.parse_args_or_exit();
     }
 
-    let poll_interval_duration = Duration::from_secs(options.poll_interval);
+    // The command line supplies anything the config file leaves out:
+    let default_policy = config::Policy {
+        poll_interval: options.poll_interval,
+        overrun_policy: options.overrun_policy,
+        check_timeout: options.check_timeout.max(1),
+        exclude_fstypes: options.exclude_fstypes.clone(),
+        exclude_mounts: options.exclude_mounts.clone(),
+        event_sinks: options.event_sinks.clone(),
+        print_bad_mounts: options.print_bad_mounts,
+        log_level: options.log_level,
+        log_reminder_interval: options.log_reminder_interval,
+    };
+    let mut policy = match options.config {
+        Some(ref path) => config::Policy::load(path, &default_policy)?,
+        None => default_policy.clone(),
+    };
 
     if !options.once_only {
         println!(
             "mount_status_monitor checking mounts every {} seconds",
-            poll_interval_duration.as_secs()
+            policy.poll_interval
         );
     }
 
-    syslog::init_unix(syslog::Facility::LOG_USER, log::LevelFilter::Debug)
-        .chain_err(|| "Unable to connect to syslog")?;
+    // Both SIGHUP and the control socket release the next cycle early:
+    let wakeup = Arc::new(schedule::Wakeup::default());
+    let reload_requested = Arc::new(AtomicBool::new(false));
 
-    let mut mount_statuses = HashMap::<PathBuf, MountStatus>::new();
+    // This has to happen before any other threads are started:
+    let mut signal_handlers: Vec<(libc::c_int, signals::Handler)> = Vec::new();
+    if options.stats {
+        signal_handlers.push((libc::SIGUSR1, Box::new(|| eprint!("{}", stats::dump()))));
+    }
+    // SIGHUP is always handled, since its default action would kill us when
+    // e.g. systemctl reload is used without a configuration file:
+    if options.config.is_some() {
+        let reload_requested = reload_requested.clone();
+        let wakeup = wakeup.clone();
+        signal_handlers.push((
+            libc::SIGHUP,
+            Box::new(move || {
+                reload_requested.store(true, Ordering::SeqCst);
+                wakeup.request();
+            }),
+        ));
+    } else {
+        signal_handlers.push((
+            libc::SIGHUP,
+            Box::new(|| warn!("Ignoring SIGHUP: there is no --config file to reload")),
+        ));
+    }
+    signals::handle(signal_handlers)?;
+
+    if options.concurrency > 0 {
+        rayon::ThreadPoolBuilder::new()
+            .num_threads(options.concurrency)
+            .build_global()
+            .chain_err(|| "Unable to start the check threads")?;
+    }
+
+    logging::init(
+        policy.log_level,
+        options.log_rate_limit,
+        options.log_queue_size.max(1),
+    )?;
+    let clock: Arc<dyn clock::Clock> = Arc::new(clock::SystemClock);
+    let mut transition_logger = transitions::TransitionLogger::new(
+        Duration::from_secs(policy.log_reminder_interval),
+        options.log_rate_limit,
+        clock.clone(),
+    );
+
+    #[cfg(feature = "with_prometheus")]
+    let pusher = match options.prometheus_push_gateway {
+        Some(ref gateway_address) => Some(push::Pusher::start(push::PushOptions {
+            gateway: gateway_address.to_owned(),
+            deadline: Duration::from_secs(options.push_timeout),
+            initial_retry_interval: Duration::from_secs(1),
+            max_retry_interval: Duration::from_secs(options.push_max_retry_interval),
+        })?),
+        None => None,
+    };
+
+    #[cfg(feature = "with_prometheus")]
+    let mut textfile_writer = match options.textfile_output {
+        Some(ref path) => Some(textfile::TextfileWriter::new(path.to_owned())?),
+        None => None,
+    };
+
+    #[cfg(feature = "with_prometheus")]
+    let metrics_enabled = pusher.is_some() || textfile_writer.is_some();
+
+    #[cfg(feature = "with_prometheus")]
+    let mut mount_metrics = match (metrics_enabled, options.mount_labels.is_empty()) {
+        (true, false) => Some(metrics::MountMetrics::new(metrics::MountMetricsOptions {
+            labels: options
+                .mount_labels
+                .split(',')
+                .map(|label| label.trim().to_owned())
+                .collect(),
+            ephemeral_prefixes: if options.ephemeral_mount_prefixes.is_empty() {
+                metrics::DEFAULT_EPHEMERAL_PREFIXES
+                    .iter()
+                    .map(|prefix| prefix.to_string())
+                    .collect()
+            } else {
+                options.ephemeral_mount_prefixes.clone()
+            },
+            max_series: options.max_mount_series,
+        })?),
+        _ => None,
+    };
+
+    let mut prober = probe::ProcessProber {
+        statfs_helper: if options.collect_statfs {
+            Some(std::env::current_exe().chain_err(|| "Unable to locate our own executable")?)
+        } else {
+            None
+        },
+        namespace_helper: if options.mount_namespaces {
+            Some(std::env::current_exe().chain_err(|| "Unable to locate our own executable")?)
+        } else {
+            None
+        },
+        timeout: Duration::from_secs(policy.check_timeout),
+    };
+    let mount_source: Box<dyn get_mounts::MountSource> = if options.mount_namespaces {
+        Box::new(namespaces::NamespacedMounts)
+    } else {
+        Box::new(get_mounts::SystemMounts)
+    };
+
+    let mut event_pipeline =
+        events::start_pipeline(&policy.event_sinks, options.event_queue_depth.max(1))?;
+
+    let mut mount_statuses = HashMap::<PathBuf, MountState>::new();
+    let mut scheduler = schedule::Scheduler::new(
+        Duration::from_secs(policy.poll_interval),
+        policy.overrun_policy,
+        clock.clone(),
+    );
+    if options.control_socket.is_some() || options.config.is_some() {
+        scheduler = scheduler.with_wakeup(wakeup.clone());
+    }
+    let status_board = Arc::new(snapshot::StatusBoard::new());
+    if let Some(ref path) = options.control_socket {
+        control::Control::start(
+            path,
+            options
+                .control_socket_group
+                .as_ref()
+                .map(|group| group.as_str()),
+            status_board.clone(),
+            wakeup.clone(),
+        )?;
+    }
+    let mut status_table = match options.status_table {
+        Some(ref path) => Some(status_table::StatusTable::create(path)?),
+        None => None,
+    };
+    let mut state_file = match options.state_file {
+        Some(ref path) => {
+            let (state_file, saved_state) = state_file::StateFile::open(path)?;
+            // The mount table is read up front so that what the previous
+            // monitor knew is in place before the first check is started:
+            let mount_points = config::FilteredMounts {
+                inner: &*mount_source,
+                policy: &policy,
+            }
+            .mount_points();
+            if let Ok(mount_points) = mount_points {
+                reconcile_mount_points(&mut mount_statuses, mount_points);
+                for adopted in saved_state.restore(&mut mount_statuses, &*clock) {
+                    transition_logger.adopted(
+                        &adopted.mount_point,
+                        adopted.pid,
+                        adopted.hung_since,
+                    );
+                }
+            }
+            Some(state_file)
+        }
+        None => None,
+    };
+    let mut history = match options.history_file {
+        Some(ref path) => Some(history::History::open(path, options.history_size << 20)?),
+        None => None,
+    };
+    // The first cycle's values are only reported by the metrics:
+    #[cfg_attr(not(feature = "with_prometheus"), allow(unused_assignments))]
+    let mut tick = schedule::Tick::default();
+    #[cfg_attr(not(feature = "with_prometheus"), allow(unused_assignments))]
+    let mut previous_cycle_duration = Duration::from_secs(0);
 
     loop {
-        check_mounts(&mut mount_statuses, options.print_bad_mounts);
+        let cycle_start_time = Instant::now();
+        let outcomes = check_mounts(
+            &mut mount_statuses,
+            &config::FilteredMounts {
+                inner: &*mount_source,
+                policy: &policy,
+            },
+            &prober,
+            &*clock,
+            policy.print_bad_mounts,
+            options.availability_windows,
+        );
 
         // We calculate these values each time because a filesystem may have been
         // mounted or unmounted since the last check:
         let total_mounts = mount_statuses.len();
         let dead_mounts = mount_statuses
             .iter()
-            .filter(|&(_, status)| !status.success())
+            .filter(|&(_, state)| !state.status.success())
             .count();
 
+        let report_start_time = Instant::now();
         info!("Checked {} mounts; {} are dead", total_mounts, dead_mounts);
+        transition_logger.record(&outcomes);
+
+        status_board.publish(&mount_statuses);
+
+        if let Some(ref mut status_table) = status_table {
+            if let Err(e) = status_table.update(&mount_statuses, &*clock) {
+                eprintln!("{}", e);
+            }
+        }
+
+        if let Some(ref mut state_file) = state_file {
+            if let Err(e) = state_file.update(&mount_statuses, &*clock) {
+                eprintln!("{}", e);
+            }
+        }
+
+        if let Some(ref mut history) = history {
+            history.record(&outcomes);
+        }
+
+        if let Some(ref event_pipeline) = event_pipeline {
+            event_pipeline.submit(outcomes);
+        }
 
         #[cfg(feature = "with_prometheus")]
         {
-            if let Some(ref gateway_address) = options.prometheus_push_gateway {
-                if let Err(e) = push_to_prometheus(gateway_address, dead_mounts, total_mounts) {
-                    eprintln!("{}", e);
+            if metrics_enabled {
+                metrics::update_totals(dead_mounts, total_mounts);
+                metrics::update_schedule(previous_cycle_duration, &tick);
+                metrics::update_self_stats();
+                if let Some(ref mut mount_metrics) = mount_metrics {
+                    mount_metrics.update(&mount_statuses, &*clock);
+                }
+                let metric_families = prometheus::gather();
+
+                if let Some(ref mut textfile_writer) = textfile_writer {
+                    if let Err(e) = textfile_writer.write(&metric_families) {
+                        eprintln!("{}", e);
+                    }
+                }
+
+                if let Some(ref pusher) = pusher {
+                    pusher.submit(metric_families);
+
+                    if options.once_only && !pusher.flush(Duration::from_secs(options.push_timeout))
+                    {
+                        eprintln!("Timed out waiting for metrics to be pushed");
+                    }
                 }
             }
         }
 
+        stats::REPORT.record(report_start_time.elapsed());
+
         if options.once_only {
+            if let Some(event_pipeline) = event_pipeline.take() {
+                event_pipeline.finish();
+            }
+            log::logger().flush();
             std::process::exit(0);
         }
 
-        // Wait before checking again:
-        thread::sleep(poll_interval_duration);
+        previous_cycle_duration = cycle_start_time.elapsed();
+        tick = scheduler.wait();
+        if reload_requested.swap(false, Ordering::SeqCst) {
+            if let Some(ref path) = options.config {
+                // The event sinks are the only part which can fail to apply,
+                // so they're started first and the old policy stays entirely
+                // in force if they can't be:
+                let reloaded = config::Policy::load(path, &default_policy).and_then(|new_policy| {
+                    let new_pipeline = if new_policy.event_sinks != policy.event_sinks {
+                        Some(events::start_pipeline(
+                            &new_policy.event_sinks,
+                            options.event_queue_depth.max(1),
+                        )?)
+                    } else {
+                        None
+                    };
+                    Ok((new_policy, new_pipeline))
+                });
+                match reloaded {
+                    Ok((new_policy, new_pipeline)) => {
+                        let changes = policy.changes(&new_policy);
+                        if changes.is_empty() {
+                            info!("Reloaded {}; nothing has changed", path.display());
+                        }
+                        for change in changes {
+                            info!("Reloaded {}: {}", path.display(), change);
+                        }
+                        // The old writer is detached rather than waited for,
+                        // and exits once it has delivered what was queued:
+                        if let Some(new_pipeline) = new_pipeline {
+                            event_pipeline = new_pipeline;
+                        }
+                        scheduler.reconfigure(
+                            Duration::from_secs(new_policy.poll_interval),
+                            new_policy.overrun_policy,
+                        );
+                        prober.timeout = Duration::from_secs(new_policy.check_timeout);
+                        transition_logger.set_reminder_interval(Duration::from_secs(
+                            new_policy.log_reminder_interval,
+                        ));
+                        log::set_max_level(new_policy.log_level);
+                        policy = new_policy;
+                    }
+                    Err(e) => error!("Keeping the previous settings: {}", e),
+                }
+            }
+        } else if tick.requested {
+            debug!("Running a cycle requested through the control socket");
+        }
+        if tick.overrun {
+            warn!(
+                "Checking mounts took {} seconds, overrunning the {} second poll interval; {} cycles skipped and {} queued",
+                previous_cycle_duration.as_secs(),
+                policy.poll_interval,
+                tick.skipped,
+                tick.backlog
+            );
+        }
     }
 }
 
-#[cfg(feature = "with_prometheus")]
-fn push_to_prometheus(
-    gateway: &str,
-    dead_mounts: usize,
-    total_mounts: usize,
-) -> prometheus::Result<()> {
-    lazy_static! {
-        static ref TOTAL_MOUNTS: prometheus::Gauge =
-            register_gauge!("total_mountpoints", "Total number of mountpoints").unwrap();
-        static ref DEAD_MOUNTS: prometheus::Gauge =
-            register_gauge!("dead_mountpoints", "Number of unresponsive mountpoints").unwrap();
-    }
+fn check_mounts(
+    mount_statuses: &mut HashMap<PathBuf, MountState>,
+    mount_source: &dyn get_mounts::MountSource,
+    prober: &dyn probe::Prober,
+    clock: &dyn clock::Clock,
+    print_bad_mounts: bool,
+    availability_windows: bool,
+) -> Vec<CheckOutcome> {
+    stats::CHECKS.time(|| {
+        let mount_points = stats::MOUNT_TABLE
+            .time(|| mount_source.mount_points())
+            .unwrap_or_else(|err| {
+                eprintln!("Failed to retrieve a list of mount-points: {:?}", err);
+                std::process::exit(2);
+            });
 
-    let prometheus_instance = hostname::get().unwrap();
-
-    // The Prometheus metrics are defined as floats so we need to convert;
-    // for monitoring the precision loss in general is fine and it's
-    // exceedingly unlikely to be relevant when counting the number of
-    // mountpoints:
-    TOTAL_MOUNTS.set(total_mounts as f64);
-    DEAD_MOUNTS.set(dead_mounts as f64);
-
-    prometheus::push_metrics(
-        "mount_status_monitor",
-        labels! {"instance".to_owned() => String::from(prometheus_instance.to_str().unwrap())},
-        gateway,
-        prometheus::gather(),
-        None,
-    )
+        check_mount_points(
+            mount_statuses,
+            mount_points,
+            prober,
+            clock,
+            print_bad_mounts,
+            availability_windows,
+        )
+    })
 }
 
-fn check_mounts(mount_statuses: &mut HashMap<PathBuf, MountStatus>, print_bad_mounts: bool) {
-    let mount_points = get_mounts::get_mount_points().unwrap_or_else(|err| {
-        eprintln!("Failed to retrieve a list of mount-points: {:?}", err);
-        std::process::exit(2);
-    });
-
-    // Remove any mount status entries which are no longer in the current list of mountpoints:
-    mount_statuses.retain(|ref k, _| mount_points.iter().position(|i| *i == **k).is_some());
+// Bring the state map into line with the current mount table:
+fn reconcile_mount_points(
+    mount_statuses: &mut HashMap<PathBuf, MountState>,
+    mount_points: Vec<MountPoint>,
+) {
+    // Remove any mount status entries which are no longer in the current list
+    // of mountpoints. This has to be a hash lookup rather than a scan of the
+    // list as hosts with containers may have tens of thousands of mounts:
+    {
+        let current: HashSet<&Path> = mount_points.iter().map(|m| m.path.as_path()).collect();
+        mount_statuses.retain(|k, state| {
+            if current.contains(k.as_path()) {
+                return true;
+            }
+            // Whatever is still hung on the mount is reaped once it exits:
+            if let MountStatus::CheckRunning { process, .. } =
+                std::mem::replace(&mut state.status, MountStatus::Alive)
+            {
+                probe::abandon(process);
+            }
+            false
+        });
+    }
+    probe::reap_abandoned();
 
     for mount_point in mount_points {
-        mount_statuses
-            .entry(mount_point)
-            .or_insert(MountStatus::Alive);
+        match mount_statuses.entry(mount_point.path) {
+            Entry::Occupied(entry) => {
+                // The path may have been remounted from a different source since we last looked:
+                let state = entry.into_mut();
+                state.fs_type = mount_point.fs_type;
+                state.source = mount_point.source;
+                state.namespace = mount_point.namespace;
+            }
+            Entry::Vacant(entry) => {
+                entry.insert(MountState::new(
+                    mount_point.fs_type,
+                    mount_point.source,
+                    mount_point.namespace,
+                ));
+            }
+        }
     }
+}
+
+fn check_mount_points(
+    mount_statuses: &mut HashMap<PathBuf, MountState>,
+    mount_points: Vec<MountPoint>,
+    prober: &dyn probe::Prober,
+    clock: &dyn clock::Clock,
+    print_bad_mounts: bool,
+    availability_windows: bool,
+) -> Vec<CheckOutcome> {
+    reconcile_mount_points(mount_statuses, mount_points);
 
+    let queue_start_time = Instant::now();
     mount_statuses
         .par_iter_mut()
-        .for_each(|(mount_point, mount_status)| {
+        .filter_map(|(mount_point, mount_state)| {
+            stats::QUEUE_WAIT.record(queue_start_time.elapsed());
+            let previous = mount_state.status.kind();
+            let now = clock.now();
+
             if let MountStatus::CheckRunning {
                 ref mut process,
                 start_time,
-            } = *mount_status
+            } = mount_state.status
             {
                 match process.try_wait() {
                     Ok(Some(status)) => {
@@ -246,109 +970,96 @@ fn check_mounts(mount_statuses: &mut HashMap<PathBuf, MountStatus>, print_bad_mo
                             "Slow check for mount {} exited with {} after {} seconds",
                             mount_point.display(),
                             status,
-                            start_time.elapsed().as_secs()
+                            now.duration_since(start_time).as_secs()
                         );
                     }
                     Ok(None) => {
-                        warn!(
+                        // This is reported by the transition logger's reminders:
+                        debug!(
                             "Slow check for mount {} has not exited after {} seconds",
                             mount_point.display(),
-                            start_time.elapsed().as_secs()
+                            now.duration_since(start_time).as_secs()
                         );
-                        return;
+                        if availability_windows {
+                            windows::record(&mut mount_state.windows, now, false, None);
+                        }
+                        mount_state
+                            .view
+                            .store(Some(snapshot::MountView::new(mount_state, clock)));
+                        return Some(CheckOutcome::new(
+                            mount_point,
+                            mount_state,
+                            previous,
+                            None,
+                            clock.system_time(),
+                        ));
                     }
                     Err(e) => {
                         error!(
                             "Stalled check on mount {} returned an error after {} seconds: {}",
                             mount_point.display(),
-                            start_time.elapsed().as_secs(),
+                            now.duration_since(start_time).as_secs(),
                             e
                         );
                     }
                 }
             }
-            let new_mount_status = match check_mount(mount_point) {
-                Ok(status) => status,
-                Err(e) => {
-                    eprintln!("{}", e);
-                    return;
-                }
-            };
+            let (new_mount_status, filesystem_stats) =
+                match prober.check(mount_point, mount_state.namespace.as_ref()) {
+                    Ok(result) => result,
+                    Err(e) => {
+                        eprintln!("{}", e);
+                        return None;
+                    }
+                };
 
+            // Only changes of state are logged at higher levels; see transitions.rs:
             match new_mount_status {
                 MountStatus::CheckFailed(rc) => {
-                    eprintln!("Mount check failed with an unexpected return code: {}", rc);
+                    debug!(
+                        "Check of mount {} failed with an unexpected return code: {}",
+                        mount_point.display(),
+                        rc
+                    );
                 }
                 MountStatus::CheckSignaled(signal) => {
-                    eprintln!("Mount check was killed by signal: {}", signal);
+                    debug!(
+                        "Check of mount {} was killed by signal: {}",
+                        mount_point.display(),
+                        signal
+                    );
                 }
                 _ => {}
             }
+            let check_duration = clock.now().duration_since(now);
+            mount_state.last_check_duration = Some(check_duration);
+            mount_state.filesystem_stats = filesystem_stats;
             if new_mount_status.success() {
+                mount_state.last_success = Some(clock.system_time());
                 debug!("Mount passed health-check: {}", mount_point.display());
-            } else {
-                let msg = format!("Mount failed health-check: {}", mount_point.display());
-                eprintln!("{}", msg);
-                if print_bad_mounts {
-                    println!("{}", mount_point.display())
-                }
-                error!("{}", msg);
+            } else if print_bad_mounts {
+                println!("{}", mount_point.display())
             }
 
-            *mount_status = new_mount_status;
-        });
-}
-
-fn check_mount(mount_point: &Path) -> Result<MountStatus> {
-    let start_time = Instant::now();
-    let mut child = process::Command::new("/usr/bin/stat")
-        .arg(mount_point)
-        .stdout(process::Stdio::null())
-        .spawn()
-        .chain_err(|| "Unable to spawn process to check mount")?;
-
-    // See https://github.com/rust-lang/rust/issues/18166 for why we can't make this a static value:
-    let child_result = child
-        .wait_timeout(Duration::from_secs(3))
-        .chain_err(|| "Unable to wait on stat command")?;
-    match child_result {
-        None => {
-            /*
-                The process has not exited and we're not going to wait for a
-                potentially very long period of time for it to recover.
-
-                We'll attempt to clean up the check process by killing it, which
-                is defined as sending SIGKILL on Unix:
-
-                https://doc.rust-lang.org/std/process/struct.Child.html#method.kill
-
-                The mount_status structure returned will include this child
-                process instance so future checks can perform a non-blocking
-                test to see whether it has finally exited:
-            */
-            if let Err(err) = child.kill() {
-                eprintln!("Unable to kill process {}: {:?}", child.id(), err)
-            };
-
-            Ok(MountStatus::CheckRunning {
-                process: child,
-                start_time: start_time,
-            })
-        }
-        Some(exit_status) => {
-            let rc = exit_status.code();
-            match rc {
-                Some(0) => Ok(MountStatus::Alive),
-                Some(rc) => Ok(MountStatus::CheckFailed(rc)),
-                None => {
-                    use std::os::unix::process::ExitStatusExt;
-
-                    // If there isn't a return code, there _should_ always be a signal
-                    Ok(MountStatus::CheckSignaled(
-                        exit_status.signal().unwrap_or(0),
-                    ))
-                }
+            if availability_windows {
+                windows::record(
+                    &mut mount_state.windows,
+                    now,
+                    new_mount_status.success(),
+                    Some(check_duration),
+                );
             }
-        }
-    }
+            mount_state.status = new_mount_status;
+            mount_state
+                .view
+                .store(Some(snapshot::MountView::new(mount_state, clock)));
+            Some(CheckOutcome::new(
+                mount_point,
+                mount_state,
+                previous,
+                Some(check_duration),
+                clock.system_time(),
+            ))
+        })
+        .collect()
 }
@@ -0,0 +1,566 @@
+// Prometheus metrics describing the monitor's view of the world
+//
+// The host-wide totals only tell you that something is wrong; the per-mount
+// series tell you which mount it is. A host running containers can easily
+// have thousands of short-lived mounts, however, so the per-mount series are
+// deliberately constrained:
+//
+//  - only the allow-listed labels are attached to each series
+//  - mounts below well-known container runtime directories are collapsed into
+//    a single series per directory
+//  - the number of distinct series is capped, with dead mounts exported
+//    first so the interesting ones are never the ones dropped
+//
+// With --availability-windows each series also gets the availability and
+// check duration percentiles over each rolling window, with window and
+// quantile labels. A grouped series adds up the checks of all of its mounts.
+//
+// When --collect-statfs is used the capacity series mirror node_exporter's
+// filesystem collector. They are only exported for series which represent a
+// single filesystem since adding up the capacity of a group of bind mounts
+// would be meaningless.
+
+use std::collections::{BTreeMap, HashMap, HashSet};
+use std::path::PathBuf;
+use std::sync::atomic::Ordering;
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+
+use prometheus;
+
+use crate::clock::Clock;
+use crate::errors::*;
+use crate::logging;
+use crate::schedule::Tick;
+use crate::statfs::FilesystemStats;
+use crate::stats::{self, seconds};
+use crate::windows::{WindowTotals, QUANTILES, WINDOWS};
+use crate::{MountState, MountStatus};
+
+pub const LABEL_NAMES: &[&str] = &["mountpoint", "fstype", "source"];
+
+pub const DEFAULT_EPHEMERAL_PREFIXES: &[&str] = &[
+    "/run/containerd/",
+    "/run/docker/netns/",
+    "/run/netns/",
+    "/var/lib/containers/",
+    "/var/lib/docker/",
+    "/var/lib/kubelet/pods/",
+];
+
+lazy_static! {
+    static ref TOTAL_MOUNTS: prometheus::Gauge =
+        register_gauge!("total_mountpoints", "Total number of mountpoints").unwrap();
+    static ref DEAD_MOUNTS: prometheus::Gauge =
+        register_gauge!("dead_mountpoints", "Number of unresponsive mountpoints").unwrap();
+    static ref CYCLE_DURATION: prometheus::Gauge = register_gauge!(
+        "check_cycle_duration_seconds",
+        "Time taken by the previous cycle of checks"
+    )
+    .unwrap();
+    static ref CYCLE_LAG: prometheus::Gauge = register_gauge!(
+        "check_cycle_lag_seconds",
+        "How long after its scheduled time the current cycle started"
+    )
+    .unwrap();
+    static ref CYCLE_OVERRUNS: prometheus::IntCounter = register_int_counter!(
+        "check_cycle_overruns_total",
+        "Number of cycles which ran past the start of the next cycle"
+    )
+    .unwrap();
+    static ref TICKS_SKIPPED: prometheus::IntCounter = register_int_counter!(
+        "check_cycle_ticks_skipped_total",
+        "Number of scheduled cycles which were not run because of overruns"
+    )
+    .unwrap();
+    static ref TICKS_QUEUED: prometheus::Gauge = register_gauge!(
+        "check_cycle_ticks_queued",
+        "Number of overdue cycles waiting to run back-to-back"
+    )
+    .unwrap();
+    static ref STAGE_SECONDS: prometheus::CounterVec = register_counter_vec!(
+        "monitor_stage_seconds_total",
+        "Total time spent in each stage of a cycle",
+        &["stage"]
+    )
+    .unwrap();
+    static ref STAGE_RUNS: prometheus::IntCounterVec = register_int_counter_vec!(
+        "monitor_stage_runs_total",
+        "Number of times each stage of a cycle has run",
+        &["stage"]
+    )
+    .unwrap();
+    static ref STAGE_LAST: prometheus::GaugeVec = register_gauge_vec!(
+        "monitor_stage_last_seconds",
+        "Time taken by the most recent run of each stage of a cycle",
+        &["stage"]
+    )
+    .unwrap();
+    static ref STAGE_MAX: prometheus::GaugeVec = register_gauge_vec!(
+        "monitor_stage_max_seconds",
+        "Longest time taken by any run of each stage of a cycle",
+        &["stage"]
+    )
+    .unwrap();
+    static ref SPAWN_FAILURES: prometheus::IntCounter = register_int_counter!(
+        "monitor_check_spawn_failures_total",
+        "Number of check processes which could not be started"
+    )
+    .unwrap();
+    static ref LOG_MESSAGES_DROPPED: prometheus::IntCounter = register_int_counter!(
+        "monitor_log_messages_dropped_total",
+        "Number of log messages which could not be sent to syslog"
+    )
+    .unwrap();
+    static ref EVENT_BATCHES_DROPPED: prometheus::IntCounter = register_int_counter!(
+        "monitor_event_batches_dropped_total",
+        "Number of cycles of events dropped because the event sinks fell behind"
+    )
+    .unwrap();
+    static ref CPU_SECONDS: prometheus::CounterVec = register_counter_vec!(
+        "monitor_cpu_seconds_total",
+        "CPU time used by the monitor and its reaped check processes",
+        &["process", "mode"]
+    )
+    .unwrap();
+    static ref MAX_RSS: prometheus::Gauge = register_gauge!(
+        "monitor_max_resident_memory_bytes",
+        "Peak resident set size of the monitor"
+    )
+    .unwrap();
+}
+
+pub fn update_totals(dead_mounts: usize, total_mounts: usize) {
+    // The Prometheus metrics are defined as floats so we need to convert;
+    // for monitoring the precision loss in general is fine and it's
+    // exceedingly unlikely to be relevant when counting the number of
+    // mountpoints:
+    TOTAL_MOUNTS.set(total_mounts as f64);
+    DEAD_MOUNTS.set(dead_mounts as f64);
+}
+
+pub fn update_schedule(previous_cycle_duration: Duration, tick: &Tick) {
+    CYCLE_DURATION.set(seconds(previous_cycle_duration));
+    CYCLE_LAG.set(seconds(tick.lag));
+    if tick.overrun {
+        CYCLE_OVERRUNS.inc();
+    }
+    TICKS_SKIPPED.inc_by(u64::from(tick.skipped));
+    TICKS_QUEUED.set(f64::from(tick.backlog));
+}
+
+pub fn update_self_stats() {
+    for timer in stats::TIMERS {
+        let snapshot = timer.snapshot();
+        let labels = &[timer.name];
+        set_counter(
+            &STAGE_SECONDS.with_label_values(labels),
+            seconds(snapshot.total),
+        );
+        set_int_counter(&STAGE_RUNS.with_label_values(labels), snapshot.count);
+        STAGE_LAST
+            .with_label_values(labels)
+            .set(seconds(snapshot.last));
+        STAGE_MAX
+            .with_label_values(labels)
+            .set(seconds(snapshot.max));
+    }
+
+    set_int_counter(
+        &SPAWN_FAILURES,
+        stats::SPAWN_FAILURES.load(Ordering::Relaxed),
+    );
+    set_int_counter(&LOG_MESSAGES_DROPPED, logging::dropped_records() as u64);
+    set_int_counter(
+        &EVENT_BATCHES_DROPPED,
+        stats::EVENT_BATCHES_DROPPED.load(Ordering::Relaxed),
+    );
+
+    let usage = stats::resource_usage();
+    for &(process, mode, value) in &[
+        ("self", "user", usage.user_cpu),
+        ("self", "system", usage.system_cpu),
+        ("children", "user", usage.children_user_cpu),
+        ("children", "system", usage.children_system_cpu),
+    ] {
+        set_counter(
+            &CPU_SECONDS.with_label_values(&[process, mode]),
+            seconds(value),
+        );
+    }
+    MAX_RSS.set(usage.max_rss_bytes as f64);
+}
+
+// The authoritative totals are kept by the stats module so they can be read
+// without the prometheus feature; these copy them into the exported counters:
+fn set_counter(counter: &prometheus::Counter, value: f64) {
+    counter.reset();
+    counter.inc_by(value);
+}
+
+fn set_int_counter(counter: &prometheus::IntCounter, value: u64) {
+    counter.reset();
+    counter.inc_by(value);
+}
+
+pub struct MountMetricsOptions {
+    pub labels: Vec<String>,
+    pub ephemeral_prefixes: Vec<String>,
+    pub max_series: usize,
+}
+
+// The values for a single series, which may represent several mounts if they
+// were grouped together or the allow-listed labels cannot tell them apart:
+struct SeriesValues {
+    up: bool,
+    last_success: f64,
+    check_duration: f64,
+    hung_check_age: f64,
+    filesystem_stats: Option<FilesystemStats>,
+    windows: Option<Vec<WindowTotals>>,
+}
+
+impl SeriesValues {
+    fn merge(&mut self, other: SeriesValues) {
+        self.filesystem_stats = None;
+        self.up &= other.up;
+        self.last_success = self.last_success.min(other.last_success);
+        self.check_duration = self.check_duration.max(other.check_duration);
+        self.hung_check_age = self.hung_check_age.max(other.hung_check_age);
+        match (&mut self.windows, other.windows) {
+            (&mut Some(ref mut windows), Some(ref other_windows)) => {
+                for (totals, other_totals) in windows.iter_mut().zip(other_windows.iter()) {
+                    totals.add(other_totals);
+                }
+            }
+            (windows, other_windows) => {
+                if windows.is_none() {
+                    *windows = other_windows;
+                }
+            }
+        }
+    }
+}
+
+pub struct MountMetrics {
+    options: MountMetricsOptions,
+    up: prometheus::GaugeVec,
+    last_success: prometheus::GaugeVec,
+    check_duration: prometheus::GaugeVec,
+    hung_check_age: prometheus::GaugeVec,
+    availability: prometheus::GaugeVec,
+    window_checks: prometheus::GaugeVec,
+    window_duration: prometheus::GaugeVec,
+    size_bytes: prometheus::GaugeVec,
+    free_bytes: prometheus::GaugeVec,
+    avail_bytes: prometheus::GaugeVec,
+    files: prometheus::GaugeVec,
+    files_free: prometheus::GaugeVec,
+    read_only: prometheus::GaugeVec,
+    series_dropped: prometheus::Gauge,
+    exported: HashSet<Vec<String>>,
+    exported_capacity: HashSet<Vec<String>>,
+    exported_windows: HashSet<Vec<String>>,
+}
+
+impl MountMetrics {
+    pub fn new(options: MountMetricsOptions) -> Result<MountMetrics> {
+        for label in &options.labels {
+            if !LABEL_NAMES.contains(&label.as_str()) {
+                return Err(format!(
+                    "Unknown mount label {:?}; expected one of {}",
+                    label,
+                    LABEL_NAMES.join(", ")
+                )
+                .into());
+            }
+        }
+
+        let label_names: Vec<&str> = options.labels.iter().map(|l| l.as_str()).collect();
+        let window_label_names: Vec<&str> =
+            label_names.iter().cloned().chain(Some("window")).collect();
+        let quantile_label_names: Vec<&str> = window_label_names
+            .iter()
+            .cloned()
+            .chain(Some("quantile"))
+            .collect();
+
+        Ok(MountMetrics {
+            up: register_gauge_vec!(
+                "mountpoint_up",
+                "Whether the last check of the mountpoint succeeded",
+                &label_names
+            )
+            .chain_err(|| "Unable to register mountpoint_up")?,
+            last_success: register_gauge_vec!(
+                "mountpoint_last_success_timestamp_seconds",
+                "Time of the last successful check of the mountpoint",
+                &label_names
+            )
+            .chain_err(|| "Unable to register mountpoint_last_success_timestamp_seconds")?,
+            check_duration: register_gauge_vec!(
+                "mountpoint_check_duration_seconds",
+                "Time taken by the last check of the mountpoint",
+                &label_names
+            )
+            .chain_err(|| "Unable to register mountpoint_check_duration_seconds")?,
+            hung_check_age: register_gauge_vec!(
+                "mountpoint_hung_check_age_seconds",
+                "Time since a check which has not yet exited was started",
+                &label_names
+            )
+            .chain_err(|| "Unable to register mountpoint_hung_check_age_seconds")?,
+            availability: register_gauge_vec!(
+                "mountpoint_availability_ratio",
+                "Fraction of the mountpoint's checks during the window which succeeded",
+                &window_label_names
+            )
+            .chain_err(|| "Unable to register mountpoint_availability_ratio")?,
+            window_checks: register_gauge_vec!(
+                "mountpoint_window_checks",
+                "Number of checks of the mountpoint during the window",
+                &window_label_names
+            )
+            .chain_err(|| "Unable to register mountpoint_window_checks")?,
+            window_duration: register_gauge_vec!(
+                "mountpoint_check_duration_quantile_seconds",
+                "Estimated quantiles of the mountpoint's check durations during the window",
+                &quantile_label_names
+            )
+            .chain_err(|| "Unable to register mountpoint_check_duration_quantile_seconds")?,
+            size_bytes: register_gauge_vec!(
+                "filesystem_size_bytes",
+                "Filesystem size in bytes",
+                &label_names
+            )
+            .chain_err(|| "Unable to register filesystem_size_bytes")?,
+            free_bytes: register_gauge_vec!(
+                "filesystem_free_bytes",
+                "Filesystem free space in bytes",
+                &label_names
+            )
+            .chain_err(|| "Unable to register filesystem_free_bytes")?,
+            avail_bytes: register_gauge_vec!(
+                "filesystem_avail_bytes",
+                "Filesystem space available to non-root users in bytes",
+                &label_names
+            )
+            .chain_err(|| "Unable to register filesystem_avail_bytes")?,
+            files: register_gauge_vec!(
+                "filesystem_files",
+                "Filesystem total file nodes",
+                &label_names
+            )
+            .chain_err(|| "Unable to register filesystem_files")?,
+            files_free: register_gauge_vec!(
+                "filesystem_files_free",
+                "Filesystem total free file nodes",
+                &label_names
+            )
+            .chain_err(|| "Unable to register filesystem_files_free")?,
+            read_only: register_gauge_vec!(
+                "filesystem_readonly",
+                "Filesystem read-only status",
+                &label_names
+            )
+            .chain_err(|| "Unable to register filesystem_readonly")?,
+            series_dropped: register_gauge!(
+                "mountpoint_series_dropped",
+                "Number of per-mount series not exported because of --max-mount-series"
+            )
+            .chain_err(|| "Unable to register mountpoint_series_dropped")?,
+            options,
+            exported: HashSet::new(),
+            exported_capacity: HashSet::new(),
+            exported_windows: HashSet::new(),
+        })
+    }
+
+    pub fn update(&mut self, mount_statuses: &HashMap<PathBuf, MountState>, clock: &dyn Clock) {
+        let mut series = BTreeMap::<Vec<String>, SeriesValues>::new();
+
+        for (mount_point, mount_state) in mount_statuses {
+            let key = self.label_values(&mount_point.to_string_lossy(), mount_state);
+            let values = series_values(mount_state, clock);
+            if let Some(existing) = series.get_mut(&key) {
+                existing.merge(values);
+                continue;
+            }
+            series.insert(key, values);
+        }
+
+        let mut series: Vec<(Vec<String>, SeriesValues)> = series.into_iter().collect();
+        // Dead mounts sort first so they survive the cap; the BTreeMap has
+        // already given us a stable order within each group:
+        series.sort_by_key(|&(_, ref values)| values.up);
+
+        let dropped = series.len().saturating_sub(self.options.max_series);
+        series.truncate(self.options.max_series);
+        self.series_dropped.set(dropped as f64);
+
+        let mut exported = HashSet::with_capacity(series.len());
+        let mut exported_capacity = HashSet::new();
+        let mut exported_windows = HashSet::new();
+        for (key, values) in series {
+            let label_values: Vec<&str> = key.iter().map(|v| v.as_str()).collect();
+            self.up
+                .with_label_values(&label_values)
+                .set(if values.up { 1.0 } else { 0.0 });
+            self.last_success
+                .with_label_values(&label_values)
+                .set(values.last_success);
+            self.check_duration
+                .with_label_values(&label_values)
+                .set(values.check_duration);
+            self.hung_check_age
+                .with_label_values(&label_values)
+                .set(values.hung_check_age);
+
+            if let Some(stats) = values.filesystem_stats {
+                self.size_bytes
+                    .with_label_values(&label_values)
+                    .set(stats.size_bytes as f64);
+                self.free_bytes
+                    .with_label_values(&label_values)
+                    .set(stats.free_bytes as f64);
+                self.avail_bytes
+                    .with_label_values(&label_values)
+                    .set(stats.avail_bytes as f64);
+                self.files
+                    .with_label_values(&label_values)
+                    .set(stats.files as f64);
+                self.files_free
+                    .with_label_values(&label_values)
+                    .set(stats.files_free as f64);
+                self.read_only
+                    .with_label_values(&label_values)
+                    .set(if stats.read_only { 1.0 } else { 0.0 });
+                exported_capacity.insert(key.clone());
+            }
+
+            if let Some(ref windows) = values.windows {
+                for (window, totals) in WINDOWS.iter().zip(windows.iter()) {
+                    let mut window_values = label_values.clone();
+                    window_values.push(window.name);
+                    self.window_checks
+                        .with_label_values(&window_values)
+                        .set(totals.checks as f64);
+                    // A window with no checks has no availability, which
+                    // is not the same thing as an availability of zero:
+                    match totals.availability() {
+                        Some(availability) => self
+                            .availability
+                            .with_label_values(&window_values)
+                            .set(availability),
+                        None => {
+                            let _ = self.availability.remove_label_values(&window_values);
+                        }
+                    }
+                    for &(quantile, q) in QUANTILES {
+                        let mut quantile_values = window_values.clone();
+                        quantile_values.push(quantile);
+                        match totals.quantile(q) {
+                            Some(value) => self
+                                .window_duration
+                                .with_label_values(&quantile_values)
+                                .set(value),
+                            None => {
+                                let _ = self.window_duration.remove_label_values(&quantile_values);
+                            }
+                        }
+                    }
+                }
+                exported_windows.insert(key.clone());
+            }
+
+            exported.insert(key);
+        }
+
+        // Unmounted filesystems must disappear rather than being reported
+        // with their last known values forever:
+        for stale in self.exported.difference(&exported) {
+            let label_values: Vec<&str> = stale.iter().map(|v| v.as_str()).collect();
+            let _ = self.up.remove_label_values(&label_values);
+            let _ = self.last_success.remove_label_values(&label_values);
+            let _ = self.check_duration.remove_label_values(&label_values);
+            let _ = self.hung_check_age.remove_label_values(&label_values);
+        }
+
+        // Capacity is also withdrawn when a check fails rather than
+        // continuing to report what may be very stale values:
+        for stale in self.exported_capacity.difference(&exported_capacity) {
+            let label_values: Vec<&str> = stale.iter().map(|v| v.as_str()).collect();
+            let _ = self.size_bytes.remove_label_values(&label_values);
+            let _ = self.free_bytes.remove_label_values(&label_values);
+            let _ = self.avail_bytes.remove_label_values(&label_values);
+            let _ = self.files.remove_label_values(&label_values);
+            let _ = self.files_free.remove_label_values(&label_values);
+            let _ = self.read_only.remove_label_values(&label_values);
+        }
+
+        for stale in self.exported_windows.difference(&exported_windows) {
+            for window in WINDOWS {
+                let mut window_values: Vec<&str> = stale.iter().map(|v| v.as_str()).collect();
+                window_values.push(window.name);
+                let _ = self.availability.remove_label_values(&window_values);
+                let _ = self.window_checks.remove_label_values(&window_values);
+                for &(quantile, _) in QUANTILES {
+                    let mut quantile_values = window_values.clone();
+                    quantile_values.push(quantile);
+                    let _ = self.window_duration.remove_label_values(&quantile_values);
+                }
+            }
+        }
+
+        self.exported = exported;
+        self.exported_capacity = exported_capacity;
+        self.exported_windows = exported_windows;
+    }
+
+    fn label_values(&self, mount_point: &str, mount_state: &MountState) -> Vec<String> {
+        let group = self
+            .options
+            .ephemeral_prefixes
+            .iter()
+            .find(|prefix| mount_point.starts_with(prefix.as_str()));
+
+        self.options
+            .labels
+            .iter()
+            .map(|label| match (label.as_str(), group) {
+                ("mountpoint", Some(prefix)) => format!("{}*", prefix),
+                ("mountpoint", None) => mount_point.to_owned(),
+                ("source", Some(_)) => "*".to_owned(),
+                ("source", None) => mount_state.source.clone(),
+                _ => mount_state.fs_type.clone(),
+            })
+            .collect()
+    }
+}
+
+fn series_values(mount_state: &MountState, clock: &dyn Clock) -> SeriesValues {
+    let now = clock.now();
+    let hung_check_age = match mount_state.status {
+        MountStatus::CheckRunning { start_time, .. } => {
+            now.duration_since(start_time).as_secs() as f64
+        }
+        _ => 0.0,
+    };
+
+    SeriesValues {
+        up: mount_state.status.success(),
+        last_success: mount_state.last_success.map_or(0.0, unix_timestamp),
+        check_duration: mount_state.last_check_duration.map_or(0.0, seconds),
+        hung_check_age,
+        filesystem_stats: mount_state.filesystem_stats,
+        windows: mount_state
+            .windows
+            .as_ref()
+            .map(|windows| windows.totals(now)),
+    }
+}
+
+fn unix_timestamp(time: SystemTime) -> f64 {
+    time.duration_since(UNIX_EPOCH)
+        .map(|d| d.as_secs() as f64)
+        .unwrap_or(0.0)
+}
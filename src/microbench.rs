@@ -0,0 +1,476 @@
+// Microbenchmarks of the parts of a cycle which grow with the number of mounts
+//
+// `mount_status_monitor microbench [BENCHMARK...]` runs against synthetic
+// mount tables so the results are comparable between machines and don't
+// require thousands of real mounts:
+//
+//   parse       reading a table in the /proc/self/mounts format (Linux only)
+//   reconcile   bringing the state map into line with a changed mount table
+//   cycle       a complete pass of check_mount_points() against a synthetic
+//               prober with configurable latency, failure and hang rates
+//
+// Each benchmark has a warm-up run and is then repeated for at least
+// --measurement-time seconds. These live in the normal binary rather than a
+// separate bench target so the same numbers can be collected on the hosts
+// whose behaviour we're trying to improve.
+
+use std::collections::HashMap;
+use std::io;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use argparse::{ArgumentParser, List, Store};
+
+use crate::clock::SystemClock;
+use crate::errors::*;
+use crate::get_mounts::{MountPoint, NamespacedPath};
+use crate::probe::{PendingCheck, Prober};
+use crate::statfs::FilesystemStats;
+use crate::status_table::path_hash;
+use crate::{check_mount_points, reconcile_mount_points, MountState, MountStatus};
+
+const BENCHMARKS: &[&str] = &["parse", "reconcile", "cycle"];
+
+// Enough samples for the median to mean something even for slow cases:
+const MIN_SAMPLES: usize = 5;
+const MAX_SAMPLES: usize = 100_000;
+
+struct Options {
+    benchmarks: Vec<String>,
+    sizes: String,
+    cycle_sizes: String,
+    measurement_time: f64,
+    churn_percent: f64,
+    latency_us: u64,
+    failure_percent: f64,
+    hang_percent: f64,
+    hang_timeout_ms: u64,
+    seed: u64,
+}
+
+pub fn run(args: Vec<String>) -> Result<()> {
+    let mut options = Options {
+        benchmarks: Vec::new(),
+        sizes: "10,100,1000,10000,100000".to_owned(),
+        cycle_sizes: "10,100,1000,10000".to_owned(),
+        measurement_time: 1.0,
+        churn_percent: 1.0,
+        latency_us: 500,
+        failure_percent: 1.0,
+        hang_percent: 1.0,
+        hang_timeout_ms: 10,
+        seed: 1,
+    };
+
+    {
+        let mut ap = ArgumentParser::new();
+        ap.set_description(
+            "Measure mount table parsing, state reconciliation and check scheduling against synthetic mounts",
+        );
+
+        ap.refer(&mut options.benchmarks).add_argument(
+            "benchmark",
+            List,
+            "Benchmarks to run (parse, reconcile or cycle; default all)",
+        );
+
+        ap.refer(&mut options.sizes).add_option(
+            &["--sizes"],
+            Store,
+            "Comma-separated numbers of mounts for the parse and reconcile benchmarks",
+        );
+
+        ap.refer(&mut options.cycle_sizes).add_option(
+            &["--cycle-sizes"],
+            Store,
+            "Comma-separated numbers of mounts for the cycle benchmark",
+        );
+
+        ap.refer(&mut options.measurement_time).add_option(
+            &["--measurement-time"],
+            Store,
+            "Minimum number of seconds to spend measuring each case",
+        );
+
+        ap.refer(&mut options.churn_percent).add_option(
+            &["--churn-percent"],
+            Store,
+            "Percentage of mounts replaced between tables in the reconcile benchmark",
+        );
+
+        ap.refer(&mut options.latency_us).add_option(
+            &["--latency-us"],
+            Store,
+            "Mean latency of a synthetic check in microseconds (exponentially distributed)",
+        );
+
+        ap.refer(&mut options.failure_percent).add_option(
+            &["--failure-percent"],
+            Store,
+            "Percentage of synthetic mounts whose checks fail",
+        );
+
+        ap.refer(&mut options.hang_percent).add_option(
+            &["--hang-percent"],
+            Store,
+            "Percentage of synthetic mounts whose checks hang forever",
+        );
+
+        ap.refer(&mut options.hang_timeout_ms).add_option(
+            &["--hang-timeout-ms"],
+            Store,
+            "Milliseconds a synthetic check waits before declaring a mount hung",
+        );
+
+        ap.refer(&mut options.seed).add_option(
+            &["--seed"],
+            Store,
+            "Seed for the synthetic latencies",
+        );
+
+        let mut args = args;
+        args[0] = "mount_status_monitor microbench".to_owned();
+        if let Err(rc) = ap.parse(args, &mut io::stdout(), &mut io::stderr()) {
+            ::std::process::exit(rc);
+        }
+    }
+
+    for name in &options.benchmarks {
+        if !BENCHMARKS.contains(&name.as_str()) {
+            return Err(format!(
+                "Unknown benchmark {:?}; expected one of {}",
+                name,
+                BENCHMARKS.join(", ")
+            )
+            .into());
+        }
+    }
+    let selected =
+        |name: &str| options.benchmarks.is_empty() || options.benchmarks.iter().any(|b| b == name);
+
+    let sizes = parse_sizes(&options.sizes)?;
+    let cycle_sizes = parse_sizes(&options.cycle_sizes)?;
+    let budget = Duration::from_millis((options.measurement_time.max(0.0) * 1000.0) as u64);
+
+    println!(
+        "{:<10} {:>8} {:>8} {:>10} {:>10} {:>10} {:>10} {:>12}",
+        "benchmark", "mounts", "samples", "median", "mean", "min", "max", "median/mount"
+    );
+
+    if selected("parse") {
+        for &size in &sizes {
+            bench_parse(size, budget)?;
+        }
+    }
+
+    if selected("reconcile") {
+        for &size in &sizes {
+            bench_reconcile(size, options.churn_percent, budget);
+        }
+    }
+
+    if selected("cycle") {
+        let prober = SyntheticProber {
+            mean_latency: Duration::from_micros(options.latency_us),
+            failure_rate: options.failure_percent / 100.0,
+            hang_rate: options.hang_percent / 100.0,
+            hang_timeout: Duration::from_millis(options.hang_timeout_ms),
+            seed: options.seed,
+            calls: AtomicU64::new(0),
+        };
+        for &size in &cycle_sizes {
+            bench_cycle(size, &prober, budget);
+        }
+    }
+
+    Ok(())
+}
+
+fn parse_sizes(sizes: &str) -> Result<Vec<usize>> {
+    sizes
+        .split(',')
+        .map(|size| {
+            size.trim()
+                .parse()
+                .chain_err(|| format!("Invalid number of mounts {:?}", size))
+        })
+        .collect()
+}
+
+#[cfg(target_os = "linux")]
+fn bench_parse(size: usize, budget: Duration) -> Result<()> {
+    use std::fs;
+    use std::io::Write;
+
+    use crate::get_mounts::read_mount_table;
+
+    let path = ::std::env::temp_dir().join(format!(
+        "mount_status_monitor-microbench.{}",
+        ::std::process::id()
+    ));
+    {
+        let mut table = io::BufWriter::new(
+            fs::File::create(&path).chain_err(|| format!("Unable to create {}", path.display()))?,
+        );
+        for mount_point in synthetic_mounts(size, 0) {
+            writeln!(
+                table,
+                "{} {} {} {} 0 0",
+                mount_point.source,
+                mount_point.path.display(),
+                mount_point.fs_type,
+                mount_options(&mount_point.fs_type)
+            )
+            .chain_err(|| format!("Unable to write {}", path.display()))?;
+        }
+    }
+
+    let result = measure(
+        budget,
+        || (),
+        |_| {
+            let parsed = read_mount_table(&path).expect("Unable to read the synthetic mount table");
+            assert_eq!(parsed.len(), size);
+        },
+    );
+    let _ = fs::remove_file(&path);
+
+    report("parse", size, &result);
+    Ok(())
+}
+
+#[cfg(not(target_os = "linux"))]
+fn bench_parse(_size: usize, _budget: Duration) -> Result<()> {
+    // getmntinfo() hands us structures rather than text so there's nothing to parse:
+    println!("parse: only available on Linux");
+    Ok(())
+}
+
+fn bench_reconcile(size: usize, churn_percent: f64, budget: Duration) {
+    let before = synthetic_mounts(size, 0);
+    // Replace a slice of the table with mounts which have new paths, as
+    // happens when containers come and go:
+    let churned = ((size as f64 * churn_percent / 100.0).round() as usize).min(size);
+    let mut after = before.clone();
+    let replacements = synthetic_mounts(churned, 1);
+    for (slot, replacement) in after.iter_mut().zip(replacements) {
+        *slot = replacement;
+    }
+
+    let result = measure(
+        budget,
+        || {
+            let mut mount_statuses = HashMap::<PathBuf, MountState>::with_capacity(size);
+            reconcile_mount_points(&mut mount_statuses, before.clone());
+            (mount_statuses, after.clone())
+        },
+        |(mut mount_statuses, after)| {
+            reconcile_mount_points(&mut mount_statuses, after);
+            assert_eq!(mount_statuses.len(), size);
+        },
+    );
+
+    report("reconcile", size, &result);
+}
+
+fn bench_cycle(size: usize, prober: &SyntheticProber, budget: Duration) {
+    let mount_points = synthetic_mounts(size, 0);
+    // The state persists between cycles just as it does in the daemon, so
+    // hung mounts cost a single try_wait() after the first cycle:
+    let mut mount_statuses = HashMap::<PathBuf, MountState>::new();
+
+    let result = measure(
+        budget,
+        || mount_points.clone(),
+        |mount_points| {
+            check_mount_points(
+                &mut mount_statuses,
+                mount_points,
+                prober,
+                &SystemClock,
+                false,
+                false,
+            );
+        },
+    );
+
+    report("cycle", size, &result);
+}
+
+// A reproducible mix of the mounts found on a busy container host:
+fn synthetic_mounts(count: usize, generation: usize) -> Vec<MountPoint> {
+    (0..count)
+        .map(|i| {
+            let (fs_type, source, path) = match i % 10 {
+                0 | 1 => (
+                    "nfs4",
+                    format!("nfs-server-{}:/export/{}", i % 7, i),
+                    format!("/mnt/nfs/{}/{}", generation, i),
+                ),
+                2 => (
+                    "fuse.sshfs",
+                    format!("user@host-{}:/home", i),
+                    format!("/mnt/sshfs/{}/{}", generation, i),
+                ),
+                3 | 4 | 5 => (
+                    "overlay",
+                    "overlay".to_owned(),
+                    format!(
+                        "/var/lib/docker/overlay2/{:016x}{:016x}/merged",
+                        splitmix64(i as u64),
+                        splitmix64(generation as u64)
+                    ),
+                ),
+                _ => (
+                    "tmpfs",
+                    "tmpfs".to_owned(),
+                    format!(
+                        "/var/lib/kubelet/pods/{:032x}/volumes/kubernetes.io~secret/token-{}-{}",
+                        i, generation, i
+                    ),
+                ),
+            };
+            MountPoint {
+                path: PathBuf::from(path),
+                fs_type: fs_type.to_owned(),
+                source,
+                namespace: None,
+            }
+        })
+        .collect()
+}
+
+fn mount_options(fs_type: &str) -> &'static str {
+    match fs_type {
+        "nfs4" => "rw,relatime,vers=4.2,rsize=1048576,wsize=1048576,namlen=255,hard,proto=tcp,timeo=600,retrans=2,sec=sys",
+        "overlay" => "rw,relatime,lowerdir=/var/lib/docker/overlay2/l/ABCDEFGHIJKLMNOPQRSTUVWXYZ:/var/lib/docker/overlay2/l/ZYXWVUTSRQPONMLKJIHGFEDCBA,upperdir=/var/lib/docker/overlay2/diff,workdir=/var/lib/docker/overlay2/work",
+        _ => "rw,nosuid,nodev,relatime",
+    }
+}
+
+struct Measurement {
+    samples: Vec<Duration>,
+}
+
+fn measure<I, S, R>(budget: Duration, mut setup: S, mut routine: R) -> Measurement
+where
+    S: FnMut() -> I,
+    R: FnMut(I),
+{
+    routine(setup());
+
+    let mut samples = Vec::new();
+    let started = Instant::now();
+    while samples.len() < MAX_SAMPLES && (samples.len() < MIN_SAMPLES || started.elapsed() < budget)
+    {
+        let input = setup();
+        let start_time = Instant::now();
+        routine(input);
+        samples.push(start_time.elapsed());
+    }
+    samples.sort();
+
+    Measurement { samples }
+}
+
+fn report(name: &str, size: usize, measurement: &Measurement) {
+    let samples = &measurement.samples;
+    let total: Duration = samples.iter().sum();
+    let median = samples[samples.len() / 2];
+
+    println!(
+        "{:<10} {:>8} {:>8} {:>10} {:>10} {:>10} {:>10} {:>12}",
+        name,
+        size,
+        samples.len(),
+        format_duration(median),
+        format_duration(total / samples.len() as u32),
+        format_duration(samples[0]),
+        format_duration(samples[samples.len() - 1]),
+        format_duration(median / size.max(1) as u32)
+    );
+}
+
+pub fn format_duration(d: Duration) -> String {
+    let nanos = d.as_secs() as f64 * 1e9 + f64::from(d.subsec_nanos());
+    if nanos >= 1e9 {
+        format!("{:.2}s", nanos / 1e9)
+    } else if nanos >= 1e6 {
+        format!("{:.2}ms", nanos / 1e6)
+    } else if nanos >= 1e3 {
+        format!("{:.2}us", nanos / 1e3)
+    } else {
+        format!("{:.0}ns", nanos)
+    }
+}
+
+// Stands in for a check process. Which mounts fail or hang is a fixed
+// property of the path, as it is for real storage, while latencies are drawn
+// afresh for each check:
+struct SyntheticProber {
+    mean_latency: Duration,
+    failure_rate: f64,
+    hang_rate: f64,
+    hang_timeout: Duration,
+    seed: u64,
+    calls: AtomicU64,
+}
+
+#[derive(Debug)]
+struct SyntheticHang;
+
+impl PendingCheck for SyntheticHang {
+    fn try_wait(&mut self) -> io::Result<Option<String>> {
+        Ok(None)
+    }
+}
+
+impl Prober for SyntheticProber {
+    fn check(
+        &self,
+        mount_point: &Path,
+        _namespaced: Option<&NamespacedPath>,
+    ) -> Result<(MountStatus, Option<FilesystemStats>)> {
+        let start_time = Instant::now();
+        let behaviour = unit_interval(path_hash(mount_point) ^ self.seed);
+
+        if behaviour < self.hang_rate {
+            thread::sleep(self.hang_timeout);
+            return Ok((
+                MountStatus::CheckRunning {
+                    process: Box::new(SyntheticHang),
+                    start_time,
+                },
+                None,
+            ));
+        }
+
+        let call = self.calls.fetch_add(1, Ordering::Relaxed);
+        let u = unit_interval(self.seed.wrapping_add(call));
+        // Inverse transform sampling of an exponential distribution:
+        let latency = -(1.0 - u).ln()
+            * (self.mean_latency.as_secs() as f64 * 1e9
+                + f64::from(self.mean_latency.subsec_nanos()));
+        thread::sleep(Duration::from_nanos(latency as u64));
+
+        if behaviour < self.hang_rate + self.failure_rate {
+            Ok((MountStatus::CheckFailed(1), None))
+        } else {
+            Ok((MountStatus::Alive, None))
+        }
+    }
+}
+
+fn splitmix64(mut x: u64) -> u64 {
+    x = x.wrapping_add(0x9e37_79b9_7f4a_7c15);
+    x = (x ^ (x >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+    x = (x ^ (x >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+    x ^ (x >> 31)
+}
+
+// A value in [0, 1) from the top 53 bits:
+pub fn unit_interval(x: u64) -> f64 {
+    (splitmix64(x) >> 11) as f64 / (1u64 << 53) as f64
+}
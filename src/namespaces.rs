@@ -0,0 +1,259 @@
+// Mounts which only exist inside other mount namespaces
+//
+// Container runtimes and CSI drivers mount volumes inside each container's own
+// mount namespace, where they never appear in /proc/self/mounts. With
+// --mount-namespaces the mount table is extended with every other namespace
+// found through /proc/PID/ns/mnt. Each namespace's mountinfo is read once,
+// through the lowest-numbered process in it, and a mount is skipped if the same
+// directory of the same filesystem is already mounted on the host or in a
+// namespace we've already seen, so a volume shared by hundreds of pods is
+// checked once. Kernel pseudo-filesystems, of which every container has its own
+// copy, are ignored.
+//
+// These mounts are reported as mnt:[INODE]/PATH, the namespace as shown by
+// readlink /proc/PID/ns/mnt followed by the path inside it. Processes come and
+// go while the namespace lives on, so no process ID is part of the name, and
+// the state, history and any hung check of the mount outlive the process we
+// first found it through. They are checked by a copy of ourselves which first
+// joins the namespace with setns(2) so absolute symlinks and automounts
+// resolve just as they do for the container's own processes. If the process
+// we found the namespace through has gone it looks for another; if none is
+// left the namespace and its mounts have gone too and the check is skipped.
+
+use std::ffi::OsString;
+#[cfg(target_os = "linux")]
+use std::fs;
+use std::io;
+#[cfg(target_os = "linux")]
+use std::path::{Path, PathBuf};
+
+use crate::get_mounts::{MountPoint, MountSource};
+
+pub const PROBE_ARGUMENT: &str = "--namespace-probe";
+pub const STATFS_ARGUMENT: &str = "--statfs";
+
+/// The probe's exit code when no process is left in the namespace
+pub const NAMESPACE_GONE: i32 = 3;
+
+#[cfg(target_os = "linux")]
+const PSEUDO_FILESYSTEMS: &[&str] = &[
+    "autofs",
+    "binfmt_misc",
+    "bpf",
+    "cgroup",
+    "cgroup2",
+    "configfs",
+    "debugfs",
+    "devpts",
+    "fusectl",
+    "hugetlbfs",
+    "mqueue",
+    "nsfs",
+    "proc",
+    "pstore",
+    "securityfs",
+    "sysfs",
+    "tracefs",
+];
+
+/// The host's mount table plus the mounts unique to other namespaces
+pub struct NamespacedMounts;
+
+#[cfg(target_os = "linux")]
+impl MountSource for NamespacedMounts {
+    fn mount_points(&self) -> io::Result<Vec<MountPoint>> {
+        use std::collections::HashSet;
+
+        use crate::get_mounts::{get_mount_points, read_mountinfo, NamespacedPath};
+
+        let mut mount_points = get_mount_points()?;
+        let mut seen: HashSet<(String, PathBuf)> =
+            read_mountinfo(Path::new("/proc/self/mountinfo"))?
+                .into_iter()
+                .map(|info| (info.device, info.root))
+                .collect();
+
+        for (namespace, pid) in discover()? {
+            // The process may have exited since we found it:
+            let mountinfo = PathBuf::from(format!("/proc/{}/mountinfo", pid));
+            let mount_table = match read_mountinfo(&mountinfo) {
+                Ok(mount_table) => mount_table,
+                Err(_) => continue,
+            };
+
+            for info in mount_table {
+                if PSEUDO_FILESYSTEMS.contains(&info.mount_point.fs_type.as_str())
+                    || !seen.insert((info.device, info.root))
+                {
+                    continue;
+                }
+                let mount_point = info.mount_point;
+                mount_points.push(MountPoint {
+                    path: namespaced_name(namespace, &mount_point.path),
+                    fs_type: mount_point.fs_type,
+                    source: mount_point.source,
+                    namespace: Some(NamespacedPath {
+                        namespace,
+                        pid,
+                        path: mount_point.path,
+                    }),
+                });
+            }
+        }
+
+        Ok(mount_points)
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+impl MountSource for NamespacedMounts {
+    fn mount_points(&self) -> io::Result<Vec<MountPoint>> {
+        Err(io::Error::new(
+            io::ErrorKind::Other,
+            "Mount namespaces are only supported on Linux",
+        ))
+    }
+}
+
+/// Every mount namespace other than our own, as (inode, lowest pid) pairs
+#[cfg(target_os = "linux")]
+fn discover() -> io::Result<Vec<(u64, u32)>> {
+    use std::collections::btree_map::{BTreeMap, Entry};
+    use std::os::unix::fs::MetadataExt;
+
+    let own_namespace = fs::metadata("/proc/self/ns/mnt")?.ino();
+    let mut namespaces = BTreeMap::new();
+
+    for entry in fs::read_dir("/proc")? {
+        let entry = match entry {
+            Ok(entry) => entry,
+            Err(_) => continue,
+        };
+        let pid: u32 = match entry.file_name().to_str().and_then(|n| n.parse().ok()) {
+            Some(pid) => pid,
+            None => continue,
+        };
+        // Processes which have exited or which we aren't allowed to inspect
+        // are skipped:
+        let namespace = match fs::metadata(entry.path().join("ns/mnt")) {
+            Ok(metadata) => metadata.ino(),
+            Err(_) => continue,
+        };
+        if namespace == own_namespace {
+            continue;
+        }
+        match namespaces.entry(namespace) {
+            Entry::Vacant(entry) => {
+                entry.insert(pid);
+            }
+            Entry::Occupied(mut entry) => {
+                if pid < *entry.get() {
+                    entry.insert(pid);
+                }
+            }
+        }
+    }
+
+    Ok(namespaces.into_iter().collect())
+}
+
+#[cfg(target_os = "linux")]
+fn namespaced_name(namespace: u64, path: &Path) -> PathBuf {
+    let mut name = OsString::from(format!("mnt:[{}]", namespace));
+    name.push(path.as_os_str());
+    PathBuf::from(name)
+}
+
+// Any process which is in the namespace, for when the one we were given has
+// exited or its pid has been reused by one in a different namespace:
+#[cfg(target_os = "linux")]
+fn find_namespace(namespace: u64) -> Option<fs::File> {
+    let entries = fs::read_dir("/proc").ok()?;
+    for entry in entries.filter_map(|entry| entry.ok()) {
+        if let Some(file) = open_namespace(&entry.path().join("ns/mnt"), namespace) {
+            return Some(file);
+        }
+    }
+    None
+}
+
+#[cfg(target_os = "linux")]
+fn open_namespace(path: &Path, namespace: u64) -> Option<fs::File> {
+    use std::os::unix::fs::MetadataExt;
+
+    let file = fs::File::open(path).ok()?;
+    match file.metadata() {
+        Ok(ref metadata) if metadata.ino() == namespace => Some(file),
+        _ => None,
+    }
+}
+
+/// Entry point for the child process, given PID NAMESPACE PATH [--statfs]:
+/// returns the exit code
+#[cfg(target_os = "linux")]
+pub fn run_probe(args: &[OsString]) -> i32 {
+    use std::os::unix::io::AsRawFd;
+
+    use libc;
+
+    use crate::statfs;
+
+    let (pid, namespace, mount_point) = match (
+        args.get(0)
+            .and_then(|a| a.to_str())
+            .and_then(|a| a.parse::<u32>().ok()),
+        args.get(1)
+            .and_then(|a| a.to_str())
+            .and_then(|a| a.parse::<u64>().ok()),
+        args.get(2),
+    ) {
+        (Some(pid), Some(namespace), Some(mount_point)) => (pid, namespace, Path::new(mount_point)),
+        _ => {
+            eprintln!(
+                "Usage: {} PID NAMESPACE PATH [{}]",
+                PROBE_ARGUMENT, STATFS_ARGUMENT
+            );
+            return 2;
+        }
+    };
+    let collect_statfs = args.get(3).map_or(false, |a| a == STATFS_ARGUMENT);
+
+    let namespace_file =
+        match open_namespace(Path::new(&format!("/proc/{}/ns/mnt", pid)), namespace)
+            .or_else(|| find_namespace(namespace))
+        {
+            Some(file) => file,
+            None => {
+                eprintln!("Mount namespace {} no longer exists", namespace);
+                return NAMESPACE_GONE;
+            }
+        };
+
+    if unsafe { libc::setns(namespace_file.as_raw_fd(), libc::CLONE_NEWNS) } != 0 {
+        eprintln!(
+            "Unable to enter mount namespace {}: {}",
+            namespace,
+            io::Error::last_os_error()
+        );
+        return 2;
+    }
+
+    if collect_statfs {
+        statfs::run_probe(mount_point)
+    } else {
+        // stat(1) may not exist inside the container so we do its job:
+        match fs::metadata(mount_point) {
+            Ok(_) => 0,
+            Err(e) => {
+                eprintln!("stat({}) failed: {}", mount_point.display(), e);
+                1
+            }
+        }
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+pub fn run_probe(_args: &[OsString]) -> i32 {
+    eprintln!("Mount namespaces are only supported on Linux");
+    2
+}
@@ -0,0 +1,398 @@
+// A single bounded check for cron and monitoring systems
+//
+// --once-only runs one normal cycle, so it takes as long as the check threads
+// need to get through every mount, including the full check timeout for each
+// hung one in turn, and it exits with 0 whatever it finds. `mount_status_monitor
+// check` is a monitoring plugin for Nagios, Icinga and the like instead. It
+// starts a check of every mount at once, waits no longer than --deadline in
+// total, and exits with the standard plugin codes:
+//
+//   0  OK        every mount answered within --warning seconds
+//   1  WARNING   some mount took longer than --warning seconds to answer
+//   2  CRITICAL  a check failed, took longer than --critical seconds or had
+//                not answered by the deadline
+//   3  UNKNOWN   the mounts could not be checked at all
+//
+// The first line of output is a summary followed by performance data with the
+// time each mount took to answer, and each problem mount gets a line of its
+// own after it. Checks still running at the deadline are killed and left
+// behind rather than waited for, since a check stuck on a dead NFS server
+// can't be reaped until the server comes back. In case anything else overruns,
+// a watchdog thread exits with UNKNOWN a second after the deadline.
+
+use std::collections::HashMap;
+use std::io::{self, Write};
+use std::path::Path;
+use std::thread;
+use std::time::{Duration, Instant};
+
+use argparse::{ArgumentParser, Collect, Store, StoreTrue};
+use libc;
+
+use crate::config::excluded;
+use crate::errors::*;
+use crate::get_mounts::{MountPoint, MountSource, SystemMounts};
+use crate::namespaces::{self, NamespacedMounts};
+use crate::probe::ProcessProber;
+use crate::stats::seconds;
+
+const OK: i32 = 0;
+const WARNING: i32 = 1;
+const CRITICAL: i32 = 2;
+const UNKNOWN: i32 = 3;
+
+const STATE_NAMES: [&str; 4] = ["OK", "WARNING", "CRITICAL", "UNKNOWN"];
+
+// How often to look for checks which have exited:
+const REAP_INTERVAL: Duration = Duration::from_millis(1);
+
+enum Outcome {
+    Answered(Duration),
+    Failed(String, Duration),
+    Hung,
+    NotStarted(String),
+    // A container which exited before its mount could be checked:
+    Gone,
+}
+
+struct Thresholds {
+    warning: Duration,
+    critical: Duration,
+    deadline: Duration,
+}
+
+impl Thresholds {
+    fn state(&self, outcome: &Outcome) -> i32 {
+        match *outcome {
+            Outcome::Answered(took) if took > self.critical => CRITICAL,
+            Outcome::Answered(took) if took > self.warning => WARNING,
+            Outcome::Answered(_) => OK,
+            Outcome::Failed(..) | Outcome::Hung => CRITICAL,
+            Outcome::Gone => OK,
+            Outcome::NotStarted(_) => UNKNOWN,
+        }
+    }
+
+    // A problem mount's line of the long output:
+    fn describe(&self, outcome: &Outcome) -> String {
+        match *outcome {
+            Outcome::Answered(took) => format!("answered after {:.3}s", seconds(took)),
+            Outcome::Failed(ref how, took) => {
+                format!("check {} after {:.3}s", how, seconds(took))
+            }
+            Outcome::Hung => format!("no answer within {}s", seconds(self.deadline)),
+            Outcome::Gone => "the mount namespace no longer exists".to_owned(),
+            Outcome::NotStarted(ref e) => format!("unable to start a check: {}", e),
+        }
+    }
+}
+
+// Collect the outcome of every check which has exited so far:
+fn reap(
+    mount_points: &[MountPoint],
+    pending: &mut HashMap<libc::pid_t, usize>,
+    started: &[Instant],
+    outcomes: &mut [Outcome],
+) {
+    // Children are reaped directly rather than through std::process::Child,
+    // so one wait covers all of them:
+    while !pending.is_empty() {
+        let mut status: libc::c_int = 0;
+        let pid = unsafe { libc::waitpid(-1, &mut status, libc::WNOHANG) };
+        if pid <= 0 {
+            return;
+        }
+        if let Some(index) = pending.remove(&pid) {
+            let took = started[index].elapsed();
+            outcomes[index] = if libc::WIFEXITED(status) {
+                match libc::WEXITSTATUS(status) {
+                    0 => Outcome::Answered(took),
+                    // Only a namespaced check can exit with this:
+                    namespaces::NAMESPACE_GONE if mount_points[index].namespace.is_some() => {
+                        Outcome::Gone
+                    }
+                    rc => Outcome::Failed(format!("exited with {}", rc), took),
+                }
+            } else {
+                Outcome::Failed(
+                    format!("was killed by signal {}", libc::WTERMSIG(status)),
+                    took,
+                )
+            };
+        }
+    }
+}
+
+// Check every mount at once, collecting whatever has finished by the deadline:
+fn check_all(
+    mount_points: &[MountPoint],
+    prober: &ProcessProber,
+    deadline: Instant,
+) -> Vec<Outcome> {
+    let mut outcomes: Vec<Outcome> = Vec::with_capacity(mount_points.len());
+    let mut started = Vec::with_capacity(mount_points.len());
+    // Checks which are still running, by process ID:
+    let mut pending = HashMap::new();
+
+    for (index, mount_point) in mount_points.iter().enumerate() {
+        started.push(Instant::now());
+        let spawned = prober
+            .command(&mount_point.path, mount_point.namespace.as_ref())
+            .and_then(|mut command| command.spawn().chain_err(|| "Unable to spawn process"));
+        match spawned {
+            Ok(child) => {
+                pending.insert(child.id() as libc::pid_t, index);
+                outcomes.push(Outcome::Hung);
+            }
+            Err(e) => outcomes.push(Outcome::NotStarted(e.to_string())),
+        }
+        // Starting thousands of checks takes a while, and the early ones
+        // shouldn't be charged for it:
+        reap(mount_points, &mut pending, &started, &mut outcomes);
+    }
+
+    loop {
+        reap(mount_points, &mut pending, &started, &mut outcomes);
+        let now = Instant::now();
+        if pending.is_empty() || now >= deadline {
+            break;
+        }
+        thread::sleep(REAP_INTERVAL.min(deadline - now));
+    }
+
+    // Whatever is left is hung. It is killed but not waited for:
+    for &pid in pending.keys() {
+        unsafe {
+            libc::kill(pid, libc::SIGKILL);
+        }
+    }
+    outcomes
+}
+
+// A performance data label, quoted as the plugin guidelines require:
+fn label(path: &Path) -> String {
+    format!("'{}'", path.to_string_lossy().replace('\'', "''"))
+}
+
+pub fn run(args: Vec<String>) -> Result<()> {
+    let mut deadline: f64 = 10.0;
+    let mut warning: f64 = 1.0;
+    let mut critical: f64 = 5.0;
+    let mut mounts: Vec<String> = Vec::new();
+    let mut exclude_fstypes: Vec<String> = Vec::new();
+    let mut exclude_mounts: Vec<String> = Vec::new();
+    let mut mount_namespaces = false;
+
+    {
+        let mut ap = ArgumentParser::new();
+        ap.set_description(
+            "Check every mount once within a deadline and report the result as a monitoring plugin",
+        );
+
+        ap.refer(&mut deadline).add_option(
+            &["-t", "--deadline"],
+            Store,
+            "Number of seconds after which we report and exit, however many checks are still running",
+        );
+
+        ap.refer(&mut warning).add_option(
+            &["-w", "--warning"],
+            Store,
+            "Warn about mounts which take longer than this many seconds to answer",
+        );
+
+        ap.refer(&mut critical).add_option(
+            &["-c", "--critical"],
+            Store,
+            "Mounts which take longer than this many seconds to answer are critical",
+        );
+
+        ap.refer(&mut mounts).add_option(
+            &["--mount"],
+            Collect,
+            "Only check mounts at or below this path (may be repeated)",
+        );
+
+        ap.refer(&mut exclude_fstypes).add_option(
+            &["--exclude-fstype"],
+            Collect,
+            "Do not check mounts of this filesystem type (may be repeated)",
+        );
+
+        ap.refer(&mut exclude_mounts).add_option(
+            &["--exclude-mount"],
+            Collect,
+            "Do not check mounts at or below this path (may be repeated)",
+        );
+
+        ap.refer(&mut mount_namespaces).add_option(
+            &["--mount-namespaces"],
+            StoreTrue,
+            "Also check mounts which only exist in other mount namespaces, such as containers",
+        );
+
+        let mut args = args;
+        args[0] = "mount_status_monitor check".to_owned();
+        match ap.parse(args, &mut io::stdout(), &mut io::stderr()) {
+            Ok(()) => {}
+            Err(0) => ::std::process::exit(0),
+            // argparse exits with 2 on a usage error, which monitoring
+            // systems would read as CRITICAL, so it is UNKNOWN instead:
+            Err(_) => ::std::process::exit(UNKNOWN),
+        }
+    }
+
+    let seconds_of = |value: f64| Duration::from_nanos((value.max(0.0) * 1e9) as u64);
+    let thresholds = Thresholds {
+        warning: seconds_of(warning),
+        critical: seconds_of(critical),
+        deadline: seconds_of(deadline),
+    };
+    let start_time = Instant::now();
+    let deadline = start_time + thresholds.deadline;
+
+    let watchdog_timeout = thresholds.deadline + Duration::from_secs(1);
+    thread::spawn(move || {
+        thread::sleep(watchdog_timeout);
+        println!(
+            "MOUNTS UNKNOWN - gave up after {}s",
+            seconds(watchdog_timeout)
+        );
+        let _ = io::stdout().flush();
+        ::std::process::exit(UNKNOWN);
+    });
+
+    // Problems with the checks themselves are UNKNOWN rather than the
+    // exit code an error usually gets:
+    let unknown = |e: Error| -> ! {
+        println!("MOUNTS UNKNOWN - {}", e);
+        let _ = io::stdout().flush();
+        ::std::process::exit(UNKNOWN);
+    };
+
+    let prober = ProcessProber {
+        statfs_helper: None,
+        namespace_helper: if mount_namespaces {
+            Some(
+                ::std::env::current_exe()
+                    .chain_err(|| "Unable to locate our own executable")
+                    .unwrap_or_else(|e| unknown(e)),
+            )
+        } else {
+            None
+        },
+        timeout: thresholds.deadline,
+    };
+    let mount_source: Box<dyn MountSource> = if mount_namespaces {
+        Box::new(NamespacedMounts)
+    } else {
+        Box::new(SystemMounts)
+    };
+    let mut mount_points = mount_source
+        .mount_points()
+        .chain_err(|| "Unable to read the mount table")
+        .unwrap_or_else(|e| unknown(e));
+    mount_points.retain(|mount_point| {
+        !excluded(mount_point, &exclude_fstypes, &exclude_mounts)
+            && (mounts.is_empty()
+                || mounts
+                    .iter()
+                    .any(|mount| mount_point.path.starts_with(mount)))
+    });
+    mount_points.sort_by(|a, b| a.path.cmp(&b.path));
+    // Mounts stacked on the same path are only visible as the top one:
+    mount_points.dedup_by(|a, b| a.path == b.path);
+    if mount_points.is_empty() {
+        unknown("No mounts to check".into());
+    }
+
+    let outcomes = check_all(&mount_points, &prober, deadline);
+
+    let state = outcomes
+        .iter()
+        .map(|outcome| thresholds.state(outcome))
+        // CRITICAL outranks UNKNOWN, which outranks WARNING:
+        .max_by_key(|&state| match state {
+            CRITICAL => 3,
+            UNKNOWN => 2,
+            state => state,
+        })
+        .unwrap_or(OK);
+
+    let mut counts: Vec<(&str, usize)> = Vec::new();
+    for outcome in &outcomes {
+        let kind = match *outcome {
+            Outcome::Answered(took) if took > thresholds.warning => "slow",
+            Outcome::Answered(_) => continue,
+            Outcome::Failed(..) => "failed",
+            Outcome::Hung => "hung",
+            Outcome::NotStarted(_) => "not checked",
+            Outcome::Gone => "gone",
+        };
+        match counts.iter_mut().find(|&&mut (k, _)| k == kind) {
+            Some(count) => count.1 += 1,
+            None => counts.push((kind, 1)),
+        }
+    }
+    let summary = if counts.is_empty() {
+        format!(
+            "{} mounts answered within {}s",
+            outcomes.len(),
+            seconds(thresholds.warning)
+        )
+    } else {
+        format!(
+            "{} out of {} mounts",
+            counts
+                .iter()
+                .map(|&(kind, count)| format!("{} {}", count, kind))
+                .collect::<Vec<_>>()
+                .join(", "),
+            outcomes.len()
+        )
+    };
+
+    let mut output = format!(
+        "MOUNTS {} - {} | 'mounts'={};;;0 'problems'={};;;0",
+        STATE_NAMES[state as usize],
+        summary,
+        outcomes.len(),
+        outcomes
+            .iter()
+            .filter(|outcome| thresholds.state(outcome) != OK)
+            .count()
+    );
+    for (mount_point, outcome) in mount_points.iter().zip(outcomes.iter()) {
+        let value = match *outcome {
+            Outcome::Answered(took) | Outcome::Failed(_, took) => {
+                format!("{:.6}s", seconds(took))
+            }
+            Outcome::Hung | Outcome::NotStarted(_) | Outcome::Gone => "U".to_owned(),
+        };
+        output.push_str(&format!(
+            " {}={};{};{};0;{}",
+            label(&mount_point.path),
+            value,
+            seconds(thresholds.warning),
+            seconds(thresholds.critical),
+            seconds(thresholds.deadline)
+        ));
+    }
+    output.push('\n');
+    for (mount_point, outcome) in mount_points.iter().zip(outcomes.iter()) {
+        if thresholds.state(outcome) != OK {
+            output.push_str(&format!(
+                "{}: {}\n",
+                mount_point.path.display(),
+                thresholds.describe(outcome)
+            ));
+        }
+    }
+
+    let stdout = io::stdout();
+    let mut stdout = stdout.lock();
+    let _ = stdout.write_all(output.as_bytes());
+    let _ = stdout.flush();
+    // Exiting straight away leaves any hung checks to init:
+    ::std::process::exit(state);
+}
@@ -0,0 +1,235 @@
+// How a single mountpoint is checked
+//
+// check_mounts() only needs something which can check a path within a
+// deadline and, if the deadline passes, hand back a handle which can later be
+// polled without blocking to see whether the check has finally finished. The
+// real implementation launches a child process; benchmarks and simulations
+// substitute their own.
+
+use std::fmt;
+use std::io::{self, Read};
+use std::os::unix::process::ExitStatusExt;
+use std::path::{Path, PathBuf};
+use std::process;
+use std::sync::atomic::Ordering;
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+
+use wait_timeout::ChildExt;
+
+use crate::errors::*;
+use crate::get_mounts::NamespacedPath;
+use crate::namespaces;
+use crate::statfs;
+use crate::stats;
+use crate::MountStatus;
+
+// How long a check may take before the mount is considered hung, unless
+// --check-timeout says otherwise:
+pub const CHECK_TIMEOUT: Duration = Duration::from_secs(3);
+
+lazy_static! {
+    // Hung checks whose mounts are no longer being monitored:
+    static ref ABANDONED: Mutex<Vec<Box<dyn PendingCheck>>> = Mutex::new(Vec::new());
+}
+
+pub trait Prober: Sync {
+    /// Check a mountpoint, waiting no longer than the deadline. Mounts in
+    /// other namespaces also say how to reach them from inside.
+    fn check(
+        &self,
+        mount_point: &Path,
+        namespaced: Option<&NamespacedPath>,
+    ) -> Result<(MountStatus, Option<statfs::FilesystemStats>)>;
+}
+
+/// A check which missed its deadline and has not yet exited
+pub trait PendingCheck: Send + fmt::Debug {
+    /// Returns a description of how the check exited once it has done so
+    fn try_wait(&mut self) -> io::Result<Option<String>>;
+
+    /// The check's process ID, if it is a real process
+    fn id(&self) -> Option<u32> {
+        None
+    }
+}
+
+impl PendingCheck for process::Child {
+    fn try_wait(&mut self) -> io::Result<Option<String>> {
+        process::Child::try_wait(self).map(|status| status.map(|s| s.to_string()))
+    }
+
+    fn id(&self) -> Option<u32> {
+        Some(process::Child::id(self))
+    }
+}
+
+/// Keep polling a hung check after its mount has gone away
+pub fn abandon(process: Box<dyn PendingCheck>) {
+    ABANDONED.lock().unwrap().push(process);
+}
+
+/// Forget any abandoned checks which have exited since the last call
+pub fn reap_abandoned() {
+    let mut abandoned = ABANDONED.lock().unwrap();
+    let mut index = 0;
+    while index < abandoned.len() {
+        let finished = match abandoned[index].try_wait() {
+            Ok(Some(status)) => {
+                info!(
+                    "Check of a mount which is no longer monitored exited with {}",
+                    status
+                );
+                true
+            }
+            Ok(None) => false,
+            Err(e) => {
+                error!(
+                    "Unable to poll the check of a mount which is no longer monitored: {}",
+                    e
+                );
+                true
+            }
+        };
+        if finished {
+            abandoned.swap_remove(index);
+        } else {
+            index += 1;
+        }
+    }
+}
+
+/// Checks each mount by running stat(1), or a copy of ourselves which also
+/// collects the capacity with statvfs(2) when a helper path is provided
+pub struct ProcessProber {
+    pub statfs_helper: Option<PathBuf>,
+    // Our own executable, which enters the namespace of mounts in containers:
+    pub namespace_helper: Option<PathBuf>,
+    pub timeout: Duration,
+}
+
+impl ProcessProber {
+    /// The process which checks a mount, ready to be spawned
+    pub fn command(
+        &self,
+        mount_point: &Path,
+        namespaced: Option<&NamespacedPath>,
+    ) -> Result<process::Command> {
+        Ok(match (namespaced, &self.statfs_helper) {
+            (Some(namespaced), statfs_helper) => {
+                let helper = self
+                    .namespace_helper
+                    .as_ref()
+                    .ok_or("No helper is available to check mounts in other namespaces")?;
+                let mut command = process::Command::new(helper);
+                command
+                    .arg(namespaces::PROBE_ARGUMENT)
+                    .arg(namespaced.pid.to_string())
+                    .arg(namespaced.namespace.to_string())
+                    .arg(&namespaced.path);
+                if statfs_helper.is_some() {
+                    command
+                        .arg(namespaces::STATFS_ARGUMENT)
+                        .stdout(process::Stdio::piped());
+                } else {
+                    command.stdout(process::Stdio::null());
+                }
+                command
+            }
+            (None, Some(helper)) => {
+                let mut command = process::Command::new(helper);
+                command
+                    .arg(statfs::PROBE_ARGUMENT)
+                    .arg(mount_point)
+                    .stdout(process::Stdio::piped());
+                command
+            }
+            (None, None) => {
+                let mut command = process::Command::new("/usr/bin/stat");
+                command.arg(mount_point).stdout(process::Stdio::null());
+                command
+            }
+        })
+    }
+}
+
+impl Prober for ProcessProber {
+    fn check(
+        &self,
+        mount_point: &Path,
+        namespaced: Option<&NamespacedPath>,
+    ) -> Result<(MountStatus, Option<statfs::FilesystemStats>)> {
+        let start_time = Instant::now();
+        let mut command = self.command(mount_point, namespaced)?;
+        let mut child = match stats::SPAWN.time(|| command.spawn()) {
+            Ok(child) => child,
+            Err(e) => {
+                stats::SPAWN_FAILURES.fetch_add(1, Ordering::Relaxed);
+                return Err(e).chain_err(|| "Unable to spawn process to check mount");
+            }
+        };
+
+        let child_result = child
+            .wait_timeout(self.timeout)
+            .chain_err(|| "Unable to wait on stat command")?;
+        match child_result {
+            None => {
+                /*
+                    The process has not exited and we're not going to wait for a
+                    potentially very long period of time for it to recover.
+
+                    We'll attempt to clean up the check process by killing it, which
+                    is defined as sending SIGKILL on Unix:
+
+                    https://doc.rust-lang.org/std/process/struct.Child.html#method.kill
+
+                    The mount_status structure returned will include this child
+                    process instance so future checks can perform a non-blocking
+                    test to see whether it has finally exited:
+                */
+                if let Err(err) = child.kill() {
+                    eprintln!("Unable to kill process {}: {:?}", child.id(), err)
+                };
+
+                Ok((
+                    MountStatus::CheckRunning {
+                        process: Box::new(child),
+                        start_time: start_time,
+                    },
+                    None,
+                ))
+            }
+            Some(exit_status) => {
+                let rc = exit_status.code();
+                match rc {
+                    Some(0) => {
+                        // The helper has already exited so its output is complete
+                        // and reading it cannot block:
+                        let mut output = String::new();
+                        let filesystem_stats = match child.stdout {
+                            Some(ref mut stdout) => stdout
+                                .read_to_string(&mut output)
+                                .ok()
+                                .and_then(|_| statfs::parse_stats(&output)),
+                            None => None,
+                        };
+                        Ok((MountStatus::Alive, filesystem_stats))
+                    }
+                    Some(namespaces::NAMESPACE_GONE) if namespaced.is_some() => {
+                        // The container has exited since we read its mount
+                        // table and the mount will have left the next one:
+                        Err("The mount namespace no longer exists".into())
+                    }
+                    Some(rc) => Ok((MountStatus::CheckFailed(rc), None)),
+                    None => {
+                        // If there isn't a return code, there _should_ always be a signal
+                        Ok((
+                            MountStatus::CheckSignaled(exit_status.signal().unwrap_or(0)),
+                            None,
+                        ))
+                    }
+                }
+            }
+        }
+    }
+}
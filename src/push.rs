@@ -0,0 +1,372 @@
+// Background delivery of metrics to a Prometheus push-gateway
+//
+// The push-gateway is usually reached over the same network whose failure we
+// are trying to report, so a push must never be allowed to delay the next
+// round of mount checks. The main loop hands each snapshot of the metrics to a
+// dedicated sender thread through a single-entry mailbox: if the sender is
+// still busy when the next snapshot arrives the older one is discarded, since
+// the push-gateway only ever keeps the most recent values anyway.
+//
+// The HTTP client used by the prometheus crate does not offer a per-request
+// deadline so each attempt runs on its own short-lived thread which we stop
+// waiting for once the deadline has passed. Much like the stat checks, we
+// won't start a new attempt while an abandoned one is still pending so a
+// black-holed gateway cannot cause connections to accumulate.
+
+use std::collections::HashMap;
+use std::sync::mpsc;
+use std::sync::{Arc, Condvar, Mutex};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use hostname;
+use prometheus;
+use prometheus::proto::MetricFamily;
+
+use crate::errors::*;
+use crate::stats::seconds;
+
+lazy_static! {
+    static ref PUSH_DURATION: prometheus::Histogram = register_histogram!(
+        "metrics_push_duration_seconds",
+        "Time taken by successful pushes to the push-gateway",
+        vec![0.01, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0]
+    )
+    .unwrap();
+    static ref PUSH_FAILURES: prometheus::IntCounterVec = register_int_counter_vec!(
+        "metrics_push_failures_total",
+        "Number of pushes to the push-gateway which failed",
+        &["reason"]
+    )
+    .unwrap();
+    static ref PUSH_COALESCED: prometheus::IntCounter = register_int_counter!(
+        "metrics_push_snapshots_coalesced_total",
+        "Number of metric snapshots replaced by a newer one before they could be pushed"
+    )
+    .unwrap();
+}
+
+pub struct PushOptions {
+    pub gateway: String,
+    pub deadline: Duration,
+    pub initial_retry_interval: Duration,
+    pub max_retry_interval: Duration,
+}
+
+struct Mailbox {
+    pending: Option<Vec<MetricFamily>>,
+    busy: bool,
+}
+
+pub struct Pusher {
+    mailbox: Arc<(Mutex<Mailbox>, Condvar)>,
+}
+
+impl Pusher {
+    pub fn start(options: PushOptions) -> Result<Pusher> {
+        let instance = hostname::get()
+            .chain_err(|| "Unable to determine the hostname")?
+            .to_string_lossy()
+            .into_owned();
+
+        let mailbox = Arc::new((
+            Mutex::new(Mailbox {
+                pending: None,
+                busy: false,
+            }),
+            Condvar::new(),
+        ));
+
+        let sender_mailbox = mailbox.clone();
+        thread::Builder::new()
+            .name("metrics-push".into())
+            .spawn(move || run_sender(&sender_mailbox, &options, &instance))
+            .chain_err(|| "Unable to start the push-gateway sender thread")?;
+
+        Ok(Pusher { mailbox })
+    }
+
+    /// Queue a snapshot for delivery without waiting for the network
+    pub fn submit(&self, metrics: Vec<MetricFamily>) {
+        let (ref lock, ref cvar) = *self.mailbox;
+        let mut mailbox = lock.lock().unwrap();
+        if mailbox.pending.replace(metrics).is_some() {
+            PUSH_COALESCED.inc();
+        }
+        cvar.notify_all();
+    }
+
+    /// Wait up to `timeout` for the queued snapshot to be delivered, returning
+    /// whether the sender went idle. Used before exiting in once-only mode.
+    pub fn flush(&self, timeout: Duration) -> bool {
+        let deadline = Instant::now() + timeout;
+        let (ref lock, ref cvar) = *self.mailbox;
+        let mut mailbox = lock.lock().unwrap();
+        while mailbox.pending.is_some() || mailbox.busy {
+            let now = Instant::now();
+            if now >= deadline {
+                return false;
+            }
+            mailbox = cvar.wait_timeout(mailbox, deadline - now).unwrap().0;
+        }
+        true
+    }
+}
+
+fn run_sender(mailbox: &Arc<(Mutex<Mailbox>, Condvar)>, options: &PushOptions, instance: &str) {
+    let (ref lock, ref cvar) = **mailbox;
+    let mut sender = Sender::new(options, instance);
+
+    loop {
+        let metrics = {
+            let mut mailbox = lock.lock().unwrap();
+            mailbox.busy = false;
+            cvar.notify_all();
+            while mailbox.pending.is_none() {
+                mailbox = cvar.wait(mailbox).unwrap();
+            }
+            mailbox.busy = true;
+            mailbox.pending.take().unwrap()
+        };
+
+        if let Err(e) = sender.push(metrics.clone()) {
+            let retry_interval = sender.backoff();
+            warn!(
+                "Unable to push metrics to {} (retrying in {} seconds): {}",
+                options.gateway,
+                retry_interval.as_secs(),
+                e
+            );
+
+            // Retry this snapshot unless a newer one arrived meanwhile:
+            {
+                let mut mailbox = lock.lock().unwrap();
+                if mailbox.pending.is_none() {
+                    mailbox.pending = Some(metrics);
+                } else {
+                    PUSH_COALESCED.inc();
+                }
+            }
+
+            thread::sleep(retry_interval);
+        }
+    }
+}
+
+// The retry state of the sender thread, kept apart from the mailbox so that a
+// push can be made on demand:
+struct Sender<'a> {
+    options: &'a PushOptions,
+    instance: String,
+    retry_interval: Duration,
+    // An attempt which blew through its deadline and may still be running:
+    abandoned: Option<mpsc::Receiver<prometheus::Result<()>>>,
+}
+
+impl<'a> Sender<'a> {
+    fn new(options: &'a PushOptions, instance: &str) -> Sender<'a> {
+        Sender {
+            options,
+            instance: instance.to_owned(),
+            retry_interval: options.initial_retry_interval,
+            abandoned: None,
+        }
+    }
+
+    /// Push one snapshot, taking no longer than the deadline (or twice that
+    /// if an earlier attempt is still pending)
+    fn push(&mut self, metrics: Vec<MetricFamily>) -> Result<()> {
+        // An earlier attempt which blew through its deadline may still be
+        // holding a connection open. Give it one more deadline to finish
+        // before we try again so we never have more than one outstanding:
+        if let Some(previous) = self.abandoned.take() {
+            if let Err(mpsc::RecvTimeoutError::Timeout) =
+                previous.recv_timeout(self.options.deadline)
+            {
+                self.abandoned = Some(previous);
+                PUSH_FAILURES.with_label_values(&["previous_pending"]).inc();
+                return Err("a previous push has still not completed".into());
+            }
+        }
+
+        self.attempt(metrics)?;
+        self.retry_interval = self.options.initial_retry_interval;
+        Ok(())
+    }
+
+    /// How long to wait before retrying after a failed push, doubling the
+    /// wait after that up to the maximum
+    fn backoff(&mut self) -> Duration {
+        let retry_interval = self.retry_interval;
+        self.retry_interval = (retry_interval * 2).min(self.options.max_retry_interval);
+        retry_interval
+    }
+
+    fn attempt(&mut self, metrics: Vec<MetricFamily>) -> Result<()> {
+        let (tx, rx) = mpsc::channel();
+        let gateway = self.options.gateway.clone();
+        let grouping: HashMap<String, String> =
+            labels! {"instance".to_owned() => self.instance.clone()};
+        let start_time = Instant::now();
+
+        let spawned = thread::Builder::new()
+            .name("metrics-push-attempt".into())
+            .spawn(move || {
+                let _ = tx.send(prometheus::push_metrics(
+                    "mount_status_monitor",
+                    grouping,
+                    &gateway,
+                    metrics,
+                    None,
+                ));
+            });
+        if let Err(e) = spawned {
+            PUSH_FAILURES.with_label_values(&["spawn"]).inc();
+            return Err(e).chain_err(|| "Unable to start push attempt");
+        }
+
+        match rx.recv_timeout(self.options.deadline) {
+            Ok(Ok(())) => {
+                PUSH_DURATION.observe(seconds(start_time.elapsed()));
+                Ok(())
+            }
+            Ok(Err(e)) => {
+                PUSH_FAILURES.with_label_values(&["error"]).inc();
+                Err(format!("{}", e).into())
+            }
+            Err(mpsc::RecvTimeoutError::Timeout) => {
+                PUSH_FAILURES.with_label_values(&["timeout"]).inc();
+                self.abandoned = Some(rx);
+                Err(format!(
+                    "push did not complete within {} seconds",
+                    self.options.deadline.as_secs()
+                )
+                .into())
+            }
+            Err(mpsc::RecvTimeoutError::Disconnected) => {
+                PUSH_FAILURES.with_label_values(&["error"]).inc();
+                Err("push attempt exited without reporting a result".into())
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::io::{Read, Write};
+    use std::net::{TcpListener, TcpStream};
+    use std::sync::atomic::{AtomicUsize, Ordering};
+    use std::sync::mpsc;
+    use std::thread;
+    use std::time::{Duration, Instant};
+
+    use super::{PushOptions, Sender};
+
+    // A stand-in push-gateway which hands each connection to `respond`,
+    // reporting connections as they arrive:
+    fn gateway<F>(respond: F) -> (String, mpsc::Receiver<TcpStream>)
+    where
+        F: Fn(&mut TcpStream) + Send + 'static,
+    {
+        let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+        let address = listener.local_addr().unwrap().to_string();
+        let (tx, rx) = mpsc::channel();
+        thread::spawn(move || {
+            for stream in listener.incoming() {
+                let mut stream = stream.unwrap();
+                respond(&mut stream);
+                // Keep the connection open, as a black hole would:
+                if tx.send(stream).is_err() {
+                    return;
+                }
+            }
+        });
+        (address, rx)
+    }
+
+    fn answer(status: &'static str) -> impl Fn(&mut TcpStream) {
+        move |stream: &mut TcpStream| {
+            let mut request = Vec::new();
+            let mut buffer = [0; 4096];
+            // Read the headers and the (small) body before answering:
+            while !request.ends_with(b"\r\n\r\n") {
+                match stream.read(&mut buffer) {
+                    Ok(0) | Err(_) => return,
+                    Ok(n) => request.extend_from_slice(&buffer[..n]),
+                }
+            }
+            let _ = write!(
+                stream,
+                "HTTP/1.1 {}\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+                status
+            );
+            let _ = stream.shutdown(::std::net::Shutdown::Both);
+        }
+    }
+
+    fn options(gateway: String, deadline: Duration) -> PushOptions {
+        PushOptions {
+            gateway,
+            deadline,
+            initial_retry_interval: Duration::from_secs(1),
+            max_retry_interval: Duration::from_secs(4),
+        }
+    }
+
+    #[test]
+    fn push_succeeds() {
+        let (address, connections) = gateway(answer("202 Accepted"));
+        let options = options(address, Duration::from_secs(5));
+        let mut sender = Sender::new(&options, "test-host");
+
+        sender.push(Vec::new()).unwrap();
+        assert!(connections.try_recv().is_ok());
+        assert!(sender.abandoned.is_none());
+    }
+
+    #[test]
+    fn black_holed_gateway_hits_the_deadline() {
+        let (address, connections) = gateway(|_: &mut TcpStream| {});
+        let deadline = Duration::from_millis(200);
+        let options = options(address, deadline);
+        let mut sender = Sender::new(&options, "test-host");
+
+        let start_time = Instant::now();
+        assert!(sender.push(Vec::new()).is_err());
+        assert!(start_time.elapsed() < deadline * 3);
+        assert!(sender.abandoned.is_some());
+        // Holding the connection keeps the attempt stuck:
+        let _connection = connections.recv_timeout(deadline).unwrap();
+
+        // The abandoned attempt is given one more deadline and no second
+        // connection is opened while it is still pending:
+        let start_time = Instant::now();
+        let error = sender.push(Vec::new()).unwrap_err();
+        assert!(start_time.elapsed() >= deadline);
+        assert!(error.to_string().contains("previous push"));
+        assert!(sender.abandoned.is_some());
+        assert!(connections.try_recv().is_err());
+    }
+
+    #[test]
+    fn backoff_resets_after_success() {
+        // Fail the first push and accept the rest:
+        let requests = AtomicUsize::new(0);
+        let (address, _connections) = gateway(move |stream: &mut TcpStream| {
+            if requests.fetch_add(1, Ordering::SeqCst) == 0 {
+                answer("500 Internal Server Error")(stream)
+            } else {
+                answer("200 OK")(stream)
+            }
+        });
+        let options = options(address, Duration::from_secs(5));
+        let mut sender = Sender::new(&options, "test-host");
+
+        assert!(sender.push(Vec::new()).is_err());
+        let waits: Vec<u64> = (0..4).map(|_| sender.backoff().as_secs()).collect();
+        assert_eq!(waits, vec![1, 2, 4, 4]);
+
+        sender.push(Vec::new()).unwrap();
+        assert_eq!(sender.backoff(), Duration::from_secs(1));
+    }
+}
@@ -0,0 +1,794 @@
+// Replaying latency traces to evaluate a policy offline
+//
+// Choosing the poll interval and check timeout is a trade between noticing an
+// outage quickly, raising alarms for mounts which were only briefly slow, and
+// the load the checks put on servers, especially ones which are already
+// struggling. `mount_status_monitor replay` measures that trade for a candidate
+// policy by running traces of how mounts responded through the real
+// check_mounts() and scheduler code on a virtual clock, as the simulator does.
+//
+// A trace says how a check of each mount started at any moment would have
+// fared: how long it took, whether it failed, or whether nothing answered
+// until some later time. Traces come from either
+//
+//   --history FILE   the checks recorded by a monitor's --history-file. A
+//                    mount was really down during any run of failed or hung
+//                    checks lasting at least --min-outage seconds; shorter
+//                    runs are noise which the candidate ought to ride out.
+//   --synthetic N    N generated hosts whose checks take a log-normally
+//                    distributed time, with occasional latency spikes which
+//                    are not outages and occasional outages during which
+//                    nothing answers.
+//
+// Every host is replayed by its own scheduler and state map, as it would be by
+// its own monitor, and hosts are spread across the check threads. The report
+// covers how long outages took to be reported and to clear, how many were
+// missed, how often a healthy mount was reported as down and how many checks
+// were started, in total and against mounts which were down.
+
+use std::collections::HashMap;
+use std::io;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::time::{Duration, Instant, SystemTime};
+
+use argparse::{ArgumentParser, Collect, Store, StoreOption};
+use rayon::prelude::*;
+
+use crate::clock::{Clock, VirtualClock};
+use crate::errors::*;
+use crate::get_mounts::{MountPoint, MountSource, NamespacedPath};
+use crate::history;
+use crate::microbench::unit_interval;
+use crate::probe::{self, Prober};
+use crate::schedule::{OverrunPolicy, Scheduler};
+use crate::simulator::CycleTimer;
+use crate::statfs::FilesystemStats;
+use crate::stats::seconds;
+use crate::status_table::{path_hash, state_code};
+use crate::{check_mounts, MountState, MountStatus, StatusKind};
+
+// Synthetic baseline latencies are drawn afresh for each slice of this length:
+const BASELINE_STEP: Duration = Duration::from_secs(10);
+
+// The spread of synthetic baseline latencies around their median, as the
+// standard deviation of their logarithm:
+const BASELINE_SIGMA: f64 = 0.5;
+
+// What a check started at some moment would have run into:
+#[derive(Clone, Copy, Debug)]
+enum Response {
+    // The check takes this long, which is a hang if it's past the timeout:
+    Latency(Duration),
+    // The check fails straight away:
+    Error,
+    // Nothing answers until this far into the trace, if ever:
+    Unresponsive(Option<Duration>),
+}
+
+enum Responses {
+    // Each response applies from its offset until the next one's:
+    Recorded(Vec<(Duration, Response)>),
+    Synthetic {
+        key: u64,
+        median: f64,
+        // Periods which override the baseline, outages first:
+        episodes: Vec<(Duration, Duration, Response)>,
+    },
+}
+
+impl Responses {
+    fn at(&self, offset: Duration) -> Response {
+        match *self {
+            Responses::Recorded(ref responses) => {
+                let index = match responses.binary_search_by(|&(start, _)| start.cmp(&offset)) {
+                    Ok(index) => index,
+                    Err(0) => 0,
+                    Err(index) => index - 1,
+                };
+                responses
+                    .get(index)
+                    .map_or(Response::Error, |&(_, response)| response)
+            }
+            Responses::Synthetic {
+                key,
+                median,
+                ref episodes,
+            } => {
+                for &(start, end, response) in episodes {
+                    if start <= offset && offset < end {
+                        return response;
+                    }
+                }
+                let step = offset.as_secs() / BASELINE_STEP.as_secs();
+                let key = key ^ step.wrapping_mul(0x9e37_79b9_7f4a_7c15);
+                // A normal deviate by the Box-Muller transform:
+                let radius = (-2.0 * (1.0 - unit_interval(key)).ln()).sqrt();
+                let angle = 2.0 * ::std::f64::consts::PI * unit_interval(key.wrapping_add(1));
+                let latency = median * (BASELINE_SIGMA * radius * angle.cos()).exp();
+                Response::Latency(Duration::from_nanos((latency * 1e9) as u64))
+            }
+        }
+    }
+}
+
+struct MountTrace {
+    path: PathBuf,
+    responses: Responses,
+    // The periods during which the mount was really down, in order:
+    outages: Vec<(Duration, Duration)>,
+}
+
+// The mounts checked by one monitor:
+struct HostTrace {
+    mounts: Vec<MountTrace>,
+    length: Duration,
+}
+
+// Stands in for both the mount table and the check processes of one host:
+struct TraceProber<'a> {
+    host: &'a HostTrace,
+    indexes: HashMap<PathBuf, usize>,
+    clock: Arc<dyn Clock>,
+    start_time: Instant,
+    timeout: Duration,
+    timer: CycleTimer,
+}
+
+impl<'a> MountSource for TraceProber<'a> {
+    fn mount_points(&self) -> io::Result<Vec<MountPoint>> {
+        Ok(self
+            .host
+            .mounts
+            .iter()
+            .map(|mount| MountPoint {
+                path: mount.path.clone(),
+                fs_type: "replay".to_owned(),
+                source: "replay".to_owned(),
+                namespace: None,
+            })
+            .collect())
+    }
+}
+
+impl<'a> Prober for TraceProber<'a> {
+    fn check(
+        &self,
+        mount_point: &Path,
+        _namespaced: Option<&NamespacedPath>,
+    ) -> Result<(MountStatus, Option<FilesystemStats>)> {
+        let start_time = self.clock.now();
+        let index = *self
+            .indexes
+            .get(mount_point)
+            .ok_or_else(|| format!("{} is not in the trace", mount_point.display()))?;
+
+        let response = self.host.mounts[index]
+            .responses
+            .at(start_time.duration_since(self.start_time));
+        match response {
+            Response::Latency(latency) if latency < self.timeout => {
+                self.timer.took(latency);
+                Ok((MountStatus::Alive, None))
+            }
+            Response::Latency(latency) => {
+                self.timer
+                    .hung(self.timeout, start_time, Some(start_time + latency))
+            }
+            Response::Error => Ok((MountStatus::CheckFailed(1), None)),
+            Response::Unresponsive(until) => self.timer.hung(
+                self.timeout,
+                start_time,
+                until.map(|until| self.start_time + until),
+            ),
+        }
+    }
+}
+
+#[derive(Clone, Copy)]
+struct Policy {
+    interval: Duration,
+    timeout: Duration,
+    overrun_policy: OverrunPolicy,
+}
+
+// What a policy made of the traces, which add up across hosts:
+#[derive(Default)]
+struct Results {
+    hosts: u64,
+    mount_time: Duration,
+    outages: u64,
+    // Seconds from the start of each detected outage until it was reported:
+    detection: Vec<f64>,
+    // Seconds from the end of each detected outage until the mount was
+    // reported alive again:
+    recovery: Vec<f64>,
+    false_alarms: u64,
+    healthy_reports: u64,
+    false_reports: u64,
+    checks: u64,
+    checks_during_outages: u64,
+    overruns: u64,
+    skipped: u64,
+}
+
+impl Results {
+    fn merge(mut self, other: Results) -> Results {
+        self.hosts += other.hosts;
+        self.mount_time += other.mount_time;
+        self.outages += other.outages;
+        self.detection.extend(other.detection);
+        self.recovery.extend(other.recovery);
+        self.false_alarms += other.false_alarms;
+        self.healthy_reports += other.healthy_reports;
+        self.false_reports += other.false_reports;
+        self.checks += other.checks;
+        self.checks_during_outages += other.checks_during_outages;
+        self.overruns += other.overruns;
+        self.skipped += other.skipped;
+        self
+    }
+}
+
+// Where a mount is in its list of outages:
+#[derive(Default)]
+struct Progress {
+    // The first outage which has not yet ended:
+    outage: usize,
+    detected: bool,
+    // The end of a detected outage while the mount is still reported down:
+    recovering: Option<Duration>,
+}
+
+fn replay(host: &HostTrace, policy: Policy) -> Results {
+    let clock: Arc<dyn Clock> = Arc::new(VirtualClock::new());
+    let prober = TraceProber {
+        host,
+        indexes: host
+            .mounts
+            .iter()
+            .enumerate()
+            .map(|(index, mount)| (mount.path.clone(), index))
+            .collect(),
+        clock: clock.clone(),
+        start_time: clock.now(),
+        timeout: policy.timeout,
+        timer: CycleTimer::new(clock.clone()),
+    };
+    let mut scheduler = Scheduler::new(policy.interval, policy.overrun_policy, clock.clone());
+    let mut mount_statuses = HashMap::<PathBuf, MountState>::new();
+    let mut progress: Vec<Progress> = host.mounts.iter().map(|_| Progress::default()).collect();
+    let mut results = Results {
+        hosts: 1,
+        mount_time: host.length * host.mounts.len() as u32,
+        outages: host
+            .mounts
+            .iter()
+            .map(|mount| mount.outages.len() as u64)
+            .sum(),
+        ..Results::default()
+    };
+
+    loop {
+        let started = clock.now().duration_since(prober.start_time);
+        if started >= host.length {
+            break;
+        }
+        let outcomes = check_mounts(&mut mount_statuses, &prober, &prober, &*clock, false, false);
+        prober.timer.charge();
+        // Results are known once the slowest check has finished or timed out:
+        let reported = clock.now().duration_since(prober.start_time);
+
+        for outcome in &outcomes {
+            let index = prober.indexes[&outcome.mount_point];
+            let outages = &host.mounts[index].outages;
+            let progress = &mut progress[index];
+            let down = outcome.current != StatusKind::Alive;
+
+            while progress.outage < outages.len() && outages[progress.outage].1 <= started {
+                if progress.detected {
+                    progress.recovering = Some(outages[progress.outage].1);
+                }
+                progress.outage += 1;
+                progress.detected = false;
+            }
+            if let Some(end) = progress.recovering {
+                if !down {
+                    results.recovery.push(seconds(reported - end));
+                    progress.recovering = None;
+                }
+            }
+
+            if outcome.check_duration.is_some() {
+                results.checks += 1;
+            }
+            match outages.get(progress.outage) {
+                Some(&(start, _)) if start <= started => {
+                    if outcome.check_duration.is_some() {
+                        results.checks_during_outages += 1;
+                    }
+                    if down && !progress.detected {
+                        progress.detected = true;
+                        results.detection.push(seconds(reported - start));
+                    }
+                }
+                // A mount still reported down after an outage isn't a false alarm:
+                _ if progress.recovering.is_some() => {}
+                _ => {
+                    results.healthy_reports += 1;
+                    if down {
+                        results.false_reports += 1;
+                        if outcome.previous == StatusKind::Alive {
+                            results.false_alarms += 1;
+                        }
+                    }
+                }
+            }
+        }
+
+        let tick = scheduler.wait();
+        if tick.overrun {
+            results.overruns += 1;
+        }
+        results.skipped += u64::from(tick.skipped);
+    }
+    results
+}
+
+// Milliseconds between two times as a duration, or zero if out of order:
+fn millis_between(from: u64, to: u64) -> Duration {
+    Duration::from_millis(to.saturating_sub(from))
+}
+
+fn history_trace(
+    path: &Path,
+    mounts: &[String],
+    since: u64,
+    until: u64,
+    min_outage: Duration,
+) -> Result<HostTrace> {
+    let reader = history::Reader::open(path)?;
+    let selected = reader.select(mounts);
+
+    let mut records: HashMap<u64, Vec<history::Record>> = HashMap::new();
+    for record in reader.records_since(since) {
+        if record.timestamp > until {
+            break;
+        }
+        if selected
+            .as_ref()
+            .map_or(true, |selected| selected.contains(&record.hash))
+        {
+            records
+                .entry(record.hash)
+                .or_insert_with(Vec::new)
+                .push(record);
+        }
+    }
+
+    // Checks are replayed from when they started rather than finished:
+    let started = |record: &history::Record| {
+        record
+            .timestamp
+            .saturating_sub(record.duration_us.unwrap_or(0) / 1000)
+    };
+    let first = match records.values().flat_map(|r| r.iter()).map(started).min() {
+        Some(first) => first,
+        None => return Err(format!("{} holds no matching checks", path.display()).into()),
+    };
+    let last = records
+        .values()
+        .flat_map(|r| r.iter())
+        .map(|r| r.timestamp)
+        .max()
+        .unwrap_or(first);
+    let length = millis_between(first, last);
+    let alive = state_code(StatusKind::Alive);
+
+    let mut traces = Vec::new();
+    for (hash, mut records) in records {
+        // Timestamps come from the wall clock, which can be stepped back, and
+        // responses are looked up by a binary search on their offsets:
+        records.sort_by_key(|record| started(record));
+        let mut responses: Vec<(Duration, Response)> = Vec::new();
+        let mut outages = Vec::new();
+        // Where the current run of failed or hung checks started:
+        let mut down_since: Option<Duration> = None;
+
+        for (index, record) in records.iter().enumerate() {
+            let offset = millis_between(first, started(record));
+            let response = match (record.state, record.duration_us) {
+                (state, Some(us)) if state == alive => Response::Latency(Duration::from_micros(us)),
+                (state, Some(_)) if state != state_code(StatusKind::Hung) => Response::Error,
+                // Hung, whether or not a new check was started. Nothing
+                // answers until the next check which succeeded:
+                _ => {
+                    if let Some(&(_, Response::Unresponsive(_))) = responses.last() {
+                        continue;
+                    }
+                    let until = records[index..]
+                        .iter()
+                        .find(|r| r.state == alive)
+                        .map(|r| millis_between(first, started(r)));
+                    Response::Unresponsive(until)
+                }
+            };
+            responses.push((offset, response));
+
+            match (record.state == alive, down_since) {
+                (false, None) => down_since = Some(offset),
+                (true, Some(since)) => {
+                    if offset.checked_sub(since).map_or(false, |d| d >= min_outage) {
+                        outages.push((since, offset));
+                    }
+                    down_since = None;
+                }
+                _ => {}
+            }
+        }
+        if let Some(since) = down_since {
+            if length.checked_sub(since).map_or(false, |d| d >= min_outage) {
+                outages.push((since, length));
+            }
+        }
+
+        traces.push(MountTrace {
+            path: PathBuf::from(reader.name(hash)),
+            responses: Responses::Recorded(responses),
+            outages,
+        });
+    }
+    traces.sort_by(|a, b| a.path.cmp(&b.path));
+
+    Ok(HostTrace {
+        mounts: traces,
+        length,
+    })
+}
+
+struct Synthetic {
+    days: f64,
+    mounts_per_host: usize,
+    median_latency: f64,
+    spikes_per_day: f64,
+    spike_latency: Duration,
+    spike_length: Duration,
+    outages_per_day: f64,
+    outage_length: Duration,
+    seed: u64,
+}
+
+impl Synthetic {
+    fn host(&self, host: usize) -> HostTrace {
+        let length = Duration::from_millis((self.days * 86_400_000.0) as u64);
+        let mounts = (0..self.mounts_per_host)
+            .map(|mount| {
+                let path = PathBuf::from(format!("/replay/{}", mount));
+                let key = self.seed
+                    ^ path_hash(&path)
+                    ^ (host as u64).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+                let mut draws = 0u64;
+                let mut draw = || {
+                    draws += 1;
+                    unit_interval(key.wrapping_add(draws << 32))
+                };
+
+                let mut outages =
+                    self.episodes(self.outages_per_day, self.outage_length, length, &mut draw);
+                outages.sort();
+                // Overlapping outages are one longer outage:
+                let mut merged: Vec<(Duration, Duration)> = Vec::new();
+                for (start, end) in outages {
+                    match merged.last_mut() {
+                        Some(last) if start <= last.1 => last.1 = last.1.max(end),
+                        _ => merged.push((start, end)),
+                    }
+                }
+                let spikes =
+                    self.episodes(self.spikes_per_day, self.spike_length, length, &mut draw);
+
+                let episodes =
+                    merged
+                        .iter()
+                        .map(|&(start, end)| (start, end, Response::Unresponsive(Some(end))))
+                        .chain(spikes.into_iter().map(|(start, end)| {
+                            (start, end, Response::Latency(self.spike_latency))
+                        }))
+                        .collect();
+                MountTrace {
+                    path,
+                    responses: Responses::Synthetic {
+                        key,
+                        median: self.median_latency,
+                        episodes,
+                    },
+                    outages: merged,
+                }
+            })
+            .collect();
+        HostTrace { mounts, length }
+    }
+
+    // Periods starting anywhere in the trace, at a rate per day:
+    fn episodes(
+        &self,
+        rate: f64,
+        length: Duration,
+        trace_length: Duration,
+        draw: &mut dyn FnMut() -> f64,
+    ) -> Vec<(Duration, Duration)> {
+        let expected = rate * self.days;
+        let count = expected.floor() as usize + if draw() < expected.fract() { 1 } else { 0 };
+        (0..count)
+            .map(|_| {
+                let start = Duration::from_millis((draw() * seconds(trace_length) * 1000.0) as u64);
+                (start, start + length)
+            })
+            .collect()
+    }
+}
+
+// The value below which a fraction q of the sorted values fall:
+fn percentile(sorted: &[f64], q: f64) -> f64 {
+    if sorted.is_empty() {
+        return 0.0;
+    }
+    sorted[((sorted.len() - 1) as f64 * q).round() as usize]
+}
+
+fn describe(label: &str, values: &mut Vec<f64>) {
+    if values.is_empty() {
+        println!("{}: none", label);
+        return;
+    }
+    values.sort_by(|a, b| a.partial_cmp(b).unwrap_or(::std::cmp::Ordering::Equal));
+    println!(
+        "{}: p50 {:.1}s, p90 {:.1}s, p99 {:.1}s, max {:.1}s",
+        label,
+        percentile(values, 0.5),
+        percentile(values, 0.9),
+        percentile(values, 0.99),
+        values[values.len() - 1]
+    );
+}
+
+pub fn run(args: Vec<String>) -> Result<()> {
+    let mut history_file: Option<String> = None;
+    let mut mounts: Vec<String> = Vec::new();
+    let mut since: Option<String> = None;
+    let mut until: Option<String> = None;
+    let mut min_outage: f64 = 60.0;
+    let mut hosts: usize = 0;
+    let mut synthetic = Synthetic {
+        days: 1.0,
+        mounts_per_host: 1,
+        median_latency: 0.005,
+        spikes_per_day: 4.0,
+        spike_latency: Duration::from_secs(5),
+        spike_length: Duration::from_secs(30),
+        outages_per_day: 0.1,
+        outage_length: Duration::from_secs(600),
+        seed: 1,
+    };
+    let mut spike_latency: f64 = 5.0;
+    let mut spike_length: f64 = 30.0;
+    let mut outage_length: f64 = 600.0;
+    let mut interval: f64 = 30.0;
+    let mut timeout: f64 = seconds(probe::CHECK_TIMEOUT);
+    let mut overrun_policy = OverrunPolicy::Skip;
+
+    {
+        let mut ap = ArgumentParser::new();
+        ap.set_description(
+            "Replay recorded or synthetic check latencies through the monitor's scheduling and check logic on a virtual clock, and report how a policy would have performed",
+        );
+
+        ap.refer(&mut history_file).add_option(
+            &["--history"],
+            StoreOption,
+            "Replay the checks recorded in a monitor's --history-file",
+        );
+
+        ap.refer(&mut mounts).add_option(
+            &["--mount"],
+            Collect,
+            "Only replay recorded mounts at or below this path (may be repeated)",
+        );
+
+        ap.refer(&mut since).add_option(
+            &["--since"],
+            StoreOption,
+            "Only replay recorded checks from this time on: seconds since the epoch, or how long ago such as 6h or 2d",
+        );
+
+        ap.refer(&mut until).add_option(
+            &["--until"],
+            StoreOption,
+            "Only replay recorded checks up to this time, in the same form as --since",
+        );
+
+        ap.refer(&mut min_outage).add_option(
+            &["--min-outage"],
+            Store,
+            "Recorded failures lasting at least this many seconds are outages which should be reported; shorter ones are noise",
+        );
+
+        ap.refer(&mut hosts).add_option(
+            &["--synthetic"],
+            Store,
+            "Replay this many generated hosts instead of a history file",
+        );
+
+        ap.refer(&mut synthetic.days).add_option(
+            &["--days"],
+            Store,
+            "Length of each generated host's trace in days",
+        );
+
+        ap.refer(&mut synthetic.mounts_per_host).add_option(
+            &["--mounts-per-host"],
+            Store,
+            "Number of mounts on each generated host",
+        );
+
+        ap.refer(&mut synthetic.median_latency).add_option(
+            &["--latency"],
+            Store,
+            "Median number of seconds a generated check takes",
+        );
+
+        ap.refer(&mut synthetic.spikes_per_day).add_option(
+            &["--spikes"],
+            Store,
+            "Number of latency spikes per generated mount per day, which are not outages",
+        );
+
+        ap.refer(&mut spike_latency).add_option(
+            &["--spike-latency"],
+            Store,
+            "Number of seconds a check takes during a spike",
+        );
+
+        ap.refer(&mut spike_length).add_option(
+            &["--spike-length"],
+            Store,
+            "Number of seconds each spike lasts",
+        );
+
+        ap.refer(&mut synthetic.outages_per_day).add_option(
+            &["--outages"],
+            Store,
+            "Number of outages per generated mount per day, during which nothing answers",
+        );
+
+        ap.refer(&mut outage_length).add_option(
+            &["--outage-length"],
+            Store,
+            "Number of seconds each outage lasts",
+        );
+
+        ap.refer(&mut synthetic.seed).add_option(
+            &["--seed"],
+            Store,
+            "Seed for the generated traces",
+        );
+
+        ap.refer(&mut interval).add_option(
+            &["--poll-interval"],
+            Store,
+            "The candidate policy's number of seconds between the start of each cycle",
+        );
+
+        ap.refer(&mut timeout).add_option(
+            &["--check-timeout"],
+            Store,
+            "The candidate policy's number of seconds before a check is considered hung",
+        );
+
+        ap.refer(&mut overrun_policy).add_option(
+            &["--overrun-policy"],
+            Store,
+            "The candidate policy for cycles missed while a slow cycle overran: skip or queue",
+        );
+
+        let mut args = args;
+        args[0] = "mount_status_monitor replay".to_owned();
+        if let Err(rc) = ap.parse(args, &mut io::stdout(), &mut io::stderr()) {
+            ::std::process::exit(rc);
+        }
+    }
+
+    let seconds_of = |value: f64| Duration::from_millis((value.max(0.0) * 1000.0) as u64);
+    let policy = Policy {
+        interval: seconds_of(interval),
+        timeout: seconds_of(timeout),
+        overrun_policy,
+    };
+    if policy.interval == Duration::from_secs(0) || policy.timeout == Duration::from_secs(0) {
+        return Err("The poll interval and check timeout must be more than zero".into());
+    }
+    synthetic.spike_latency = seconds_of(spike_latency);
+    synthetic.spike_length = seconds_of(spike_length);
+    synthetic.outage_length = seconds_of(outage_length);
+
+    let wall_clock_start_time = Instant::now();
+    let mut results = match (history_file, hosts) {
+        (Some(ref file), 0) => {
+            let now = SystemTime::now();
+            let since = match since {
+                Some(ref since) => history::parse_time(since, now)?,
+                None => 0,
+            };
+            let until = match until {
+                Some(ref until) => history::parse_time(until, now)?,
+                None => ::std::u64::MAX,
+            };
+            let trace = history_trace(
+                Path::new(file),
+                &mounts,
+                since,
+                until,
+                seconds_of(min_outage),
+            )?;
+            replay(&trace, policy)
+        }
+        (None, hosts) if hosts > 0 => {
+            if !(synthetic.days > 0.0) || synthetic.mounts_per_host == 0 {
+                return Err("Generated hosts need at least one mount and some days".into());
+            }
+            (0..hosts)
+                .into_par_iter()
+                .map(|host| replay(&synthetic.host(host), policy))
+                .reduce(Results::default, Results::merge)
+        }
+        _ => return Err("Exactly one of --history or --synthetic is required".into()),
+    };
+    let wall_clock = seconds(wall_clock_start_time.elapsed());
+
+    let mount_days = seconds(results.mount_time) / 86400.0;
+    println!(
+        "Replayed {} on {} host{} in {:.3} seconds ({:.0} mount-days per second)",
+        if mount_days < 1.0 {
+            format!("{:.1} mount-hours", mount_days * 24.0)
+        } else {
+            format!("{:.1} mount-days", mount_days)
+        },
+        results.hosts,
+        if results.hosts == 1 { "" } else { "s" },
+        wall_clock,
+        mount_days / wall_clock.max(1e-9)
+    );
+    println!(
+        "Policy: poll interval {}s, check timeout {}s, overrun policy {}",
+        seconds(policy.interval),
+        seconds(policy.timeout),
+        format!("{:?}", policy.overrun_policy).to_lowercase()
+    );
+    println!(
+        "Outages: {}, of which {} were reported and {} missed",
+        results.outages,
+        results.detection.len(),
+        results.outages - results.detection.len() as u64
+    );
+    describe("Time to report an outage", &mut results.detection);
+    describe("Time to report recovery", &mut results.recovery);
+    println!(
+        "False alarms: {} ({:.3} per mount-day); {:.4}% of reports on healthy mounts said down",
+        results.false_alarms,
+        results.false_alarms as f64 / mount_days.max(1e-9),
+        100.0 * results.false_reports as f64 / (results.healthy_reports.max(1)) as f64
+    );
+    println!(
+        "Checks started: {} ({:.1} per mount-hour), {} of them against mounts which were down",
+        results.checks,
+        results.checks as f64 / (mount_days * 24.0).max(1e-9),
+        results.checks_during_outages
+    );
+    if results.overruns > 0 {
+        println!(
+            "Overran the interval {} times, skipping {} cycles",
+            results.overruns, results.skipped
+        );
+    }
+    Ok(())
+}
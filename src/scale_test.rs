@@ -0,0 +1,340 @@
+// End-to-end scale testing against thousands of real mounts
+//
+// Synthetic benchmarks can't capture kernel-side costs such as generating
+// /proc/self/mounts or the path lookups made by each check. On Linux,
+// `mount_status_monitor scale-test` unshares a user and mount namespace, which
+// needs no privileges on most distributions, creates the requested number of
+// tmpfs or bind mounts inside it and then runs the normal mount table reader
+// and check processes against them for a number of cycles.
+//
+// --stalled adds FUSE mounts whose daemon never answers, so every check of
+// them blocks until it is killed, as happens with a dead network filesystem.
+// The mounts only exist inside the namespace and disappear when we exit.
+
+use crate::errors::*;
+
+#[cfg(target_os = "linux")]
+pub fn run(args: Vec<String>) -> Result<()> {
+    linux::run(args)
+}
+
+#[cfg(not(target_os = "linux"))]
+pub fn run(_args: Vec<String>) -> Result<()> {
+    Err("scale-test requires Linux user and mount namespaces".into())
+}
+
+#[cfg(target_os = "linux")]
+mod linux {
+    use std::collections::HashMap;
+    use std::ffi::CString;
+    use std::fs;
+    use std::io;
+    use std::os::unix::ffi::OsStrExt;
+    use std::os::unix::io::AsRawFd;
+    use std::path::{Path, PathBuf};
+    use std::ptr;
+    use std::sync::atomic::Ordering;
+    use std::time::Instant;
+
+    use argparse::{ArgumentParser, Store, StoreTrue};
+    use libc;
+
+    use crate::clock::SystemClock;
+    use crate::errors::*;
+    use crate::get_mounts::SystemMounts;
+    use crate::probe::{ProcessProber, CHECK_TIMEOUT};
+    use crate::stats::{self, seconds};
+    use crate::{check_mounts, MountState};
+
+    pub fn run(args: Vec<String>) -> Result<()> {
+        let mut mount_count: usize = 1000;
+        let mut bind_mounts = false;
+        let mut stalled: usize = 0;
+        let mut cycles: usize = 3;
+        let mut collect_statfs = false;
+
+        {
+            let mut ap = ArgumentParser::new();
+            ap.set_description(
+                "Create mounts in a private user and mount namespace and measure the monitor checking them",
+            );
+
+            ap.refer(&mut mount_count).add_option(
+                &["--mounts"],
+                Store,
+                "Number of healthy mounts to create",
+            );
+
+            ap.refer(&mut bind_mounts).add_option(
+                &["--bind"],
+                StoreTrue,
+                "Create bind mounts of a single tmpfs rather than a tmpfs for each mount",
+            );
+
+            ap.refer(&mut stalled).add_option(
+                &["--stalled"],
+                Store,
+                "Number of FUSE mounts to create whose daemon never responds",
+            );
+
+            ap.refer(&mut cycles)
+                .add_option(&["--cycles"], Store, "Number of check cycles to run");
+
+            ap.refer(&mut collect_statfs).add_option(
+                &["--collect-statfs"],
+                StoreTrue,
+                "Collect filesystem capacity as part of each check",
+            );
+
+            let mut args = args;
+            args[0] = "mount_status_monitor scale-test".to_owned();
+            if let Err(rc) = ap.parse(args, &mut io::stdout(), &mut io::stderr()) {
+                ::std::process::exit(rc);
+            }
+        }
+
+        // This must happen before any threads are started since the kernel
+        // refuses to move a multi-threaded process into a new user namespace:
+        enter_namespaces()?;
+
+        let base = ::std::env::temp_dir().join(format!(
+            "mount_status_monitor-scale-test.{}",
+            ::std::process::id()
+        ));
+        fs::create_dir(&base).chain_err(|| format!("Unable to create {}", base.display()))?;
+
+        let result = run_in(
+            &base,
+            mount_count,
+            bind_mounts,
+            stalled,
+            cycles.max(1),
+            collect_statfs,
+        );
+
+        let _ = umount(&base);
+        let _ = fs::remove_dir(&base);
+        result
+    }
+
+    fn run_in(
+        base: &Path,
+        mount_count: usize,
+        bind_mounts: bool,
+        stalled: usize,
+        cycles: usize,
+        collect_statfs: bool,
+    ) -> Result<()> {
+        // A tmpfs underneath everything keeps the mountpoint directories off
+        // the real filesystem:
+        mount(Some("tmpfs"), base, Some("tmpfs"), 0, Some("mode=0755"))?;
+
+        let setup_start_time = Instant::now();
+        let bind_source = base.join("source");
+        if bind_mounts {
+            fs::create_dir(&bind_source)
+                .chain_err(|| format!("Unable to create {}", bind_source.display()))?;
+            mount(Some("tmpfs"), &bind_source, Some("tmpfs"), 0, None)?;
+        }
+
+        for i in 0..mount_count {
+            let mount_point = base.join(format!("healthy-{}", i));
+            fs::create_dir(&mount_point)
+                .chain_err(|| format!("Unable to create {}", mount_point.display()))?;
+            if bind_mounts {
+                mount(Some(&bind_source), &mount_point, None, libc::MS_BIND, None)?;
+            } else {
+                mount(Some("tmpfs"), &mount_point, Some("tmpfs"), 0, None)?;
+            }
+        }
+
+        // The FUSE connections stay open, and unanswered, until we exit:
+        let mut fuse_devices = Vec::with_capacity(stalled);
+        for i in 0..stalled {
+            let mount_point = base.join(format!("stalled-{}", i));
+            fs::create_dir(&mount_point)
+                .chain_err(|| format!("Unable to create {}", mount_point.display()))?;
+            let device = fs::OpenOptions::new()
+                .read(true)
+                .write(true)
+                .open("/dev/fuse")
+                .chain_err(|| "Unable to open /dev/fuse for the stalled mounts")?;
+            let options = format!(
+                "fd={},rootmode=40000,user_id=0,group_id=0",
+                device.as_raw_fd()
+            );
+            mount(
+                Some("stalled"),
+                &mount_point,
+                Some("fuse"),
+                libc::MS_NOSUID | libc::MS_NODEV,
+                Some(&options),
+            )?;
+            fuse_devices.push(device);
+        }
+
+        println!(
+            "Created {} {} mounts and {} stalled FUSE mounts in {:.2}s",
+            mount_count,
+            if bind_mounts { "bind" } else { "tmpfs" },
+            stalled,
+            seconds(setup_start_time.elapsed())
+        );
+
+        let prober = ProcessProber {
+            statfs_helper: if collect_statfs {
+                Some(
+                    ::std::env::current_exe()
+                        .chain_err(|| "Unable to locate our own executable")?,
+                )
+            } else {
+                None
+            },
+            namespace_helper: None,
+            timeout: CHECK_TIMEOUT,
+        };
+
+        let mut mount_statuses = HashMap::<PathBuf, MountState>::new();
+        let mut cycle_times = Vec::with_capacity(cycles);
+        for cycle in 1..=cycles {
+            let cycle_start_time = Instant::now();
+            let outcomes = check_mounts(
+                &mut mount_statuses,
+                &SystemMounts,
+                &prober,
+                &SystemClock,
+                false,
+                false,
+            );
+            let cycle_time = cycle_start_time.elapsed();
+            cycle_times.push(cycle_time);
+
+            let dead = mount_statuses
+                .values()
+                .filter(|state| !state.status.success())
+                .count();
+            println!(
+                "cycle {}: checked {} of {} mounts in {:.3}s; {} dead",
+                cycle,
+                outcomes
+                    .iter()
+                    .filter(|o| o.check_duration.is_some())
+                    .count(),
+                mount_statuses.len(),
+                seconds(cycle_time),
+                dead
+            );
+        }
+        drop(fuse_devices);
+
+        cycle_times.sort();
+        let mount_table = stats::MOUNT_TABLE.snapshot();
+        let spawn = stats::SPAWN.snapshot();
+        let usage = stats::resource_usage();
+        println!(
+            "median cycle {:.3}s, max {:.3}s",
+            seconds(cycle_times[cycle_times.len() / 2]),
+            seconds(cycle_times[cycle_times.len() - 1])
+        );
+        if mount_table.count > 0 {
+            println!(
+                "mount table read {:.3}s on average",
+                seconds(mount_table.total) / mount_table.count as f64
+            );
+        }
+        if spawn.count > 0 {
+            println!(
+                "{} checks spawned at {:.0}us each, {} failed to spawn",
+                spawn.count,
+                seconds(spawn.total) * 1e6 / spawn.count as f64,
+                stats::SPAWN_FAILURES.load(Ordering::Relaxed)
+            );
+        }
+        println!(
+            "cpu: monitor {:.3}s user {:.3}s system, checks {:.3}s user {:.3}s system",
+            seconds(usage.user_cpu),
+            seconds(usage.system_cpu),
+            seconds(usage.children_user_cpu),
+            seconds(usage.children_system_cpu)
+        );
+        println!("peak rss: {} KiB", usage.max_rss_bytes / 1024);
+
+        Ok(())
+    }
+
+    fn enter_namespaces() -> Result<()> {
+        let uid = unsafe { libc::geteuid() };
+        let gid = unsafe { libc::getegid() };
+
+        if unsafe { libc::unshare(libc::CLONE_NEWUSER | libc::CLONE_NEWNS) } != 0 {
+            return Err(io::Error::last_os_error())
+                .chain_err(|| "Unable to create user and mount namespaces");
+        }
+
+        // Map ourselves to root inside the namespace so we can mount things:
+        fs::write("/proc/self/setgroups", "deny")
+            .chain_err(|| "Unable to write /proc/self/setgroups")?;
+        fs::write("/proc/self/uid_map", format!("0 {} 1", uid))
+            .chain_err(|| "Unable to write /proc/self/uid_map")?;
+        fs::write("/proc/self/gid_map", format!("0 {} 1", gid))
+            .chain_err(|| "Unable to write /proc/self/gid_map")?;
+
+        // Don't let anything we do propagate back to the parent namespace:
+        mount(
+            None::<&str>,
+            Path::new("/"),
+            None,
+            libc::MS_REC | libc::MS_PRIVATE,
+            None,
+        )
+    }
+
+    fn mount<S: AsRef<Path>>(
+        source: Option<S>,
+        target: &Path,
+        fs_type: Option<&str>,
+        flags: libc::c_ulong,
+        data: Option<&str>,
+    ) -> Result<()> {
+        let c_string = |bytes: &[u8]| CString::new(bytes).chain_err(|| "Invalid mount argument");
+        let source = match source {
+            Some(source) => Some(c_string(source.as_ref().as_os_str().as_bytes())?),
+            None => None,
+        };
+        let target_c = c_string(target.as_os_str().as_bytes())?;
+        let fs_type = match fs_type {
+            Some(fs_type) => Some(c_string(fs_type.as_bytes())?),
+            None => None,
+        };
+        let data = match data {
+            Some(data) => Some(c_string(data.as_bytes())?),
+            None => None,
+        };
+
+        let rc = unsafe {
+            libc::mount(
+                source.as_ref().map_or(ptr::null(), |s| s.as_ptr()),
+                target_c.as_ptr(),
+                fs_type.as_ref().map_or(ptr::null(), |s| s.as_ptr()),
+                flags,
+                data.as_ref()
+                    .map_or(ptr::null(), |s| s.as_ptr() as *const libc::c_void),
+            )
+        };
+        if rc != 0 {
+            return Err(io::Error::last_os_error())
+                .chain_err(|| format!("Unable to mount {}", target.display()));
+        }
+        Ok(())
+    }
+
+    fn umount(target: &Path) -> Result<()> {
+        let target_c =
+            CString::new(target.as_os_str().as_bytes()).chain_err(|| "Invalid mount argument")?;
+        if unsafe { libc::umount2(target_c.as_ptr(), libc::MNT_DETACH) } != 0 {
+            return Err(io::Error::last_os_error())
+                .chain_err(|| format!("Unable to unmount {}", target.display()));
+        }
+        Ok(())
+    }
+}
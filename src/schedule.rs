@@ -0,0 +1,211 @@
+// Fixed-rate scheduling of check cycles
+//
+// Sleeping for the poll interval after each cycle makes the real period the
+// interval plus however long the cycle took, and cycles take longest during
+// exactly the outages we care about. Instead each cycle is due at a fixed
+// deadline on a grid measured from startup using the monotonic clock, and we
+// sleep only for whatever remains of the interval.
+//
+// A cycle which runs past the next deadline is an overrun. The late tick
+// always runs immediately; --overrun-policy decides what happens to any
+// further ticks which were missed entirely:
+//
+//   skip    drop them and carry on from the next deadline on the grid
+//   queue   run them back-to-back until we have caught up, up to a limit,
+//           skipping any beyond that
+//
+// Either way the numbers are reported so a monitor which cannot keep up with
+// its configured cadence is visible rather than silently drifting.
+//
+// Other threads may ask for a cycle to run early through a Wakeup. Requests
+// don't disturb the grid: the extra tick is released immediately and the next
+// regular deadline is unchanged. Any number of requests made before the wait
+// begins are served by a single tick.
+
+use std::str::FromStr;
+use std::sync::{Arc, Condvar, Mutex};
+use std::time::{Duration, Instant};
+
+use crate::clock::Clock;
+
+// The most ticks which will be queued behind an overrun cycle:
+const MAX_QUEUED_TICKS: u32 = 5;
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum OverrunPolicy {
+    Skip,
+    Queue,
+}
+
+impl FromStr for OverrunPolicy {
+    type Err = String;
+
+    fn from_str(s: &str) -> ::std::result::Result<OverrunPolicy, String> {
+        match s {
+            "skip" => Ok(OverrunPolicy::Skip),
+            "queue" => Ok(OverrunPolicy::Queue),
+            _ => Err(format!(
+                "Unknown overrun policy {:?}; expected skip or queue",
+                s
+            )),
+        }
+    }
+}
+
+// How the scheduler arrived at the tick it just returned:
+#[derive(Clone, Copy, Debug, Default)]
+pub struct Tick {
+    // How long after its deadline the tick was released, which only the
+    // metrics report:
+    #[cfg_attr(not(feature = "with_prometheus"), allow(dead_code))]
+    pub lag: Duration,
+    // Whether the previous cycle ran past the following tick's deadline:
+    pub overrun: bool,
+    // Ticks dropped entirely because of the overrun:
+    pub skipped: u32,
+    // Ticks still waiting to run back-to-back after this one:
+    pub backlog: u32,
+    // Whether this is an extra tick asked for through a Wakeup:
+    pub requested: bool,
+}
+
+/// Lets another thread release the next tick early
+#[derive(Default)]
+pub struct Wakeup {
+    requested: Mutex<bool>,
+    condvar: Condvar,
+}
+
+impl Wakeup {
+    pub fn request(&self) {
+        *self.requested.lock().unwrap() = true;
+        self.condvar.notify_all();
+    }
+
+    // Consumes any pending request:
+    fn take(&self) -> bool {
+        let mut requested = self.requested.lock().unwrap();
+        let was_requested = *requested;
+        *requested = false;
+        was_requested
+    }
+
+    // Returns whether we were woken by a request rather than the timeout. This
+    // uses real time so is only used with the system clock:
+    fn wait(&self, timeout: Duration) -> bool {
+        let requested = self.requested.lock().unwrap();
+        let (mut requested, _) = self
+            .condvar
+            .wait_timeout_while(requested, timeout, |requested| !*requested)
+            .unwrap();
+        let was_requested = *requested;
+        *requested = false;
+        was_requested
+    }
+}
+
+pub struct Scheduler {
+    clock: Arc<dyn Clock>,
+    interval: Duration,
+    policy: OverrunPolicy,
+    // The deadline of the tick which was most recently released:
+    current: Instant,
+    backlog: u32,
+    wakeup: Option<Arc<Wakeup>>,
+}
+
+impl Scheduler {
+    /// The first tick is due immediately
+    pub fn new(interval: Duration, policy: OverrunPolicy, clock: Arc<dyn Clock>) -> Scheduler {
+        Scheduler {
+            interval,
+            policy,
+            current: clock.now(),
+            clock,
+            backlog: 0,
+            wakeup: None,
+        }
+    }
+
+    /// Allow ticks to be requested early; the clock must be the system clock
+    pub fn with_wakeup(mut self, wakeup: Arc<Wakeup>) -> Scheduler {
+        self.wakeup = Some(wakeup);
+        self
+    }
+
+    /// Change the interval and overrun policy from the next tick on. The grid
+    /// stays anchored at the most recent tick, so the next one is due one new
+    /// interval after it.
+    pub fn reconfigure(&mut self, interval: Duration, policy: OverrunPolicy) {
+        self.interval = interval;
+        self.policy = policy;
+    }
+
+    /// Sleep until the next tick is due
+    pub fn wait(&mut self) -> Tick {
+        let next = self.current + self.interval;
+        let now = self.clock.now();
+
+        // A zero interval means checking continuously, which can't overrun:
+        if now < next || self.interval == Duration::from_secs(0) {
+            if now < next {
+                let requested = match self.wakeup {
+                    Some(ref wakeup) => wakeup.wait(next - now),
+                    None => {
+                        self.clock.sleep(next - now);
+                        false
+                    }
+                };
+                if requested {
+                    return Tick {
+                        requested: true,
+                        ..Tick::default()
+                    };
+                }
+            } else if let Some(ref wakeup) = self.wakeup {
+                wakeup.take();
+            }
+            self.current = next;
+            self.backlog = 0;
+            return Tick::default();
+        }
+
+        // The late tick starts after any request was made so serves it too:
+        if let Some(ref wakeup) = self.wakeup {
+            wakeup.take();
+        }
+
+        let late_by = now - next;
+        // Ticks whose deadlines have passed in addition to the one we'll run now:
+        let missed = (duration_nanos(late_by) / duration_nanos(self.interval)) as u32;
+
+        let (run, skipped, backlog) = match self.policy {
+            OverrunPolicy::Skip => (missed, missed, 0),
+            OverrunPolicy::Queue => {
+                let skipped = missed.saturating_sub(MAX_QUEUED_TICKS);
+                (skipped, skipped, missed - skipped)
+            }
+        };
+
+        // Working through a backlog means every tick is late; it's only a
+        // new overrun if the last cycle added to it:
+        let overrun = missed >= self.backlog;
+        self.backlog = backlog;
+
+        // Advancing along the grid rather than resetting it to now keeps the
+        // cadence anchored to where it started:
+        self.current = next + self.interval * run;
+
+        Tick {
+            lag: now - self.current,
+            overrun,
+            skipped,
+            backlog,
+            requested: false,
+        }
+    }
+}
+
+fn duration_nanos(d: Duration) -> u64 {
+    d.as_secs() * 1_000_000_000 + u64::from(d.subsec_nanos())
+}
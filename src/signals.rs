@@ -0,0 +1,54 @@
+// Signal handling without asynchronous signal handlers
+//
+// The signals we act on are blocked in every thread and collected by a single
+// thread using sigwait(2), so whatever they trigger runs as ordinary code which
+// may take locks and allocate. This must be set up before any other thread is
+// started because new threads inherit the signal mask of their creator; the
+// check processes are unaffected because std::process::Command resets the
+// mask in the child.
+
+use std::mem;
+use std::ptr;
+use std::thread;
+
+use libc;
+
+use crate::errors::*;
+
+pub type Handler = Box<dyn Fn() + Send>;
+
+pub fn handle(handlers: Vec<(libc::c_int, Handler)>) -> Result<()> {
+    if handlers.is_empty() {
+        return Ok(());
+    }
+
+    let mut signal_set: libc::sigset_t = unsafe { mem::zeroed() };
+    unsafe {
+        libc::sigemptyset(&mut signal_set);
+        for &(signal, _) in &handlers {
+            libc::sigaddset(&mut signal_set, signal);
+        }
+    }
+
+    let rc = unsafe { libc::pthread_sigmask(libc::SIG_BLOCK, &signal_set, ptr::null_mut()) };
+    if rc != 0 {
+        return Err(format!("Unable to block signals: error {}", rc).into());
+    }
+
+    thread::Builder::new()
+        .name("signals".into())
+        .spawn(move || loop {
+            let mut received: libc::c_int = 0;
+            if unsafe { libc::sigwait(&signal_set, &mut received) } != 0 {
+                continue;
+            }
+            for &(signal, ref handler) in &handlers {
+                if signal == received {
+                    handler();
+                }
+            }
+        })
+        .chain_err(|| "Unable to start the signal handling thread")?;
+
+    Ok(())
+}
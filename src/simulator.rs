@@ -0,0 +1,813 @@
+// Simulated filesystems for exercising the monitor without broken storage
+//
+// The simulator is both a mount table and a prober so the real
+// check_mounts() code, including the handling of checks which never exit, can
+// be driven through outages which would otherwise need a dead NFS server or a
+// wedged FUSE daemon. Each simulated mount has a behaviour:
+//
+//   ok            every check succeeds immediately
+//   slow:SECS     checks take SECS seconds, which is a hang if that's longer
+//                 than the check timeout, but the check exits eventually
+//   error[:RC]    checks exit with return code RC (default 1)
+//   signal[:SIG]  checks are killed by signal SIG (default 9)
+//   hang          checks never exit
+//   recover:SECS  checks hang until SECS seconds after the simulation started,
+//                 when the stuck checks exit and new ones succeed
+//
+// Simulated checks never block. Instead each one reports how long it would
+// have taken and, once every check in a cycle has run, the simulator charges
+// the longest of them to the clock, as if the checks had all run in
+// parallel. With the virtual clock this means hours of simulated outage take
+// milliseconds to play through.
+//
+// `mount_status_monitor simulate` runs a scenario through a number of cycles
+// and can compare the resulting states with expectations, exiting with an
+// error if any differ. A scenario can also be kept in a file with the same
+// options as KEY = VALUE lines; those in the scenarios directory are run by
+// the tests below along with generated ones.
+
+use std::collections::HashMap;
+use std::fmt;
+use std::fs;
+use std::io::{self, Write};
+use std::path::{Path, PathBuf};
+use std::str::FromStr;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use argparse::{ArgumentParser, Collect, Store, StoreOption, StoreTrue};
+
+use crate::clock::{Clock, SystemClock, VirtualClock};
+use crate::errors::*;
+use crate::get_mounts::{MountPoint, MountSource, NamespacedPath};
+use crate::probe::{self, PendingCheck, Prober};
+use crate::schedule::{OverrunPolicy, Scheduler};
+use crate::statfs::FilesystemStats;
+use crate::stats::seconds;
+use crate::transitions::TransitionLogger;
+use crate::{check_mounts, CheckOutcome, MountState, MountStatus, StatusKind};
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum Behaviour {
+    Ok,
+    Slow(Duration),
+    Error(i32),
+    Signal(i32),
+    Hang,
+    RecoverAfter(Duration),
+}
+
+impl FromStr for Behaviour {
+    type Err = String;
+
+    fn from_str(s: &str) -> ::std::result::Result<Behaviour, String> {
+        let mut parts = s.splitn(2, ':');
+        let kind = parts.next().unwrap_or("");
+        let argument = parts.next();
+
+        let seconds = |argument: Option<&str>| -> ::std::result::Result<Duration, String> {
+            let value: f64 = argument
+                .ok_or_else(|| format!("{} requires a number of seconds", kind))?
+                .parse()
+                .map_err(|_| format!("Invalid number of seconds in {:?}", s))?;
+            if !(value >= 0.0) {
+                return Err(format!("Invalid number of seconds in {:?}", s));
+            }
+            Ok(Duration::from_millis((value * 1000.0) as u64))
+        };
+        let code = |argument: Option<&str>, default| -> ::std::result::Result<i32, String> {
+            argument.map_or(Ok(default), |a| {
+                a.parse().map_err(|_| format!("Invalid code in {:?}", s))
+            })
+        };
+
+        match kind {
+            "ok" => Ok(Behaviour::Ok),
+            "slow" => Ok(Behaviour::Slow(seconds(argument)?)),
+            "error" => Ok(Behaviour::Error(code(argument, 1)?)),
+            "signal" => Ok(Behaviour::Signal(code(argument, 9)?)),
+            "hang" => Ok(Behaviour::Hang),
+            "recover" => Ok(Behaviour::RecoverAfter(seconds(argument)?)),
+            _ => Err(format!(
+                "Unknown behaviour {:?}; expected ok, slow, error, signal, hang or recover",
+                s
+            )),
+        }
+    }
+}
+
+/// Charges simulated checks to a clock as if each cycle's checks ran in
+/// parallel
+pub struct CycleTimer {
+    clock: Arc<dyn Clock>,
+    // The longest check since the last call to charge():
+    cycle_nanos: AtomicU64,
+}
+
+impl CycleTimer {
+    pub fn new(clock: Arc<dyn Clock>) -> CycleTimer {
+        CycleTimer {
+            clock,
+            cycle_nanos: AtomicU64::new(0),
+        }
+    }
+
+    /// Let the clock run on by the time the last cycle's checks would have taken
+    pub fn charge(&self) {
+        let nanos = self.cycle_nanos.swap(0, Ordering::SeqCst);
+        self.clock.sleep(Duration::from_nanos(nanos));
+    }
+
+    pub fn took(&self, duration: Duration) {
+        let nanos = duration.as_secs() * 1_000_000_000 + u64::from(duration.subsec_nanos());
+        let mut longest = self.cycle_nanos.load(Ordering::SeqCst);
+        while nanos > longest {
+            match self.cycle_nanos.compare_exchange_weak(
+                longest,
+                nanos,
+                Ordering::SeqCst,
+                Ordering::SeqCst,
+            ) {
+                Ok(_) => break,
+                Err(current) => longest = current,
+            }
+        }
+    }
+
+    /// Behaves like a check which missed its deadline and was killed, leaving
+    /// a process behind which exits at the given time, if ever
+    pub fn hung(
+        &self,
+        timeout: Duration,
+        start_time: Instant,
+        exits_at: Option<Instant>,
+    ) -> Result<(MountStatus, Option<FilesystemStats>)> {
+        self.took(timeout);
+        Ok((
+            MountStatus::CheckRunning {
+                process: Box::new(SimulatedCheck {
+                    clock: self.clock.clone(),
+                    exits_at,
+                }),
+                start_time,
+            },
+            None,
+        ))
+    }
+}
+
+pub struct Simulator {
+    clock: Arc<dyn Clock>,
+    start_time: Instant,
+    timeout: Duration,
+    mounts: Vec<(PathBuf, Behaviour)>,
+    behaviours: HashMap<PathBuf, Behaviour>,
+    timer: CycleTimer,
+}
+
+impl Simulator {
+    pub fn new(
+        mounts: Vec<(PathBuf, Behaviour)>,
+        timeout: Duration,
+        clock: Arc<dyn Clock>,
+    ) -> Simulator {
+        Simulator {
+            start_time: clock.now(),
+            timer: CycleTimer::new(clock.clone()),
+            clock,
+            timeout,
+            behaviours: mounts.iter().cloned().collect(),
+            mounts,
+        }
+    }
+
+    /// Let the clock run on by the time the last cycle's checks would have taken
+    pub fn charge_cycle_time(&self) {
+        self.timer.charge();
+    }
+
+    fn hung(
+        &self,
+        start_time: Instant,
+        exits_at: Option<Instant>,
+    ) -> Result<(MountStatus, Option<FilesystemStats>)> {
+        self.timer.hung(self.timeout, start_time, exits_at)
+    }
+}
+
+impl MountSource for Simulator {
+    fn mount_points(&self) -> io::Result<Vec<MountPoint>> {
+        Ok(self
+            .mounts
+            .iter()
+            .map(|&(ref path, _)| MountPoint {
+                path: path.clone(),
+                fs_type: "simulated".to_owned(),
+                source: "simulator".to_owned(),
+                namespace: None,
+            })
+            .collect())
+    }
+}
+
+impl Prober for Simulator {
+    fn check(
+        &self,
+        mount_point: &Path,
+        _namespaced: Option<&NamespacedPath>,
+    ) -> Result<(MountStatus, Option<FilesystemStats>)> {
+        let start_time = self.clock.now();
+        let behaviour = *self
+            .behaviours
+            .get(mount_point)
+            .ok_or_else(|| format!("{} is not a simulated mount", mount_point.display()))?;
+
+        match behaviour {
+            Behaviour::Ok => Ok((MountStatus::Alive, None)),
+            Behaviour::Slow(latency) if latency < self.timeout => {
+                self.timer.took(latency);
+                Ok((MountStatus::Alive, None))
+            }
+            Behaviour::Slow(latency) => self.hung(start_time, Some(start_time + latency)),
+            Behaviour::Error(rc) => Ok((MountStatus::CheckFailed(rc), None)),
+            Behaviour::Signal(signal) => Ok((MountStatus::CheckSignaled(signal), None)),
+            Behaviour::Hang => self.hung(start_time, None),
+            Behaviour::RecoverAfter(outage) => {
+                let recovery_time = self.start_time + outage;
+                if start_time >= recovery_time {
+                    Ok((MountStatus::Alive, None))
+                } else {
+                    self.hung(start_time, Some(recovery_time))
+                }
+            }
+        }
+    }
+}
+
+struct SimulatedCheck {
+    clock: Arc<dyn Clock>,
+    exits_at: Option<Instant>,
+}
+
+impl fmt::Debug for SimulatedCheck {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.debug_struct("SimulatedCheck")
+            .field("exits_at", &self.exits_at)
+            .finish()
+    }
+}
+
+impl PendingCheck for SimulatedCheck {
+    fn try_wait(&mut self) -> io::Result<Option<String>> {
+        Ok(match self.exits_at {
+            Some(exits_at) if self.clock.now() >= exits_at => Some("exit code: 0".to_owned()),
+            _ => None,
+        })
+    }
+}
+
+// CYCLE:PATH=STATE, e.g. 3:/mnt/data=hung
+struct Expectation {
+    cycle: usize,
+    path: PathBuf,
+    state: String,
+}
+
+impl FromStr for Expectation {
+    type Err = String;
+
+    fn from_str(s: &str) -> ::std::result::Result<Expectation, String> {
+        let invalid = || format!("Expectation {:?} must be in the form CYCLE:PATH=STATE", s);
+        let colon = s.find(':').ok_or_else(invalid)?;
+        let equals = s.rfind('=').ok_or_else(invalid)?;
+        if equals < colon {
+            return Err(invalid());
+        }
+        Ok(Expectation {
+            cycle: s[..colon].parse().map_err(|_| invalid())?,
+            path: PathBuf::from(&s[colon + 1..equals]),
+            state: s[equals + 1..].to_owned(),
+        })
+    }
+}
+
+fn parse_mount(spec: &str) -> Result<(PathBuf, Behaviour)> {
+    let equals = spec.rfind('=').ok_or_else(|| {
+        format!(
+            "Simulated mount {:?} must be in the form PATH=BEHAVIOUR",
+            spec
+        )
+    })?;
+    let behaviour = spec[equals + 1..].parse::<Behaviour>()?;
+    Ok((PathBuf::from(&spec[..equals]), behaviour))
+}
+
+// The command-line options, which a scenario file can also supply:
+struct Options {
+    scenario_file: Option<String>,
+    mount_specs: Vec<String>,
+    expectation_specs: Vec<String>,
+    cycles: usize,
+    interval: f64,
+    timeout: f64,
+    overrun_policy: OverrunPolicy,
+    reminder_interval: u64,
+    real_time: bool,
+    verbose: bool,
+}
+
+impl Options {
+    fn parse(
+        args: Vec<String>,
+        stdout: &mut dyn Write,
+        stderr: &mut dyn Write,
+    ) -> ::std::result::Result<Options, i32> {
+        let mut options = Options {
+            scenario_file: None,
+            mount_specs: Vec::new(),
+            expectation_specs: Vec::new(),
+            cycles: 10,
+            interval: 1.0,
+            timeout: probe::CHECK_TIMEOUT.as_secs() as f64
+                + f64::from(probe::CHECK_TIMEOUT.subsec_millis()) / 1e3,
+            overrun_policy: OverrunPolicy::Skip,
+            reminder_interval: 3600,
+            real_time: false,
+            verbose: false,
+        };
+
+        {
+            let mut ap = ArgumentParser::new();
+            ap.set_description(
+                "Run the monitor's checks against simulated mounts and optionally verify the results",
+            );
+
+            ap.refer(&mut options.scenario_file).add_option(
+                &["--scenario"],
+                StoreOption,
+                "Read options from this file, one KEY = VALUE line per long option, before those on the command line",
+            );
+
+            ap.refer(&mut options.mount_specs).add_option(
+                &["--mount"],
+                Collect,
+                "A simulated mount as PATH=BEHAVIOUR where BEHAVIOUR is ok, slow:SECS, error[:RC], signal[:SIG], hang or recover:SECS (may be repeated)",
+            );
+
+            ap.refer(&mut options.expectation_specs).add_option(
+                &["--expect"],
+                Collect,
+                "Fail unless the mount is in the given state after a cycle, as CYCLE:PATH=STATE (may be repeated)",
+            );
+
+            ap.refer(&mut options.cycles).add_option(
+                &["--cycles"],
+                Store,
+                "Number of cycles to run",
+            );
+
+            ap.refer(&mut options.interval).add_option(
+                &["--interval"],
+                Store,
+                "Number of seconds between the start of each cycle",
+            );
+
+            ap.refer(&mut options.timeout).add_option(
+                &["--timeout"],
+                Store,
+                "Number of seconds before a simulated check is considered hung",
+            );
+
+            ap.refer(&mut options.overrun_policy).add_option(
+                &["--overrun-policy"],
+                Store,
+                "What to do with cycles missed while a slow cycle overran the interval: skip or queue",
+            );
+
+            ap.refer(&mut options.reminder_interval).add_option(
+                &["--reminder-interval"],
+                Store,
+                "Number of seconds between summaries of mounts which are still failing",
+            );
+
+            ap.refer(&mut options.real_time).add_option(
+                &["--real-time"],
+                StoreTrue,
+                "Run against the system clock instead of a virtual clock",
+            );
+
+            ap.refer(&mut options.verbose).add_option(
+                &["-v", "--verbose"],
+                StoreTrue,
+                "Print the state of every mount after each cycle",
+            );
+
+            ap.parse(args, stdout, stderr)?;
+        }
+
+        Ok(options)
+    }
+
+    fn scenario(&self) -> Result<Scenario> {
+        let mounts = self
+            .mount_specs
+            .iter()
+            .map(|spec| parse_mount(spec))
+            .collect::<Result<Vec<_>>>()?;
+        let expectations = self
+            .expectation_specs
+            .iter()
+            .map(|spec| spec.parse::<Expectation>())
+            .collect::<::std::result::Result<Vec<_>, _>>()?;
+        if mounts.is_empty() {
+            return Err("At least one --mount is required".into());
+        }
+
+        let seconds = |value: f64| Duration::from_millis((value.max(0.0) * 1000.0) as u64);
+        Ok(Scenario {
+            mounts,
+            expectations,
+            cycles: self.cycles,
+            interval: seconds(self.interval),
+            timeout: seconds(self.timeout),
+            overrun_policy: self.overrun_policy,
+            reminder_interval: Duration::from_secs(self.reminder_interval),
+        })
+    }
+}
+
+// The options in a scenario file, which has a KEY = VALUE line for each long
+// option and may have # comments:
+fn scenario_args(path: &Path) -> Result<Vec<String>> {
+    let contents = fs::read_to_string(path)
+        .chain_err(|| format!("Unable to read the scenario {}", path.display()))?;
+
+    let mut args = Vec::new();
+    for (number, line) in contents.lines().enumerate() {
+        let line = line.trim();
+        if line.is_empty() || line.starts_with('#') {
+            continue;
+        }
+        let equals = line.find('=').ok_or_else(|| {
+            format!(
+                "{} line {}: expected KEY = VALUE",
+                path.display(),
+                number + 1
+            )
+        })?;
+        args.push(format!("--{}", line[..equals].trim()));
+        args.push(line[equals + 1..].trim().to_owned());
+    }
+    Ok(args)
+}
+
+struct Scenario {
+    mounts: Vec<(PathBuf, Behaviour)>,
+    expectations: Vec<Expectation>,
+    cycles: usize,
+    interval: Duration,
+    timeout: Duration,
+    overrun_policy: OverrunPolicy,
+    reminder_interval: Duration,
+}
+
+// What happened in one cycle of a scenario:
+struct Cycle {
+    // Since the start of the scenario:
+    started: Duration,
+    outcomes: Vec<CheckOutcome>,
+    reminded: bool,
+}
+
+impl Cycle {
+    fn print(&self, number: usize, verbose: bool, out: &mut dyn Write) {
+        let dead = self
+            .outcomes
+            .iter()
+            .filter(|o| o.current != StatusKind::Alive)
+            .count();
+        let _ = writeln!(
+            out,
+            "cycle {} at {:.1}s: {} mounts, {} dead",
+            number,
+            self.started.as_secs() as f64 + f64::from(self.started.subsec_millis()) / 1e3,
+            self.outcomes.len(),
+            dead
+        );
+        for outcome in &self.outcomes {
+            if outcome.previous != outcome.current {
+                let _ = writeln!(
+                    out,
+                    "  {} {} -> {}",
+                    outcome.mount_point.display(),
+                    outcome.previous.name(),
+                    outcome.current.name()
+                );
+            } else if verbose {
+                let _ = writeln!(
+                    out,
+                    "  {} {}",
+                    outcome.mount_point.display(),
+                    outcome.current.name()
+                );
+            }
+        }
+        if self.reminded {
+            let _ = writeln!(out, "  reminder: {} mounts still failing", dead);
+        }
+    }
+}
+
+struct Playback {
+    cycles: Vec<Cycle>,
+    failed_expectations: usize,
+}
+
+impl Scenario {
+    /// Run the scenario, describing each cycle as it goes
+    fn play(&self, clock: Arc<dyn Clock>, verbose: bool, out: &mut dyn Write) -> Playback {
+        let simulator = Simulator::new(self.mounts.clone(), self.timeout, clock.clone());
+        let mut scheduler = Scheduler::new(self.interval, self.overrun_policy, clock.clone());
+
+        let mut mount_statuses = HashMap::<PathBuf, MountState>::new();
+        // Every failure is shown, however many mounts fail at once:
+        let mut transition_logger = TransitionLogger::new(self.reminder_interval, 0, clock.clone());
+        let mut playback = Playback {
+            cycles: Vec::with_capacity(self.cycles),
+            failed_expectations: 0,
+        };
+
+        for cycle in 1..=self.cycles {
+            let started = clock.now().duration_since(simulator.start_time);
+            let mut outcomes = check_mounts(
+                &mut mount_statuses,
+                &simulator,
+                &simulator,
+                &*clock,
+                false,
+                false,
+            );
+            simulator.charge_cycle_time();
+            let reminded = transition_logger.record(&outcomes);
+            outcomes.sort_by(|a, b| a.mount_point.cmp(&b.mount_point));
+
+            let cycle_record = Cycle {
+                started,
+                outcomes,
+                reminded,
+            };
+            cycle_record.print(cycle, verbose, out);
+
+            for expectation in self.expectations.iter().filter(|e| e.cycle == cycle) {
+                let actual = mount_statuses
+                    .get(&expectation.path)
+                    .map_or("unmounted", |state| state.status.kind().name());
+                if actual != expectation.state {
+                    let _ = writeln!(
+                        out,
+                        "  FAILED: expected {} to be {} but it was {}",
+                        expectation.path.display(),
+                        expectation.state,
+                        actual
+                    );
+                    playback.failed_expectations += 1;
+                }
+            }
+
+            playback.cycles.push(cycle_record);
+
+            if cycle < self.cycles {
+                let tick = scheduler.wait();
+                if tick.overrun {
+                    let _ = writeln!(
+                        out,
+                        "  cycle overran: {} skipped, {} queued",
+                        tick.skipped, tick.backlog
+                    );
+                }
+            }
+        }
+
+        playback
+    }
+}
+
+pub fn run(args: Vec<String>) -> Result<()> {
+    let parse = |args: Vec<String>| match Options::parse(args, &mut io::stdout(), &mut io::stderr())
+    {
+        Ok(options) => options,
+        Err(rc) => ::std::process::exit(rc),
+    };
+
+    let mut args = args;
+    args[0] = "mount_status_monitor simulate".to_owned();
+    let mut options = parse(args.clone());
+    if let Some(scenario_file) = options.scenario_file.take() {
+        // Parse again with the file's options ahead of the command line's, so
+        // that the command line can add mounts or override settings:
+        let mut expanded = vec![args[0].clone()];
+        expanded.extend(scenario_args(Path::new(&scenario_file))?);
+        expanded.extend(args.into_iter().skip(1));
+        options = parse(expanded);
+    }
+    let scenario = options.scenario()?;
+
+    let clock: Arc<dyn Clock> = if options.real_time {
+        Arc::new(SystemClock)
+    } else {
+        Arc::new(VirtualClock::new())
+    };
+    let wall_clock_start_time = Instant::now();
+    let start_time = clock.now();
+
+    let stdout = io::stdout();
+    let playback = scenario.play(clock.clone(), options.verbose, &mut stdout.lock());
+
+    let simulated = clock.now().duration_since(start_time);
+    let wall_clock = wall_clock_start_time.elapsed();
+    println!(
+        "Simulated {:.1} seconds in {:.3} seconds",
+        seconds(simulated),
+        seconds(wall_clock)
+    );
+
+    if playback.failed_expectations > 0 {
+        return Err(format!("{} expectations were not met", playback.failed_expectations).into());
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs;
+    use std::io;
+    use std::path::{Path, PathBuf};
+    use std::sync::Arc;
+    use std::time::Duration;
+
+    use super::{scenario_args, Behaviour, Options, Playback, Scenario};
+    use crate::clock::VirtualClock;
+    use crate::schedule::OverrunPolicy;
+    use crate::StatusKind;
+
+    fn scenario(
+        mounts: &[(&str, Behaviour)],
+        interval: u64,
+        cycles: usize,
+        overrun_policy: OverrunPolicy,
+    ) -> Scenario {
+        Scenario {
+            mounts: mounts
+                .iter()
+                .map(|&(path, behaviour)| (PathBuf::from(path), behaviour))
+                .collect(),
+            expectations: Vec::new(),
+            cycles,
+            interval: Duration::from_secs(interval),
+            timeout: Duration::from_secs(3),
+            overrun_policy,
+            reminder_interval: Duration::from_secs(3600),
+        }
+    }
+
+    fn play(scenario: &Scenario) -> Playback {
+        scenario.play(Arc::new(VirtualClock::new()), false, &mut io::sink())
+    }
+
+    fn state(playback: &Playback, cycle: usize, path: &str) -> StatusKind {
+        playback.cycles[cycle]
+            .outcomes
+            .iter()
+            .find(|outcome| outcome.mount_point == Path::new(path))
+            .map(|outcome| outcome.current)
+            .unwrap()
+    }
+
+    fn start_times(playback: &Playback) -> Vec<u64> {
+        playback
+            .cycles
+            .iter()
+            .map(|cycle| cycle.started.as_secs())
+            .collect()
+    }
+
+    #[test]
+    fn committed_scenarios_pass() {
+        let directory = Path::new(env!("CARGO_MANIFEST_DIR")).join("scenarios");
+        let mut played = 0;
+        for entry in fs::read_dir(&directory).unwrap() {
+            let path = entry.unwrap().path();
+            if path
+                .extension()
+                .map_or(true, |extension| extension != "scenario")
+            {
+                continue;
+            }
+
+            let mut args = vec!["simulate".to_owned()];
+            args.extend(scenario_args(&path).unwrap());
+            let mut errors = Vec::new();
+            let options = match Options::parse(args, &mut io::sink(), &mut errors) {
+                Ok(options) => options,
+                Err(_) => panic!("{}: {}", path.display(), String::from_utf8_lossy(&errors)),
+            };
+            let playback = play(&options.scenario().unwrap());
+            assert_eq!(playback.failed_expectations, 0, "{}", path.display());
+            played += 1;
+        }
+        assert!(played > 0);
+    }
+
+    #[test]
+    fn hung_mounts_recover_on_the_first_cycle_after_the_outage() {
+        // Hundreds of outages from none at all to over an hour:
+        for outage in (0..300).map(|i| Duration::from_secs(i * 13)) {
+            let playback = play(&scenario(
+                &[
+                    ("/mnt/home", Behaviour::Ok),
+                    ("/mnt/nfs", Behaviour::RecoverAfter(outage)),
+                ],
+                30,
+                150,
+                OverrunPolicy::Skip,
+            ));
+
+            for (number, cycle) in playback.cycles.iter().enumerate() {
+                let expected = if cycle.started >= outage {
+                    StatusKind::Alive
+                } else {
+                    StatusKind::Hung
+                };
+                assert_eq!(
+                    state(&playback, number, "/mnt/nfs"),
+                    expected,
+                    "{:?} outage, cycle at {:?}",
+                    outage,
+                    cycle.started
+                );
+                assert_eq!(state(&playback, number, "/mnt/home"), StatusKind::Alive);
+            }
+        }
+    }
+
+    #[test]
+    fn hung_checks_are_not_restarted() {
+        let playback = play(&scenario(
+            &[("/mnt/dead", Behaviour::Hang)],
+            10,
+            20,
+            OverrunPolicy::Skip,
+        ));
+
+        for (number, cycle) in playback.cycles.iter().enumerate() {
+            let outcome = &cycle.outcomes[0];
+            assert_eq!(outcome.current, StatusKind::Hung);
+            // Only the first cycle starts a check; the rest find it running:
+            assert_eq!(outcome.check_duration.is_some(), number == 0);
+        }
+    }
+
+    #[test]
+    fn overruns_are_skipped_or_queued() {
+        // The first cycle waits 25 seconds for a check to time out, missing
+        // the ticks at 10 and 20 seconds, and the rest are quick:
+        let mounts = [("/mnt/nfs", Behaviour::RecoverAfter(Duration::from_secs(5)))];
+        let mut slow_start = scenario(&mounts, 10, 5, OverrunPolicy::Skip);
+        slow_start.timeout = Duration::from_secs(25);
+
+        // The late tick runs straight away and the missed one is dropped:
+        let playback = play(&slow_start);
+        assert_eq!(start_times(&playback), vec![0, 25, 30, 40, 50]);
+
+        // The missed tick runs too, back-to-back with the late one:
+        slow_start.overrun_policy = OverrunPolicy::Queue;
+        let playback = play(&slow_start);
+        assert_eq!(start_times(&playback), vec![0, 25, 25, 30, 40]);
+        assert_eq!(state(&playback, 0, "/mnt/nfs"), StatusKind::Hung);
+        assert_eq!(state(&playback, 1, "/mnt/nfs"), StatusKind::Alive);
+    }
+
+    #[test]
+    fn reminders_follow_the_interval() {
+        let mut hung_scenario = scenario(
+            &[("/mnt/ok", Behaviour::Ok), ("/mnt/dead", Behaviour::Hang)],
+            60,
+            40,
+            OverrunPolicy::Skip,
+        );
+        hung_scenario.reminder_interval = Duration::from_secs(600);
+        let playback = play(&hung_scenario);
+
+        let reminders: Vec<u64> = playback
+            .cycles
+            .iter()
+            .filter(|cycle| cycle.reminded)
+            .map(|cycle| cycle.started.as_secs())
+            .collect();
+        // The mount failed when its first check timed out at 3 seconds, so
+        // the first reminder is due at 603 seconds and goes with the cycle
+        // after that:
+        assert_eq!(reminders, vec![660, 1260, 1860]);
+    }
+}
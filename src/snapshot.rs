@@ -0,0 +1,155 @@
+// Immutable views of mount state for readers outside the check loop
+//
+// The state map is owned by the main loop and mutated in place by the check
+// threads, and a cycle can take minutes when checks are hanging, so nothing
+// else may look at it directly. Instead every mount has a slot holding an
+// immutable MountView which the check thread replaces as soon as it has a
+// result, and the set of slots is itself published as an immutable map at the
+// end of each cycle. A reader loads the map, then whichever views it needs,
+// and is never affected by checks which are still running.
+//
+// Each Published value is an Arc behind a lock which is only ever held to
+// clone or replace the pointer, in the style of RCU: readers and the writer
+// never wait for each other for longer than that, however many checks are
+// stuck, and a reader keeps a consistent view for as long as it holds the Arc.
+// Every replacement bumps a version number so readers can tell cheaply
+// whether anything has changed.
+
+use std::collections::{BTreeMap, HashMap};
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, RwLock};
+use std::time::{Duration, SystemTime};
+
+use crate::clock::Clock;
+use crate::windows::WindowTotals;
+use crate::{MountState, MountStatus, StatusKind};
+
+#[derive(Debug)]
+pub struct Published<T> {
+    current: RwLock<Arc<T>>,
+    version: AtomicU64,
+}
+
+impl<T> Published<T> {
+    pub fn new(value: T) -> Published<T> {
+        Published {
+            current: RwLock::new(Arc::new(value)),
+            version: AtomicU64::new(0),
+        }
+    }
+
+    pub fn load(&self) -> Arc<T> {
+        self.current.read().unwrap().clone()
+    }
+
+    pub fn store(&self, value: T) {
+        // The new value is allocated before taking the lock so the lock is
+        // only held for the pointer swap; the old value is freed after:
+        let value = Arc::new(value);
+        let _previous = {
+            let mut current = self.current.write().unwrap();
+            self.version.fetch_add(1, Ordering::Release);
+            ::std::mem::replace(&mut *current, value)
+        };
+    }
+
+    pub fn version(&self) -> u64 {
+        self.version.load(Ordering::Acquire)
+    }
+}
+
+/// A mount as of its most recent check
+#[derive(Clone, Debug)]
+pub struct MountView {
+    pub fs_type: String,
+    pub source: String,
+    pub status: StatusKind,
+    // When a check last finished or was found to be still running:
+    pub checked: SystemTime,
+    pub last_success: Option<SystemTime>,
+    pub last_check_duration: Option<Duration>,
+    pub hung_since: Option<SystemTime>,
+    // Totals for each of windows::WINDOWS, if they are being kept:
+    pub windows: Option<Vec<WindowTotals>>,
+}
+
+impl MountView {
+    pub fn new(mount_state: &MountState, clock: &dyn Clock) -> MountView {
+        let system_now = clock.system_time();
+        let hung_since = match mount_state.status {
+            MountStatus::CheckRunning { start_time, .. } => {
+                Some(system_now - clock.now().duration_since(start_time))
+            }
+            _ => None,
+        };
+
+        MountView {
+            fs_type: mount_state.fs_type.clone(),
+            source: mount_state.source.clone(),
+            status: mount_state.status.kind(),
+            checked: system_now,
+            last_success: mount_state.last_success,
+            last_check_duration: mount_state.last_check_duration,
+            hung_since,
+            windows: mount_state
+                .windows
+                .as_ref()
+                .map(|windows| windows.totals(clock.now())),
+        }
+    }
+}
+
+pub type MountSlot = Arc<Published<Option<MountView>>>;
+
+/// Every mount's slot, as of the end of the last cycle
+pub type MountSlots = BTreeMap<PathBuf, MountSlot>;
+
+/// Where the main loop publishes the state for other threads
+pub struct StatusBoard {
+    mounts: Published<MountSlots>,
+}
+
+impl StatusBoard {
+    pub fn new() -> StatusBoard {
+        StatusBoard {
+            mounts: Published::new(MountSlots::new()),
+        }
+    }
+
+    /// Publish the current set of mounts after the state map has changed
+    pub fn publish(&self, mount_statuses: &HashMap<PathBuf, MountState>) {
+        self.mounts.store(
+            mount_statuses
+                .iter()
+                .map(|(mount_point, state)| (mount_point.clone(), state.view.clone()))
+                .collect(),
+        );
+    }
+
+    pub fn load(&self) -> BoardSnapshot {
+        // The version is read first so it can only understate what we load:
+        let version = self.mounts.version();
+        BoardSnapshot {
+            version,
+            mounts: self.mounts.load(),
+        }
+    }
+}
+
+pub struct BoardSnapshot {
+    version: u64,
+    pub mounts: Arc<MountSlots>,
+}
+
+impl BoardSnapshot {
+    /// Changes whenever a mount is added, removed or checked, for caching
+    /// anything derived from the whole board. Call this before loading the
+    /// views so a cached result can only be older than its key.
+    pub fn changes(&self) -> (u64, u64) {
+        (
+            self.version,
+            self.mounts.values().map(|slot| slot.version()).sum(),
+        )
+    }
+}
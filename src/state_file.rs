@@ -0,0 +1,440 @@
+// Per-mount state which survives a restart of the monitor
+//
+// A hung check stays in the kernel long after we stop waiting for it, and the
+// only thing stopping us from piling another one onto the same dead server
+// each cycle is the record of it in the mount's state. If the monitor is
+// restarted, by systemd after a crash or for an upgrade, that record is lost
+// and a crash-looping monitor would add a stuck process to every dead mount on
+// every restart. With --state-file PATH each cycle also saves what we need to
+// carry on where we left off, and on startup any check which is still stuck is
+// adopted instead of starting a new one.
+//
+// The file is written through a shared memory mapping, so it survives the
+// monitor crashing without any fsync, and has the same shape as the status
+// table: an array of u64 words with an 8 word header,
+//
+//   0  magic "MSMSTA01"
+//   1  layout version (1)
+//   2  sequence number: odd while the file is being written
+//   3  number of slots, a power of two
+//   4  boot time in seconds since the epoch, from /proc/stat
+//   5  number of occupied slots
+//   6  milliseconds since the epoch when the file was last written
+//   7  reserved
+//
+// followed by slots of 8 words, found by linear probing from hash % slots:
+//
+//   0  FNV-1a hash of the mountpoint's path, 0 for an empty slot
+//   1  process ID of the hung check, or 0
+//   2  the check's start time in clock ticks after boot, from /proc/PID/stat
+//   3  milliseconds since the epoch when the hung check started, or 0
+//   4  milliseconds since the epoch of the last successful check, or 0
+//   5  duration of the last completed check in microseconds
+//   6  reserved
+//   7  reserved
+//
+// Process IDs are reused, so a check is only adopted if a process with that ID
+// exists, started at the recorded time and has the mountpoint on its command
+// line. A file written during an earlier boot, or left half-written, is
+// ignored. /run is the natural place for it since it is emptied on boot.
+//
+// Adopted checks belong to init once their parent has gone, so they can't be
+// waited for; instead each poll looks for the process in /proc. This needs
+// Linux, and elsewhere only the last success and check duration are restored.
+
+use std::collections::HashMap;
+use std::fs;
+use std::io;
+use std::mem;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{fence, AtomicU64, Ordering};
+use std::time::{Duration, Instant, SystemTime};
+
+use libc;
+
+use crate::clock::Clock;
+use crate::errors::*;
+use crate::probe::PendingCheck;
+use crate::status_table::{epoch_millis, from_millis, path_hash, Mapping};
+use crate::{MountState, MountStatus};
+
+const MAGIC: u64 = 0x3130_4154_534d_534d; // "MSMSTA01" read as little-endian
+const VERSION: u64 = 1;
+const HEADER_WORDS: usize = 8;
+const SLOT_WORDS: usize = 8;
+const MIN_SLOTS: usize = 256;
+
+const H_MAGIC: usize = 0;
+const H_VERSION: usize = 1;
+const H_SEQUENCE: usize = 2;
+const H_SLOTS: usize = 3;
+const H_BOOT_TIME: usize = 4;
+const H_COUNT: usize = 5;
+const H_UPDATED: usize = 6;
+
+const S_HASH: usize = 0;
+const S_PID: usize = 1;
+const S_PID_START: usize = 2;
+const S_HUNG_SINCE: usize = 3;
+const S_LAST_SUCCESS: usize = 4;
+const S_LATENCY: usize = 5;
+
+/// What a previous monitor recorded about one mount
+#[derive(Clone, Debug)]
+struct Saved {
+    // The hung check's process ID and start time:
+    check: Option<(u32, u64)>,
+    hung_since: Option<SystemTime>,
+    last_success: Option<SystemTime>,
+    last_check_duration: Option<Duration>,
+}
+
+/// Everything a previous monitor recorded, keyed by path hash
+pub struct SavedState {
+    mounts: HashMap<u64, Saved>,
+}
+
+/// A mount whose hung check was adopted from a previous monitor
+pub struct Adopted {
+    pub mount_point: PathBuf,
+    pub pid: u32,
+    pub hung_since: Instant,
+}
+
+impl SavedState {
+    /// Bring back the saved state of each mount in the map, adopting any
+    /// checks which are still running
+    pub fn restore(
+        &self,
+        mount_statuses: &mut HashMap<PathBuf, MountState>,
+        clock: &dyn Clock,
+    ) -> Vec<Adopted> {
+        let now = clock.now();
+        let system_now = clock.system_time();
+        let mut adopted = Vec::new();
+
+        for (mount_point, state) in mount_statuses.iter_mut() {
+            let saved = match self.mounts.get(&path_hash(mount_point)) {
+                Some(saved) => saved,
+                None => continue,
+            };
+            state.last_success = saved.last_success;
+            state.last_check_duration = saved.last_check_duration;
+
+            let (pid, start_ticks) = match saved.check {
+                Some(check) => check,
+                None => continue,
+            };
+            let inner_path = state.namespace.as_ref().map(|n| n.path.as_path());
+            if !is_our_check(pid, start_ticks, mount_point, inner_path) {
+                continue;
+            }
+
+            // The previous monitor should have killed it already, but may
+            // have died before it could:
+            unsafe {
+                libc::kill(pid as libc::pid_t, libc::SIGKILL);
+            }
+
+            let hung_for = saved
+                .hung_since
+                .and_then(|since| system_now.duration_since(since).ok())
+                .unwrap_or_default();
+            let start_time = now.checked_sub(hung_for).unwrap_or(now);
+            state.status = MountStatus::CheckRunning {
+                process: Box::new(AdoptedCheck { pid, start_ticks }),
+                start_time,
+            };
+            adopted.push(Adopted {
+                mount_point: mount_point.clone(),
+                pid,
+                hung_since: start_time,
+            });
+        }
+
+        adopted
+    }
+}
+
+/// A check started by a previous monitor which has not yet exited
+#[derive(Debug)]
+struct AdoptedCheck {
+    pid: u32,
+    start_ticks: u64,
+}
+
+impl PendingCheck for AdoptedCheck {
+    fn try_wait(&mut self) -> io::Result<Option<String>> {
+        // Zombies have exited but are waiting for init to reap them:
+        match process_start(self.pid) {
+            Some((state, start_ticks)) if start_ticks == self.start_ticks && state != 'Z' => {
+                Ok(None)
+            }
+            _ => Ok(Some("an unknown status".to_owned())),
+        }
+    }
+
+    fn id(&self) -> Option<u32> {
+        Some(self.pid)
+    }
+}
+
+/// The monitor's side of the file
+pub struct StateFile {
+    file: fs::File,
+    // Not mapped for writing until the first update, so what the previous
+    // monitor saved is kept until we have something to replace it with:
+    mapping: Option<Mapping>,
+    slots: usize,
+    boot_time: u64,
+    // Check start times which have already been looked up, by process ID:
+    start_times: HashMap<u32, u64>,
+}
+
+impl StateFile {
+    /// Open the file, returning whatever a previous monitor saved in it
+    pub fn open(path: &Path) -> Result<(StateFile, SavedState)> {
+        let file = fs::OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .open(path)
+            .chain_err(|| format!("Unable to open state file {}", path.display()))?;
+        let boot_time = boot_time();
+
+        let size = file
+            .metadata()
+            .chain_err(|| format!("Unable to stat {}", path.display()))?
+            .len() as usize;
+        let len = size / mem::size_of::<u64>();
+        let mounts = if len >= HEADER_WORDS {
+            let mapping = Mapping::new(&file, len, false)
+                .chain_err(|| format!("Unable to map {}", path.display()))?;
+            read_saved(mapping.words(), boot_time)
+        } else {
+            HashMap::new()
+        };
+
+        let state_file = StateFile {
+            file,
+            mapping: None,
+            slots: 0,
+            boot_time,
+            start_times: HashMap::new(),
+        };
+        Ok((state_file, SavedState { mounts }))
+    }
+
+    // Empty the file and map it at the new size:
+    fn resize(file: &fs::File, slots: usize, boot_time: u64) -> io::Result<Mapping> {
+        let len = HEADER_WORDS + slots * SLOT_WORDS;
+        file.set_len(0)?;
+        file.set_len((len * mem::size_of::<u64>()) as u64)?;
+        let mapping = Mapping::new(file, len, true)?;
+        {
+            let header = mapping.words();
+            header[H_VERSION].store(VERSION, Ordering::Relaxed);
+            header[H_SLOTS].store(slots as u64, Ordering::Relaxed);
+            header[H_BOOT_TIME].store(boot_time, Ordering::Relaxed);
+            header[H_MAGIC].store(MAGIC, Ordering::Release);
+        }
+        Ok(mapping)
+    }
+
+    /// Save the state of every mount at the end of a cycle
+    pub fn update(
+        &mut self,
+        mount_statuses: &HashMap<PathBuf, MountState>,
+        clock: &dyn Clock,
+    ) -> Result<()> {
+        if self.mapping.is_none() || mount_statuses.len() * 2 > self.slots {
+            let slots = (mount_statuses.len() * 2)
+                .next_power_of_two()
+                .max(MIN_SLOTS);
+            self.mapping = None;
+            self.mapping = Some(
+                StateFile::resize(&self.file, slots, self.boot_time)
+                    .chain_err(|| "Unable to size the state file")?,
+            );
+            self.slots = slots;
+        }
+
+        let mut slots = vec![[0u64; SLOT_WORDS]; self.slots];
+        let mut start_times = HashMap::new();
+        let now = clock.now();
+        let system_now = clock.system_time();
+        for (mount_point, state) in mount_statuses {
+            let hash = path_hash(mount_point);
+            let mut index = hash as usize & (self.slots - 1);
+            while slots[index][S_HASH] != 0 {
+                index = (index + 1) & (self.slots - 1);
+            }
+
+            let (pid, start_ticks, hung_since) = match state.status {
+                MountStatus::CheckRunning {
+                    ref process,
+                    start_time,
+                } => {
+                    let pid = process.id().unwrap_or(0);
+                    let start_ticks = match self.start_times.get(&pid) {
+                        Some(&start_ticks) => Some(start_ticks),
+                        None => process_start(pid).map(|(_, start_ticks)| start_ticks),
+                    };
+                    match start_ticks {
+                        Some(start_ticks) => {
+                            start_times.insert(pid, start_ticks);
+                            (
+                                pid,
+                                start_ticks,
+                                epoch_millis(system_now - now.duration_since(start_time)),
+                            )
+                        }
+                        None => (0, 0, 0),
+                    }
+                }
+                _ => (0, 0, 0),
+            };
+            slots[index] = [
+                hash,
+                u64::from(pid),
+                start_ticks,
+                hung_since,
+                state.last_success.map_or(0, epoch_millis),
+                state.last_check_duration.map_or(0, |d| {
+                    d.as_secs() * 1_000_000 + u64::from(d.subsec_micros())
+                }),
+                0,
+                0,
+            ];
+        }
+        self.start_times = start_times;
+
+        // A crash part way through leaves an odd sequence number, which the
+        // next monitor takes as a reason to ignore the file:
+        let words = match self.mapping {
+            Some(ref mapping) => mapping.words(),
+            None => return Ok(()),
+        };
+        let sequence = words[H_SEQUENCE].load(Ordering::Relaxed);
+        words[H_SEQUENCE].store(sequence | 1, Ordering::Relaxed);
+        fence(Ordering::Release);
+        for (index, slot) in slots.iter().enumerate() {
+            let base = HEADER_WORDS + index * SLOT_WORDS;
+            for (offset, &value) in slot.iter().enumerate() {
+                words[base + offset].store(value, Ordering::Relaxed);
+            }
+        }
+        words[H_COUNT].store(mount_statuses.len() as u64, Ordering::Relaxed);
+        words[H_UPDATED].store(epoch_millis(system_now), Ordering::Relaxed);
+        words[H_SEQUENCE].store((sequence | 1) + 1, Ordering::Release);
+        Ok(())
+    }
+}
+
+fn read_saved(words: &[AtomicU64], boot_time: u64) -> HashMap<u64, Saved> {
+    let word = |index: usize| words[index].load(Ordering::Relaxed);
+    let slots = word(H_SLOTS) as usize;
+    let mut mounts = HashMap::new();
+    if word(H_MAGIC) != MAGIC
+        || word(H_VERSION) != VERSION
+        || word(H_SEQUENCE) % 2 != 0
+        || word(H_BOOT_TIME) != boot_time
+        || !slots.is_power_of_two()
+        || HEADER_WORDS + slots * SLOT_WORDS > words.len()
+    {
+        return mounts;
+    }
+
+    let optional_time = |millis: u64| {
+        if millis == 0 {
+            None
+        } else {
+            Some(from_millis(millis))
+        }
+    };
+    for index in 0..slots {
+        let base = HEADER_WORDS + index * SLOT_WORDS;
+        let hash = word(base + S_HASH);
+        if hash == 0 {
+            continue;
+        }
+        let pid = word(base + S_PID) as u32;
+        mounts.insert(
+            hash,
+            Saved {
+                check: if pid == 0 {
+                    None
+                } else {
+                    Some((pid, word(base + S_PID_START)))
+                },
+                hung_since: optional_time(word(base + S_HUNG_SINCE)),
+                last_success: optional_time(word(base + S_LAST_SUCCESS)),
+                last_check_duration: match word(base + S_LATENCY) {
+                    0 => None,
+                    micros => Some(Duration::from_micros(micros)),
+                },
+            },
+        );
+    }
+    mounts
+}
+
+#[cfg(target_os = "linux")]
+fn boot_time() -> u64 {
+    fs::read_to_string("/proc/stat")
+        .ok()
+        .and_then(|stat| {
+            stat.lines()
+                .find(|line| line.starts_with("btime "))
+                .and_then(|line| line[6..].trim().parse().ok())
+        })
+        .unwrap_or(0)
+}
+
+// A process's state letter and start time in clock ticks after boot:
+#[cfg(target_os = "linux")]
+fn process_start(pid: u32) -> Option<(char, u64)> {
+    if pid == 0 {
+        return None;
+    }
+    let stat = fs::read_to_string(format!("/proc/{}/stat", pid)).ok()?;
+    // The command name is in parentheses and may contain anything, so the
+    // other fields are counted from the last closing parenthesis:
+    let fields: Vec<&str> = stat[stat.rfind(')')? + 1..].split_whitespace().collect();
+    let state = fields.get(0)?.chars().next()?;
+    let start_ticks = fields.get(19)?.parse().ok()?;
+    Some((state, start_ticks))
+}
+
+#[cfg(target_os = "linux")]
+fn is_our_check(pid: u32, start_ticks: u64, mount_point: &Path, inner_path: Option<&Path>) -> bool {
+    use std::os::unix::ffi::OsStrExt;
+
+    match process_start(pid) {
+        Some((state, start)) if start == start_ticks && state != 'Z' => {}
+        _ => return false,
+    }
+    let command_line = match fs::read(format!("/proc/{}/cmdline", pid)) {
+        Ok(command_line) => command_line,
+        Err(_) => return false,
+    };
+    command_line.split(|&byte| byte == 0).any(|argument| {
+        argument == mount_point.as_os_str().as_bytes()
+            || inner_path.map_or(false, |path| argument == path.as_os_str().as_bytes())
+    })
+}
+
+#[cfg(not(target_os = "linux"))]
+fn boot_time() -> u64 {
+    0
+}
+
+#[cfg(not(target_os = "linux"))]
+fn process_start(_pid: u32) -> Option<(char, u64)> {
+    None
+}
+
+#[cfg(not(target_os = "linux"))]
+fn is_our_check(_pid: u32, _start: u64, _mount_point: &Path, _inner: Option<&Path>) -> bool {
+    false
+}
@@ -0,0 +1,97 @@
+// Filesystem capacity collection which cannot hang the monitor
+//
+// Calling statvfs(2) on a dead NFS mount blocks just like stat(2) does, which
+// is why node_exporter's filesystem collector is so often disabled on NFS
+// clients. When capacity collection is enabled we run the check by re-executing
+// ourselves with --statfs-probe instead of /usr/bin/stat: the child performs
+// the statvfs(2) call and prints the results on standard output, giving us the
+// same deadline and SIGKILL protection as any other check.
+
+use std::ffi::CString;
+use std::io::{self, Write};
+use std::mem;
+use std::os::unix::ffi::OsStrExt;
+use std::path::Path;
+
+use libc;
+
+pub const PROBE_ARGUMENT: &str = "--statfs-probe";
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct FilesystemStats {
+    pub size_bytes: u64,
+    pub free_bytes: u64,
+    pub avail_bytes: u64,
+    pub files: u64,
+    pub files_free: u64,
+    pub read_only: bool,
+}
+
+/// Entry point for the child process: returns the exit code
+pub fn run_probe(mount_point: &Path) -> i32 {
+    let path = match CString::new(mount_point.as_os_str().as_bytes()) {
+        Ok(path) => path,
+        Err(_) => return 2,
+    };
+
+    let mut buf: libc::statvfs = unsafe { mem::zeroed() };
+    if unsafe { libc::statvfs(path.as_ptr(), &mut buf) } != 0 {
+        eprintln!(
+            "statvfs({}) failed: {}",
+            mount_point.display(),
+            io::Error::last_os_error()
+        );
+        return 1;
+    }
+
+    // The field types vary between platforms so everything is widened to u64:
+    let fragment_size = buf.f_frsize as u64;
+    let stats = FilesystemStats {
+        size_bytes: buf.f_blocks as u64 * fragment_size,
+        free_bytes: buf.f_bfree as u64 * fragment_size,
+        avail_bytes: buf.f_bavail as u64 * fragment_size,
+        files: buf.f_files as u64,
+        files_free: buf.f_ffree as u64,
+        read_only: buf.f_flag as u64 & libc::ST_RDONLY as u64 != 0,
+    };
+
+    let stdout = io::stdout();
+    let mut stdout = stdout.lock();
+    match writeln!(stdout, "{}", format_stats(&stats)) {
+        Ok(()) => 0,
+        Err(_) => 1,
+    }
+}
+
+fn format_stats(stats: &FilesystemStats) -> String {
+    format!(
+        "{} {} {} {} {} {}",
+        stats.size_bytes,
+        stats.free_bytes,
+        stats.avail_bytes,
+        stats.files,
+        stats.files_free,
+        stats.read_only as u8
+    )
+}
+
+pub fn parse_stats(output: &str) -> Option<FilesystemStats> {
+    let fields = output
+        .split_whitespace()
+        .map(|f| f.parse::<u64>())
+        .collect::<Result<Vec<u64>, _>>()
+        .ok()?;
+
+    if fields.len() != 6 {
+        return None;
+    }
+
+    Some(FilesystemStats {
+        size_bytes: fields[0],
+        free_bytes: fields[1],
+        avail_bytes: fields[2],
+        files: fields[3],
+        files_free: fields[4],
+        read_only: fields[5] != 0,
+    })
+}
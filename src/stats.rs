@@ -0,0 +1,185 @@
+// Measurements of the monitor itself
+//
+// A monitor which needs hundreds of processes every cycle must be able to
+// show that it isn't the thing hurting the host. Each stage of a cycle is
+// timed into a set of atomics which can be read from any thread without
+// locking: the metrics code exports them alongside everything else and
+// --stats prints them on SIGUSR1, which works even when no metrics output
+// is configured.
+
+use std::fmt::Write;
+use std::mem;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{Duration, Instant};
+
+use libc;
+
+use crate::logging;
+
+pub struct Timer {
+    pub name: &'static str,
+    count: AtomicU64,
+    total_nanos: AtomicU64,
+    last_nanos: AtomicU64,
+    max_nanos: AtomicU64,
+}
+
+#[derive(Clone, Copy, Debug, Default)]
+pub struct TimerSnapshot {
+    pub count: u64,
+    pub total: Duration,
+    pub last: Duration,
+    pub max: Duration,
+}
+
+impl Timer {
+    const fn new(name: &'static str) -> Timer {
+        Timer {
+            name,
+            count: AtomicU64::new(0),
+            total_nanos: AtomicU64::new(0),
+            last_nanos: AtomicU64::new(0),
+            max_nanos: AtomicU64::new(0),
+        }
+    }
+
+    pub fn record(&self, duration: Duration) {
+        let nanos = duration.as_secs() * 1_000_000_000 + u64::from(duration.subsec_nanos());
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.total_nanos.fetch_add(nanos, Ordering::Relaxed);
+        self.last_nanos.store(nanos, Ordering::Relaxed);
+
+        let mut max = self.max_nanos.load(Ordering::Relaxed);
+        while nanos > max {
+            match self.max_nanos.compare_exchange_weak(
+                max,
+                nanos,
+                Ordering::Relaxed,
+                Ordering::Relaxed,
+            ) {
+                Ok(_) => break,
+                Err(current) => max = current,
+            }
+        }
+    }
+
+    pub fn time<T, F: FnOnce() -> T>(&self, f: F) -> T {
+        let start_time = Instant::now();
+        let result = f();
+        self.record(start_time.elapsed());
+        result
+    }
+
+    pub fn snapshot(&self) -> TimerSnapshot {
+        TimerSnapshot {
+            count: self.count.load(Ordering::Relaxed),
+            total: Duration::from_nanos(self.total_nanos.load(Ordering::Relaxed)),
+            last: Duration::from_nanos(self.last_nanos.load(Ordering::Relaxed)),
+            max: Duration::from_nanos(self.max_nanos.load(Ordering::Relaxed)),
+        }
+    }
+}
+
+// Reading the mount table:
+pub static MOUNT_TABLE: Timer = Timer::new("mount_table");
+// The whole of check_mounts(), from reading the mount table until every check
+// has finished or timed out:
+pub static CHECKS: Timer = Timer::new("checks");
+// From the start of the parallel checks until a worker picked up each mount:
+pub static QUEUE_WAIT: Timer = Timer::new("queue_wait");
+// fork() and exec() of each check process:
+pub static SPAWN: Timer = Timer::new("spawn");
+// Logging, events and metrics output after the checks:
+pub static REPORT: Timer = Timer::new("report");
+
+pub static TIMERS: &[&Timer] = &[&MOUNT_TABLE, &CHECKS, &QUEUE_WAIT, &SPAWN, &REPORT];
+
+pub static SPAWN_FAILURES: AtomicU64 = AtomicU64::new(0);
+pub static EVENT_BATCHES_DROPPED: AtomicU64 = AtomicU64::new(0);
+
+#[derive(Clone, Copy, Debug, Default)]
+pub struct ResourceUsage {
+    pub user_cpu: Duration,
+    pub system_cpu: Duration,
+    // The check processes, once they have been reaped:
+    pub children_user_cpu: Duration,
+    pub children_system_cpu: Duration,
+    pub max_rss_bytes: u64,
+}
+
+pub fn resource_usage() -> ResourceUsage {
+    let own = rusage(libc::RUSAGE_SELF);
+    let children = rusage(libc::RUSAGE_CHILDREN);
+
+    // macOS reports ru_maxrss in bytes where everyone else uses kilobytes:
+    let max_rss_bytes = if cfg!(target_os = "macos") {
+        own.ru_maxrss as u64
+    } else {
+        own.ru_maxrss as u64 * 1024
+    };
+
+    ResourceUsage {
+        user_cpu: timeval_duration(own.ru_utime),
+        system_cpu: timeval_duration(own.ru_stime),
+        children_user_cpu: timeval_duration(children.ru_utime),
+        children_system_cpu: timeval_duration(children.ru_stime),
+        max_rss_bytes,
+    }
+}
+
+fn rusage(who: libc::c_int) -> libc::rusage {
+    let mut usage: libc::rusage = unsafe { mem::zeroed() };
+    // getrusage() can only fail for an invalid argument:
+    unsafe { libc::getrusage(who, &mut usage) };
+    usage
+}
+
+fn timeval_duration(tv: libc::timeval) -> Duration {
+    Duration::from_secs(tv.tv_sec as u64) + Duration::from_micros(tv.tv_usec as u64)
+}
+
+/// A human-readable summary for --stats
+pub fn dump() -> String {
+    let mut output = String::from("mount_status_monitor statistics:\n");
+
+    for timer in TIMERS {
+        let snapshot = timer.snapshot();
+        let _ = writeln!(
+            output,
+            "  {:<12} count={} total={:.3}s last={:.6}s max={:.6}s",
+            timer.name,
+            snapshot.count,
+            seconds(snapshot.total),
+            seconds(snapshot.last),
+            seconds(snapshot.max)
+        );
+    }
+
+    let usage = resource_usage();
+    let _ = writeln!(
+        output,
+        "  cpu          user={:.3}s system={:.3}s children_user={:.3}s children_system={:.3}s",
+        seconds(usage.user_cpu),
+        seconds(usage.system_cpu),
+        seconds(usage.children_user_cpu),
+        seconds(usage.children_system_cpu)
+    );
+    let _ = writeln!(output, "  max_rss      {} bytes", usage.max_rss_bytes);
+    let _ = writeln!(
+        output,
+        "  spawn_fails  {}",
+        SPAWN_FAILURES.load(Ordering::Relaxed)
+    );
+    let _ = writeln!(
+        output,
+        "  dropped      log_messages={} event_batches={}",
+        logging::dropped_records(),
+        EVENT_BATCHES_DROPPED.load(Ordering::Relaxed)
+    );
+
+    output
+}
+
+pub fn seconds(d: Duration) -> f64 {
+    d.as_secs() as f64 + f64::from(d.subsec_nanos()) / 1e9
+}
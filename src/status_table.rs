@@ -0,0 +1,620 @@
+// A memory-mapped table of mount states for other processes
+//
+// Backup agents, shell prompts and anything else which walks the filesystem
+// hang on a dead mount just as we would, and asking the monitor over the
+// control socket still costs a connection. With --status-table PATH (normally
+// somewhere under /run) the monitor also publishes each mount's state in a
+// small file of fixed layout which readers map into memory, so checking a path
+// takes a few memory reads and no system calls at all once the file is mapped.
+//
+// The file is an array of little-endian u64 words. The header is 8 words:
+//
+//   0  magic "MSMTBL01"
+//   1  layout version (1)
+//   2  sequence number: odd while the table is being written
+//   3  number of slots, a power of two
+//   4  milliseconds since the Unix epoch when the table was last written
+//   5  flags: bit 0 is set once the file has been replaced by a larger table
+//   6  number of occupied slots
+//   7  reserved
+//
+// followed by slots of 8 words:
+//
+//   0  FNV-1a hash of the mountpoint's path, 0 for an empty slot
+//   1  state: 1 alive, 2 failed, 3 signaled, 4 hung
+//   2  milliseconds since the epoch at the end of the cycle which last
+//      checked the mount
+//   3  duration of the last completed check in microseconds
+//   4  milliseconds since the epoch of the last successful check, or 0
+//   5  milliseconds since the epoch when a hung check started, or 0
+//   6  reserved
+//   7  reserved
+//
+// Mounts are found by linear probing from hash % slots. The whole table is
+// protected by the sequence number in the manner of a seqlock: readers note it
+// before reading, retry if it was odd and retry if it has changed afterwards.
+// A monitor killed part way through a write leaves the sequence number odd for
+// good, so readers give up after READ_TIMEOUT rather than spinning forever.
+// The table is sized so at least half the slots are free; when the number of
+// mounts outgrows it, or a monitor starts up, a new file is renamed into place
+// and the old one flagged so long-running readers know to map the file again.
+//
+// `mount_status_monitor lookup PATH...` is a reader which reports the state of
+// the mount holding each path, found by lexically searching upwards for a
+// known mountpoint since looking at the path itself could hang.
+
+use std::collections::HashMap;
+use std::fs;
+use std::io;
+use std::mem;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::io::AsRawFd;
+use std::path::{Component, Path, PathBuf};
+use std::ptr;
+use std::slice;
+use std::sync::atomic::{fence, AtomicU64, Ordering};
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+
+use argparse::{ArgumentParser, List, Store};
+use libc;
+
+use crate::clock::Clock;
+use crate::errors::*;
+use crate::{MountState, MountStatus, StatusKind};
+
+const MAGIC: u64 = 0x3130_4c42_544d_534d; // "MSMTBL01" read as little-endian
+const VERSION: u64 = 1;
+const HEADER_WORDS: usize = 8;
+const SLOT_WORDS: usize = 8;
+const MIN_SLOTS: usize = 1024;
+const RETIRED: u64 = 1;
+// Writes take as long as a copy, so a table which stays busy for this long
+// was abandoned part way through by a monitor which died:
+const READ_TIMEOUT: Duration = Duration::from_secs(1);
+
+const H_MAGIC: usize = 0;
+const H_VERSION: usize = 1;
+const H_SEQUENCE: usize = 2;
+const H_SLOTS: usize = 3;
+const H_UPDATED: usize = 4;
+const H_FLAGS: usize = 5;
+const H_COUNT: usize = 6;
+
+const S_HASH: usize = 0;
+const S_STATE: usize = 1;
+const S_CHECKED: usize = 2;
+const S_LATENCY: usize = 3;
+const S_LAST_SUCCESS: usize = 4;
+const S_HUNG_SINCE: usize = 5;
+
+/// The hash identifying a mountpoint in the table, FNV-1a over the path's bytes
+pub fn path_hash(path: &Path) -> u64 {
+    let hash = path
+        .as_os_str()
+        .as_bytes()
+        .iter()
+        .fold(0xcbf2_9ce4_8422_2325, |hash: u64, &byte| {
+            (hash ^ u64::from(byte)).wrapping_mul(0x0100_0000_01b3)
+        });
+    // Zero marks an empty slot:
+    hash.max(1)
+}
+
+pub fn state_code(kind: StatusKind) -> u64 {
+    match kind {
+        StatusKind::Alive => 1,
+        StatusKind::Failed => 2,
+        StatusKind::Signaled => 3,
+        StatusKind::Hung => 4,
+    }
+}
+
+pub fn state_name(code: u64) -> &'static str {
+    match code {
+        1 => StatusKind::Alive.name(),
+        2 => StatusKind::Failed.name(),
+        3 => StatusKind::Signaled.name(),
+        4 => StatusKind::Hung.name(),
+        _ => "unknown",
+    }
+}
+
+pub fn epoch_millis(time: SystemTime) -> u64 {
+    time.duration_since(UNIX_EPOCH)
+        .map(|d| d.as_secs() * 1000 + u64::from(d.subsec_millis()))
+        .unwrap_or(0)
+}
+
+/// A shared mapping of a table file viewed as atomic words
+pub struct Mapping {
+    words: *const AtomicU64,
+    len: usize,
+}
+
+// The mapping is only ever accessed through atomics:
+unsafe impl Send for Mapping {}
+unsafe impl Sync for Mapping {}
+
+impl Mapping {
+    pub fn new(file: &fs::File, len: usize, writable: bool) -> io::Result<Mapping> {
+        let protection = if writable {
+            libc::PROT_READ | libc::PROT_WRITE
+        } else {
+            libc::PROT_READ
+        };
+        let address = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len * mem::size_of::<u64>(),
+                protection,
+                libc::MAP_SHARED,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if address == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Mapping {
+            words: address as *const AtomicU64,
+            len,
+        })
+    }
+
+    pub fn words(&self) -> &[AtomicU64] {
+        unsafe { slice::from_raw_parts(self.words, self.len) }
+    }
+
+    /// Write any modified pages back to the file
+    pub fn sync(&self) -> io::Result<()> {
+        let rc = unsafe {
+            libc::msync(
+                self.words as *mut libc::c_void,
+                self.len * mem::size_of::<u64>(),
+                libc::MS_SYNC,
+            )
+        };
+        if rc != 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(())
+    }
+}
+
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(
+                self.words as *mut libc::c_void,
+                self.len * mem::size_of::<u64>(),
+            );
+        }
+    }
+}
+
+/// The daemon's side of the table
+pub struct StatusTable {
+    path: PathBuf,
+    mapping: Mapping,
+    slots: usize,
+}
+
+impl StatusTable {
+    /// Create an empty table, replacing any previous file
+    pub fn create(path: &Path) -> Result<StatusTable> {
+        let table = StatusTable::prepare(path, MIN_SLOTS)?;
+        let previous = StatusTable::previous_header(path);
+        table.install()?;
+        // Readers may still have the last monitor's table mapped:
+        if let Some(previous) = previous {
+            previous.words()[H_FLAGS].fetch_or(RETIRED, Ordering::Release);
+        }
+        Ok(table)
+    }
+
+    // The header of a table left by an earlier monitor, if there is one:
+    fn previous_header(path: &Path) -> Option<Mapping> {
+        let file = fs::OpenOptions::new()
+            .read(true)
+            .write(true)
+            .open(path)
+            .ok()?;
+        let size = file.metadata().ok()?.len() as usize;
+        if size < HEADER_WORDS * mem::size_of::<u64>() {
+            return None;
+        }
+        let mapping = Mapping::new(&file, HEADER_WORDS, true).ok()?;
+        if mapping.words()[H_MAGIC].load(Ordering::Acquire) != MAGIC {
+            return None;
+        }
+        Some(mapping)
+    }
+
+    // Tables are prepared under a temporary name so readers never see one
+    // which is only partly written:
+    fn temporary_path(path: &Path) -> PathBuf {
+        let mut temporary_name = path.as_os_str().to_owned();
+        temporary_name.push(".tmp");
+        PathBuf::from(temporary_name)
+    }
+
+    fn prepare(path: &Path, slots: usize) -> Result<StatusTable> {
+        let temporary_path = StatusTable::temporary_path(path);
+
+        let len = HEADER_WORDS + slots * SLOT_WORDS;
+        let file = fs::OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .truncate(true)
+            .open(&temporary_path)
+            .chain_err(|| format!("Unable to create {}", temporary_path.display()))?;
+        file.set_len((len * mem::size_of::<u64>()) as u64)
+            .chain_err(|| format!("Unable to size {}", temporary_path.display()))?;
+        let mapping = Mapping::new(&file, len, true)
+            .chain_err(|| format!("Unable to map {}", temporary_path.display()))?;
+
+        {
+            let header = mapping.words();
+            header[H_VERSION].store(VERSION, Ordering::Relaxed);
+            header[H_SLOTS].store(slots as u64, Ordering::Relaxed);
+            header[H_MAGIC].store(MAGIC, Ordering::Release);
+        }
+
+        Ok(StatusTable {
+            path: path.to_owned(),
+            mapping,
+            slots,
+        })
+    }
+
+    fn install(&self) -> Result<()> {
+        fs::rename(StatusTable::temporary_path(&self.path), &self.path)
+            .chain_err(|| format!("Unable to replace {}", self.path.display()))
+    }
+
+    /// Publish the state of every mount at the end of a cycle
+    pub fn update(
+        &mut self,
+        mount_statuses: &HashMap<PathBuf, MountState>,
+        clock: &dyn Clock,
+    ) -> Result<()> {
+        if mount_statuses.len() * 2 <= self.slots {
+            self.write(mount_statuses, clock);
+            return Ok(());
+        }
+
+        let slots = (mount_statuses.len() * 2).next_power_of_two();
+        let replacement = StatusTable::prepare(&self.path, slots)?;
+        replacement.write(mount_statuses, clock);
+        replacement.install()?;
+        let previous = mem::replace(self, replacement);
+        previous.mapping.words()[H_FLAGS].fetch_or(RETIRED, Ordering::Release);
+        Ok(())
+    }
+
+    fn write(&self, mount_statuses: &HashMap<PathBuf, MountState>, clock: &dyn Clock) {
+        // Lay the slots out in private memory first so the readers' retry
+        // window is only as long as a copy:
+        let mut slots = vec![[0u64; SLOT_WORDS]; self.slots];
+        let now = clock.now();
+        let system_now = clock.system_time();
+        for (mount_point, state) in mount_statuses {
+            let hash = path_hash(mount_point);
+            let mut index = hash as usize & (self.slots - 1);
+            while slots[index][S_HASH] != 0 {
+                index = (index + 1) & (self.slots - 1);
+            }
+
+            let hung_since = match state.status {
+                MountStatus::CheckRunning { start_time, .. } => {
+                    epoch_millis(system_now - now.duration_since(start_time))
+                }
+                _ => 0,
+            };
+            slots[index] = [
+                hash,
+                state_code(state.status.kind()),
+                epoch_millis(system_now),
+                state.last_check_duration.map_or(0, |d| {
+                    d.as_secs() * 1_000_000 + u64::from(d.subsec_micros())
+                }),
+                state.last_success.map_or(0, epoch_millis),
+                hung_since,
+                0,
+                0,
+            ];
+        }
+
+        let words = self.mapping.words();
+        let sequence = words[H_SEQUENCE].load(Ordering::Relaxed);
+        words[H_SEQUENCE].store(sequence + 1, Ordering::Relaxed);
+        fence(Ordering::Release);
+
+        for (index, slot) in slots.iter().enumerate() {
+            let base = HEADER_WORDS + index * SLOT_WORDS;
+            for (offset, &value) in slot.iter().enumerate() {
+                words[base + offset].store(value, Ordering::Relaxed);
+            }
+        }
+        words[H_COUNT].store(mount_statuses.len() as u64, Ordering::Relaxed);
+        words[H_UPDATED].store(epoch_millis(system_now), Ordering::Relaxed);
+
+        words[H_SEQUENCE].store(sequence + 2, Ordering::Release);
+    }
+}
+
+/// What the table says about a single mount
+#[derive(Clone, Debug)]
+pub struct Entry {
+    pub state: &'static str,
+    pub checked: SystemTime,
+    pub check_duration: Option<Duration>,
+    pub last_success: Option<SystemTime>,
+    pub hung_since: Option<SystemTime>,
+}
+
+/// A read-only view of a table published by the daemon
+pub struct Reader {
+    path: PathBuf,
+    mapping: Mapping,
+    slots: usize,
+}
+
+impl Reader {
+    pub fn open(path: &Path) -> Result<Reader> {
+        let file =
+            fs::File::open(path).chain_err(|| format!("Unable to open {}", path.display()))?;
+        let size = file
+            .metadata()
+            .chain_err(|| format!("Unable to stat {}", path.display()))?
+            .len() as usize;
+        let len = size / mem::size_of::<u64>();
+        if len < HEADER_WORDS {
+            return Err(format!("{} is not a mount status table", path.display()).into());
+        }
+
+        let mapping = Mapping::new(&file, len, false)
+            .chain_err(|| format!("Unable to map {}", path.display()))?;
+        let (magic, version, slots) = {
+            let header = mapping.words();
+            (
+                header[H_MAGIC].load(Ordering::Acquire),
+                header[H_VERSION].load(Ordering::Relaxed),
+                header[H_SLOTS].load(Ordering::Relaxed) as usize,
+            )
+        };
+        if magic != MAGIC || version != VERSION {
+            return Err(format!(
+                "{} is not a version {} mount status table",
+                path.display(),
+                VERSION
+            )
+            .into());
+        }
+        if !slots.is_power_of_two() || HEADER_WORDS + slots * SLOT_WORDS > len {
+            return Err(format!("{} is truncated", path.display()).into());
+        }
+
+        Ok(Reader {
+            path: path.to_owned(),
+            mapping,
+            slots,
+        })
+    }
+
+    /// Whether the daemon has moved to a new file which should be opened instead
+    pub fn retired(&self) -> bool {
+        self.mapping.words()[H_FLAGS].load(Ordering::Acquire) & RETIRED != 0
+    }
+
+    /// When the daemon last wrote the table
+    pub fn updated(&self) -> Result<SystemTime> {
+        self.consistent(|words| from_millis(words[H_UPDATED].load(Ordering::Relaxed)))
+    }
+
+    /// The state of the mount at exactly this path
+    pub fn get(&self, mount_point: &Path) -> Result<Option<Entry>> {
+        let hash = path_hash(mount_point);
+        let slots = self.slots;
+        self.consistent(|words| {
+            let mut index = hash as usize & (slots - 1);
+            for _ in 0..slots {
+                let base = HEADER_WORDS + index * SLOT_WORDS;
+                let slot_hash = words[base + S_HASH].load(Ordering::Relaxed);
+                if slot_hash == 0 {
+                    return None;
+                }
+                if slot_hash == hash {
+                    let word = |offset: usize| words[base + offset].load(Ordering::Relaxed);
+                    let optional_time = |millis: u64| {
+                        if millis == 0 {
+                            None
+                        } else {
+                            Some(from_millis(millis))
+                        }
+                    };
+                    return Some(Entry {
+                        state: state_name(word(S_STATE)),
+                        checked: from_millis(word(S_CHECKED)),
+                        check_duration: match word(S_LATENCY) {
+                            0 => None,
+                            micros => Some(Duration::from_micros(micros)),
+                        },
+                        last_success: optional_time(word(S_LAST_SUCCESS)),
+                        hung_since: optional_time(word(S_HUNG_SINCE)),
+                    });
+                }
+                index = (index + 1) & (slots - 1);
+            }
+            None
+        })
+    }
+
+    /// The state of the mount holding path, found without touching the
+    /// filesystem by trying each of its ancestors
+    pub fn find(&self, path: &Path) -> Result<Option<(PathBuf, Entry)>> {
+        for ancestor in path.ancestors() {
+            if ancestor.as_os_str().is_empty() {
+                continue;
+            }
+            if let Some(entry) = self.get(ancestor)? {
+                return Ok(Some((ancestor.to_owned(), entry)));
+            }
+        }
+        Ok(None)
+    }
+
+    // Run a read until it completes without the daemon writing concurrently:
+    fn consistent<T, F: Fn(&[AtomicU64]) -> T>(&self, read: F) -> Result<T> {
+        let words = self.mapping.words();
+        let deadline = Instant::now() + READ_TIMEOUT;
+        loop {
+            let before = words[H_SEQUENCE].load(Ordering::Acquire);
+            if before & 1 == 0 {
+                let result = read(words);
+                fence(Ordering::Acquire);
+                if words[H_SEQUENCE].load(Ordering::Relaxed) == before {
+                    return Ok(result);
+                }
+            }
+            if Instant::now() >= deadline {
+                return Err(format!(
+                    "{} was left part way through an update; is the monitor running?",
+                    self.path.display()
+                )
+                .into());
+            }
+            ::std::thread::yield_now();
+        }
+    }
+}
+
+pub fn from_millis(millis: u64) -> SystemTime {
+    UNIX_EPOCH + Duration::from_millis(millis)
+}
+
+/// The lookup subcommand; exits with 0 if every path is on a live mount
+pub fn run(args: Vec<String>) -> Result<()> {
+    let mut table = "/run/mount_status_monitor.table".to_owned();
+    let mut max_age: u64 = 300;
+    let mut paths: Vec<String> = Vec::new();
+
+    {
+        let mut ap = ArgumentParser::new();
+        ap.set_description(
+            "Report the state of the mounts holding each path from the monitor's status table, without touching them",
+        );
+
+        ap.refer(&mut table)
+            .add_option(&["--table"], Store, "The monitor's --status-table file");
+
+        ap.refer(&mut max_age).add_option(
+            &["--max-age"],
+            Store,
+            "Treat the table as unavailable if the monitor has not updated it for this many seconds",
+        );
+
+        ap.refer(&mut paths)
+            .add_argument("path", List, "Paths to look up")
+            .required();
+
+        let mut args = args;
+        args[0] = "mount_status_monitor lookup".to_owned();
+        if let Err(rc) = ap.parse(args, &mut io::stdout(), &mut io::stderr()) {
+            ::std::process::exit(rc);
+        }
+    }
+
+    // Exit codes 0 and 1 describe the mounts so problems with the table itself
+    // are reported with 2:
+    let unavailable = |e: Error| -> ! {
+        eprintln!("{}", e);
+        ::std::process::exit(2);
+    };
+    let reader = open_current(Path::new(&table)).unwrap_or_else(|e| unavailable(e));
+    let now = SystemTime::now();
+    let updated = reader.updated().unwrap_or_else(|e| unavailable(e));
+    let age = now.duration_since(updated).unwrap_or_default();
+    if age > Duration::from_secs(max_age) {
+        eprintln!(
+            "{} was last updated {} seconds ago; is the monitor running?",
+            table,
+            age.as_secs()
+        );
+        ::std::process::exit(2);
+    }
+
+    let current_dir = ::std::env::current_dir().unwrap_or_else(|_| PathBuf::from("/"));
+    let mut all_alive = true;
+    for path in &paths {
+        let found = reader
+            .find(&lexical_absolute(&current_dir, Path::new(path)))
+            .unwrap_or_else(|e| unavailable(e));
+        match found {
+            Some((mount_point, entry)) => {
+                all_alive &= entry.state == StatusKind::Alive.name();
+                println!(
+                    "{}\t{}\t{}",
+                    path,
+                    mount_point.display(),
+                    describe(&entry, now)
+                );
+            }
+            None => {
+                all_alive = false;
+                println!("{}\t-\tunknown", path);
+            }
+        }
+    }
+
+    if !all_alive {
+        ::std::process::exit(1);
+    }
+    Ok(())
+}
+
+fn open_current(path: &Path) -> Result<Reader> {
+    let reader = Reader::open(path)?;
+    // We may have opened the old file just as it was replaced:
+    if reader.retired() {
+        Reader::open(path)
+    } else {
+        Ok(reader)
+    }
+}
+
+// Resolve . and .. without looking at the filesystem, which could hang:
+fn lexical_absolute(current_dir: &Path, path: &Path) -> PathBuf {
+    let mut absolute = PathBuf::from("/");
+    for component in current_dir.join(path).components() {
+        match component {
+            Component::Normal(name) => absolute.push(name),
+            Component::ParentDir => {
+                absolute.pop();
+            }
+            Component::RootDir | Component::CurDir | Component::Prefix(_) => {}
+        }
+    }
+    absolute
+}
+
+fn describe(entry: &Entry, now: SystemTime) -> String {
+    let ago = |time: SystemTime| now.duration_since(time).unwrap_or_default().as_secs();
+    let mut description = format!("{}, checked {}s ago", entry.state, ago(entry.checked));
+    if let Some(duration) = entry.check_duration {
+        description.push_str(&format!(" in {}ms", duration.as_millis()));
+    }
+    if let Some(hung_since) = entry.hung_since {
+        description.push_str(&format!(", hung for {}s", ago(hung_since)));
+    }
+    if entry.state != StatusKind::Alive.name() {
+        match entry.last_success {
+            Some(last_success) => {
+                description.push_str(&format!(", last alive {}s ago", ago(last_success)))
+            }
+            None => description.push_str(", never seen alive"),
+        }
+    }
+    description
+}
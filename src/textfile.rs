@@ -0,0 +1,119 @@
+// Output for node_exporter's textfile collector
+//
+// node_exporter reads every *.prom file in its textfile directory on each
+// scrape, so the file must never be observed half-written. We write the new
+// contents to a temporary file in the same directory (and therefore on the
+// same filesystem, which should be local) and rename(2) it over the old one,
+// which atomically replaces the directory entry. The temporary name does not
+// end in .prom so the collector will ignore it if it's left behind.
+//
+// Check durations, timestamps and our own resource usage change on nearly
+// every cycle, but the state of the mounts rarely does. We keep a copy of the
+// series describing that state as last written and skip the write while they
+// are unchanged, refreshing the rest at most every REFRESH_INTERVAL so that
+// neither they nor the file's mtime go stale.
+
+use std::fs;
+use std::io::Write;
+use std::path::PathBuf;
+use std::process;
+use std::time::{Duration, Instant};
+
+use prometheus::proto::MetricFamily;
+use prometheus::{Encoder, TextEncoder};
+
+use crate::errors::*;
+
+// The metric families which force a write as soon as they change:
+const STATE_SERIES: &[&str] = &[
+    "total_mountpoints",
+    "dead_mountpoints",
+    "mountpoint_up",
+    "filesystem_readonly",
+    "mountpoint_series_dropped",
+];
+
+const REFRESH_INTERVAL: Duration = Duration::from_secs(300);
+
+pub struct TextfileWriter {
+    path: PathBuf,
+    temp_path: PathBuf,
+    // The state series and time of the last write:
+    last_written: Option<(Vec<u8>, Instant)>,
+}
+
+impl TextfileWriter {
+    pub fn new(path: PathBuf) -> Result<TextfileWriter> {
+        let file_name = match path.file_name() {
+            Some(file_name) if file_name.to_string_lossy().ends_with(".prom") => {
+                file_name.to_string_lossy().into_owned()
+            }
+            _ => {
+                return Err(format!(
+                    "The textfile output {} must have a .prom extension",
+                    path.display()
+                )
+                .into())
+            }
+        };
+
+        let temp_path = path.with_file_name(format!(".{}.{}", file_name, process::id()));
+
+        Ok(TextfileWriter {
+            path,
+            temp_path,
+            last_written: None,
+        })
+    }
+
+    /// Render the metrics and replace the output file if the state of the
+    /// mounts changed or the file is due a refresh, returning whether the file
+    /// was written
+    pub fn write(&mut self, metrics: &[MetricFamily]) -> Result<bool> {
+        let encoder = TextEncoder::new();
+
+        let state: Vec<MetricFamily> = metrics
+            .iter()
+            .filter(|family| STATE_SERIES.contains(&family.get_name()))
+            .cloned()
+            .collect();
+        let mut state_buffer = Vec::new();
+        encoder
+            .encode(&state, &mut state_buffer)
+            .chain_err(|| "Unable to encode metrics")?;
+
+        if let Some((ref last_state, written_at)) = self.last_written {
+            if *last_state == state_buffer && written_at.elapsed() < REFRESH_INTERVAL {
+                return Ok(false);
+            }
+        }
+
+        let mut buffer = Vec::new();
+        encoder
+            .encode(metrics, &mut buffer)
+            .chain_err(|| "Unable to encode metrics")?;
+
+        {
+            let mut temp_file = fs::File::create(&self.temp_path)
+                .chain_err(|| format!("Unable to create {}", self.temp_path.display()))?;
+            // Without the sync a crash shortly after the rename can leave an
+            // empty file behind on filesystems which delay allocation:
+            if let Err(e) = temp_file
+                .write_all(&buffer)
+                .and_then(|_| temp_file.sync_all())
+            {
+                let _ = fs::remove_file(&self.temp_path);
+                return Err(e)
+                    .chain_err(|| format!("Unable to write {}", self.temp_path.display()));
+            }
+        }
+
+        if let Err(e) = fs::rename(&self.temp_path, &self.path) {
+            let _ = fs::remove_file(&self.temp_path);
+            return Err(e).chain_err(|| format!("Unable to replace {}", self.path.display()));
+        }
+
+        self.last_written = Some((state_buffer, Instant::now()));
+        Ok(true)
+    }
+}
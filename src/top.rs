@@ -0,0 +1,809 @@
+// A live terminal view of every mount
+//
+// When a host misbehaves the first questions are which mounts are slow or
+// hung, for how long, and whether they share a server. `mount_status_monitor
+// top` shows one line per mount with its state, the duration of its last
+// check, the 99th percentile over the last 5 minutes, how long a hung check has
+// been stuck and the server it is mounted from, refreshed in place.
+//
+// It reads the state from a running monitor's --control-socket, which serves
+// it from the monitor's snapshots without starting any checks. With --local,
+// or when nothing is listening on the socket, it runs the normal checks itself
+// in a background thread and reads the same snapshots directly.
+//
+// The view is cheap to keep open with thousands of mounts: the rows are only
+// rebuilt when the state they came from has changed, only the rows which fit
+// on the screen are formatted, and only the screen lines which differ from the
+// last refresh are rewritten. Keys change the order: l (last check duration,
+// the default), p (p99), s (state), a (hung age), g (server) and n (name).
+// When the output is not a terminal a single plain table is printed instead.
+
+use std::cmp::Ordering;
+use std::collections::HashMap;
+use std::io::{self, Read, Write};
+use std::mem;
+use std::os::unix::net::UnixStream;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::thread;
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+
+use argparse::{ArgumentParser, Store, StoreTrue};
+use libc;
+
+use crate::clock::{Clock, SystemClock};
+use crate::errors::*;
+use crate::get_mounts::SystemMounts;
+use crate::probe::{self, ProcessProber};
+use crate::schedule::{OverrunPolicy, Scheduler};
+use crate::snapshot::{MountView, StatusBoard};
+use crate::stats::seconds;
+use crate::windows::QUANTILES;
+use crate::{check_mounts, MountState};
+
+const SOCKET_TIMEOUT: Duration = Duration::from_secs(2);
+
+// Lines above the rows: the title, the totals and the column headings:
+const HEADER_LINES: usize = 3;
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+enum SortKey {
+    Latency,
+    P99,
+    State,
+    HungAge,
+    Server,
+    Name,
+}
+
+impl SortKey {
+    fn from_key(key: u8) -> Option<SortKey> {
+        match key {
+            b'l' => Some(SortKey::Latency),
+            b'p' => Some(SortKey::P99),
+            b's' => Some(SortKey::State),
+            b'a' => Some(SortKey::HungAge),
+            b'g' => Some(SortKey::Server),
+            b'n' => Some(SortKey::Name),
+            _ => None,
+        }
+    }
+
+    fn name(self) -> &'static str {
+        match self {
+            SortKey::Latency => "latency",
+            SortKey::P99 => "p99",
+            SortKey::State => "state",
+            SortKey::HungAge => "hung age",
+            SortKey::Server => "server",
+            SortKey::Name => "name",
+        }
+    }
+}
+
+struct Row {
+    mount_point: String,
+    server: String,
+    state: String,
+    latency: Option<f64>,
+    p99: Option<f64>,
+    hung_since: Option<SystemTime>,
+    checked: Option<SystemTime>,
+}
+
+impl Row {
+    fn from_view(mount_point: &Path, view: Option<&MountView>) -> Row {
+        let mount_point = mount_point.to_string_lossy().into_owned();
+        match view {
+            Some(view) => Row {
+                mount_point,
+                server: server(&view.source, &view.fs_type),
+                state: view.status.name().to_owned(),
+                latency: view.last_check_duration.map(seconds),
+                p99: view
+                    .windows
+                    .as_ref()
+                    .and_then(|windows| windows.first())
+                    .and_then(|totals| totals.quantile(QUANTILES[2].1)),
+                hung_since: view.hung_since,
+                checked: Some(view.checked),
+            },
+            None => Row::unknown(mount_point),
+        }
+    }
+
+    fn unknown(mount_point: String) -> Row {
+        Row {
+            mount_point,
+            server: String::new(),
+            state: "unknown".to_owned(),
+            latency: None,
+            p99: None,
+            hung_since: None,
+            checked: None,
+        }
+    }
+
+    // Parse a line of the control socket's status reply:
+    fn from_json(line: &str) -> Option<Row> {
+        let fields = match Json::parse(line)? {
+            Json::Object(fields) => fields,
+            _ => return None,
+        };
+        let field = |fields: &[(String, Json)], key: &str| -> Option<Json> {
+            fields
+                .iter()
+                .find(|&&(ref name, _)| name == key)
+                .map(|&(_, ref value)| value.clone())
+        };
+        let string = |key: &str| match field(&fields, key) {
+            Some(Json::String(value)) => Some(value),
+            _ => None,
+        };
+        let number = |fields: &[(String, Json)], key: &str| match field(fields, key) {
+            Some(Json::Number(value)) => Some(value),
+            _ => None,
+        };
+        let time = |key: &str| {
+            number(&fields, key).map(|t| UNIX_EPOCH + Duration::from_millis((t * 1e3) as u64))
+        };
+
+        let mut row = Row::unknown(string("mountpoint")?);
+        row.server = server(
+            &string("source").unwrap_or_default(),
+            &string("fstype").unwrap_or_default(),
+        );
+        row.state = string("status")?;
+        row.latency = number(&fields, "check_duration_seconds");
+        row.hung_since = time("hung_since");
+        row.checked = time("checked");
+        if let Some(Json::Object(windows)) = field(&fields, "windows") {
+            if let Some(Json::Object(window)) = windows.into_iter().next().map(|(_, w)| w) {
+                row.p99 = number(&window, "p99");
+            }
+        }
+        Some(row)
+    }
+
+    fn hung_for(&self, now: SystemTime) -> Option<Duration> {
+        self.hung_since
+            .map(|since| now.duration_since(since).unwrap_or_default())
+    }
+}
+
+// What the mount's server is called, or its source if it has none:
+fn server(source: &str, fs_type: &str) -> String {
+    if source.starts_with("//") {
+        // CIFS: //server/share
+        return source[2..].split('/').next().unwrap_or("").to_owned();
+    }
+    match source.find(":/") {
+        // NFS and friends: server:/export, including [v6::address]:/export
+        Some(colon) if fs_type.starts_with("nfs") || !source.starts_with('/') => source[..colon]
+            .trim_matches(|c| c == '[' || c == ']')
+            .to_owned(),
+        _ => source.to_owned(),
+    }
+}
+
+fn state_rank(state: &str) -> u8 {
+    match state {
+        "hung" => 0,
+        "signaled" => 1,
+        "failed" => 2,
+        "unknown" => 3,
+        _ => 4,
+    }
+}
+
+// Larger values first, with missing ones last:
+fn descending(a: Option<f64>, b: Option<f64>) -> Ordering {
+    match (a, b) {
+        (Some(a), Some(b)) => b.partial_cmp(&a).unwrap_or(Ordering::Equal),
+        (Some(_), None) => Ordering::Less,
+        (None, Some(_)) => Ordering::Greater,
+        (None, None) => Ordering::Equal,
+    }
+}
+
+fn sort_rows(rows: &mut [Row], key: SortKey, now: SystemTime) {
+    // A hung mount's latency is at least as long as it has been hung:
+    let latency = |row: &Row| match row.hung_for(now) {
+        Some(hung_for) => Some(seconds(hung_for).max(row.latency.unwrap_or(0.0))),
+        None => row.latency,
+    };
+    rows.sort_by(|a, b| {
+        let order = match key {
+            SortKey::Latency => descending(latency(a), latency(b)),
+            SortKey::P99 => descending(a.p99, b.p99),
+            SortKey::State => state_rank(&a.state)
+                .cmp(&state_rank(&b.state))
+                .then_with(|| descending(latency(a), latency(b))),
+            SortKey::HungAge => {
+                descending(a.hung_for(now).map(seconds), b.hung_for(now).map(seconds))
+                    .then_with(|| descending(latency(a), latency(b)))
+            }
+            SortKey::Server => a
+                .server
+                .cmp(&b.server)
+                .then_with(|| state_rank(&a.state).cmp(&state_rank(&b.state))),
+            SortKey::Name => Ordering::Equal,
+        };
+        order.then_with(|| a.mount_point.cmp(&b.mount_point))
+    });
+}
+
+// Where the rows come from:
+enum Source {
+    // A running monitor's control socket, with its last reply:
+    Socket(PathBuf, Option<String>),
+    // Our own checks, and the board changes the rows were built from:
+    Local(Arc<StatusBoard>, Option<(u64, u64)>),
+}
+
+impl Source {
+    fn describe(&self) -> String {
+        match *self {
+            Source::Socket(ref path, _) => format!("monitor at {}", path.display()),
+            Source::Local(..) => "own checks".to_owned(),
+        }
+    }
+
+    // The current rows, or None if nothing has changed since the last call:
+    fn poll(&mut self) -> Result<Option<Vec<Row>>> {
+        match *self {
+            Source::Socket(ref path, ref mut last_reply) => {
+                let reply = query(path)?;
+                if last_reply.as_ref() == Some(&reply) {
+                    return Ok(None);
+                }
+                let rows = reply.lines().filter_map(Row::from_json).collect();
+                *last_reply = Some(reply);
+                Ok(Some(rows))
+            }
+            Source::Local(ref board, ref mut last_changes) => {
+                let snapshot = board.load();
+                let changes = snapshot.changes();
+                if *last_changes == Some(changes) {
+                    return Ok(None);
+                }
+                *last_changes = Some(changes);
+                Ok(Some(
+                    snapshot
+                        .mounts
+                        .iter()
+                        .map(|(mount_point, slot)| {
+                            Row::from_view(mount_point, slot.load().as_ref().as_ref())
+                        })
+                        .collect(),
+                ))
+            }
+        }
+    }
+}
+
+fn local_source(source: &Source) -> bool {
+    match *source {
+        Source::Local(..) => true,
+        Source::Socket(..) => false,
+    }
+}
+
+fn query(path: &Path) -> Result<String> {
+    let mut stream = UnixStream::connect(path)
+        .chain_err(|| format!("Unable to connect to {}", path.display()))?;
+    let mut reply = String::new();
+    stream
+        .set_read_timeout(Some(SOCKET_TIMEOUT))
+        .and_then(|_| stream.set_write_timeout(Some(SOCKET_TIMEOUT)))
+        .and_then(|_| stream.write_all(b"status\n"))
+        .and_then(|_| stream.read_to_string(&mut reply))
+        .chain_err(|| format!("Unable to read the status from {}", path.display()))?;
+    Ok(reply)
+}
+
+// Check every mount in the background the way the monitor does, publishing
+// the results on a board:
+fn start_checks(interval: Duration, timeout: Duration) -> Result<Arc<StatusBoard>> {
+    let board = Arc::new(StatusBoard::new());
+    let published = board.clone();
+    thread::Builder::new()
+        .name("checks".to_owned())
+        .spawn(move || {
+            let clock: Arc<dyn Clock> = Arc::new(SystemClock);
+            let prober = ProcessProber {
+                statfs_helper: None,
+                namespace_helper: None,
+                timeout,
+            };
+            let mut scheduler = Scheduler::new(interval, OverrunPolicy::Skip, clock.clone());
+            let mut mount_statuses = HashMap::<PathBuf, MountState>::new();
+            loop {
+                // Windows are kept for the p99 column:
+                check_mounts(
+                    &mut mount_statuses,
+                    &SystemMounts,
+                    &prober,
+                    &*clock,
+                    false,
+                    true,
+                );
+                published.publish(&mount_statuses);
+                scheduler.wait();
+            }
+        })
+        .chain_err(|| "Unable to start the check thread")?;
+    Ok(board)
+}
+
+fn format_seconds(value: Option<f64>) -> String {
+    match value {
+        None => "-".to_owned(),
+        Some(value) if value < 1.0 => format!("{:.1}ms", value * 1e3),
+        Some(value) => format!("{:.2}s", value),
+    }
+}
+
+fn format_age(age: Option<Duration>) -> String {
+    match age.map(|age| age.as_secs()) {
+        None => "-".to_owned(),
+        Some(s) if s < 120 => format!("{}s", s),
+        Some(s) if s < 7200 => format!("{}m", s / 60),
+        Some(s) if s < 172_800 => format!("{}h", s / 3600),
+        Some(s) => format!("{}d", s / 86400),
+    }
+}
+
+fn format_row(row: &Row, now: SystemTime) -> String {
+    let mut server = row.server.clone();
+    if server.chars().count() > 24 {
+        server = server.chars().take(23).collect::<String>() + "~";
+    }
+    format!(
+        "{:<9} {:>9} {:>9} {:>6}  {:<24} {}",
+        row.state,
+        format_seconds(row.latency),
+        format_seconds(row.p99),
+        format_age(row.hung_for(now)),
+        server,
+        row.mount_point
+    )
+}
+
+const COLUMNS: &str = "STATE       LATENCY   P99(5m)   HUNG  SERVER                   MOUNTPOINT";
+
+fn summary(rows: &[Row], key: SortKey, now: SystemTime) -> String {
+    let mut counts: Vec<(&str, usize)> = Vec::new();
+    for row in rows {
+        match counts
+            .iter_mut()
+            .find(|&&mut (state, _)| state == row.state)
+        {
+            Some(count) => count.1 += 1,
+            None => counts.push((&row.state, 1)),
+        }
+    }
+    counts.sort_by_key(|&(state, _)| state_rank(state));
+    let latest = rows.iter().filter_map(|row| row.checked).max();
+    format!(
+        "{} mounts: {}; last checked {} ago; sorted by {}",
+        rows.len(),
+        if counts.is_empty() {
+            "waiting for the first check".to_owned()
+        } else {
+            counts
+                .iter()
+                .map(|&(state, count)| format!("{} {}", count, state))
+                .collect::<Vec<_>>()
+                .join(", ")
+        },
+        format_age(latest.map(|latest| now.duration_since(latest).unwrap_or_default())),
+        key.name()
+    )
+}
+
+// The terminal in raw mode, restored when dropped:
+struct Terminal {
+    original: libc::termios,
+    // What is on the screen, line by line:
+    lines: Vec<String>,
+    size: (usize, usize),
+}
+
+impl Terminal {
+    fn open() -> Result<Terminal> {
+        let mut original: libc::termios = unsafe { mem::zeroed() };
+        if unsafe { libc::tcgetattr(libc::STDIN_FILENO, &mut original) } != 0 {
+            return Err(io::Error::last_os_error())
+                .chain_err(|| "Unable to read terminal settings");
+        }
+        let mut raw = original;
+        // Keys arrive as they are pressed and are not echoed. Ctrl-C arrives
+        // as a key too, so the terminal is always restored on the way out:
+        raw.c_lflag &= !(libc::ICANON | libc::ECHO | libc::ISIG);
+        raw.c_cc[libc::VMIN] = 0;
+        raw.c_cc[libc::VTIME] = 0;
+        if unsafe { libc::tcsetattr(libc::STDIN_FILENO, libc::TCSANOW, &raw) } != 0 {
+            return Err(io::Error::last_os_error()).chain_err(|| "Unable to set terminal mode");
+        }
+        // The alternate screen leaves the scrollback as it was, with the
+        // cursor hidden:
+        print!("\x1b[?1049h\x1b[?25l");
+        Ok(Terminal {
+            original,
+            lines: Vec::new(),
+            size: (0, 0),
+        })
+    }
+
+    // Rows and columns:
+    fn size() -> (usize, usize) {
+        let mut size: libc::winsize = unsafe { mem::zeroed() };
+        if unsafe { libc::ioctl(libc::STDOUT_FILENO, libc::TIOCGWINSZ, &mut size) } == 0
+            && size.ws_row > 0
+            && size.ws_col > 0
+        {
+            (size.ws_row as usize, size.ws_col as usize)
+        } else {
+            (24, 80)
+        }
+    }
+
+    // Wait up to the timeout for a key:
+    fn key(&self, timeout: Duration) -> Option<u8> {
+        let mut poll_fd = libc::pollfd {
+            fd: libc::STDIN_FILENO,
+            events: libc::POLLIN,
+            revents: 0,
+        };
+        let millis = timeout.as_secs() * 1000 + u64::from(timeout.subsec_millis());
+        if unsafe { libc::poll(&mut poll_fd, 1, millis as libc::c_int) } <= 0 {
+            return None;
+        }
+        let mut key = [0u8];
+        match io::stdin().read(&mut key) {
+            Ok(1) => Some(key[0]),
+            _ => None,
+        }
+    }
+
+    // Rewrite the lines which have changed since the last draw:
+    fn draw(&mut self, lines: Vec<String>) -> io::Result<()> {
+        let size = Terminal::size();
+        let mut output = String::new();
+        if size != self.size {
+            output.push_str("\x1b[2J");
+            self.lines.clear();
+            self.size = size;
+        }
+
+        let (height, width) = size;
+        let lines: Vec<String> = lines
+            .into_iter()
+            .take(height)
+            .map(|line| line.chars().take(width).collect())
+            .collect();
+        for index in 0..lines.len().max(self.lines.len()) {
+            let line = lines.get(index).map_or("", |line| line.as_str());
+            if self.lines.get(index).map(|drawn| drawn.as_str()) != Some(line) {
+                // The column headings are drawn in reverse video:
+                let (start, end) = if index == HEADER_LINES - 1 {
+                    ("\x1b[7m", "\x1b[0m")
+                } else {
+                    ("", "")
+                };
+                output.push_str(&format!(
+                    "\x1b[{};1H{}{}\x1b[K{}",
+                    index + 1,
+                    start,
+                    line,
+                    end
+                ));
+            }
+        }
+        self.lines = lines;
+
+        let stdout = io::stdout();
+        let mut stdout = stdout.lock();
+        stdout.write_all(output.as_bytes())?;
+        stdout.flush()
+    }
+}
+
+impl Drop for Terminal {
+    fn drop(&mut self) {
+        print!("\x1b[?25h\x1b[?1049l");
+        let _ = io::stdout().flush();
+        unsafe {
+            libc::tcsetattr(libc::STDIN_FILENO, libc::TCSANOW, &self.original);
+        }
+    }
+}
+
+pub fn run(args: Vec<String>) -> Result<()> {
+    let mut socket = "/run/mount_status_monitor.sock".to_owned();
+    let mut local = false;
+    let mut refresh: f64 = 1.0;
+    let mut interval: u64 = 5;
+    let mut timeout: f64 = seconds(probe::CHECK_TIMEOUT);
+    let mut sort = "l".to_owned();
+
+    {
+        let mut ap = ArgumentParser::new();
+        ap.set_description("Show the state and check latency of every mount, refreshed in place");
+
+        ap.refer(&mut socket).add_option(
+            &["--socket"],
+            Store,
+            "The running monitor's --control-socket",
+        );
+
+        ap.refer(&mut local).add_option(
+            &["--local"],
+            StoreTrue,
+            "Check the mounts ourselves instead of asking a running monitor",
+        );
+
+        ap.refer(&mut refresh).add_option(
+            &["--refresh"],
+            Store,
+            "Number of seconds between refreshes of the screen",
+        );
+
+        ap.refer(&mut interval).add_option(
+            &["--poll-interval"],
+            Store,
+            "Number of seconds between our own checks of each mount",
+        );
+
+        ap.refer(&mut timeout).add_option(
+            &["--check-timeout"],
+            Store,
+            "Number of seconds before one of our own checks is considered hung",
+        );
+
+        ap.refer(&mut sort).add_option(
+            &["--sort"],
+            Store,
+            "Initial order: l (latency), p (p99), s (state), a (hung age), g (server) or n (name)",
+        );
+
+        let mut args = args;
+        args[0] = "mount_status_monitor top".to_owned();
+        if let Err(rc) = ap.parse(args, &mut io::stdout(), &mut io::stderr()) {
+            ::std::process::exit(rc);
+        }
+    }
+
+    let mut key = match sort.as_bytes() {
+        &[key] => SortKey::from_key(key),
+        _ => None,
+    }
+    .ok_or_else(|| format!("Unknown sort order {:?}", sort))?;
+    let seconds_of = |value: f64| Duration::from_millis((value.max(0.0) * 1000.0) as u64);
+
+    let socket = PathBuf::from(socket);
+    let mut source = if !local && query(&socket).is_ok() {
+        Source::Socket(socket, None)
+    } else {
+        let board = start_checks(Duration::from_secs(interval), seconds_of(timeout))?;
+        Source::Local(board, None)
+    };
+
+    if unsafe { libc::isatty(libc::STDOUT_FILENO) } == 0 {
+        // Our own checks need a cycle to produce anything:
+        let mut rows = loop {
+            match source.poll()? {
+                Some(ref rows) if rows.is_empty() && local_source(&source) => {}
+                Some(rows) => break rows,
+                None => {}
+            }
+            thread::sleep(Duration::from_millis(100));
+        };
+        let now = SystemTime::now();
+        sort_rows(&mut rows, key, now);
+        println!("{}", COLUMNS);
+        for row in &rows {
+            println!("{}", format_row(row, now));
+        }
+        return Ok(());
+    }
+
+    let mut terminal = Terminal::open()?;
+    let mut rows = Vec::new();
+    let mut resort = true;
+    loop {
+        // A monitor which stops answering may be restarting, so keep trying:
+        let problem = match source.poll() {
+            Ok(Some(new_rows)) => {
+                rows = new_rows;
+                resort = true;
+                None
+            }
+            Ok(None) => None,
+            Err(e) => Some(e.to_string()),
+        };
+        let now = SystemTime::now();
+        // Hung ages keep growing, so those orders change without new rows:
+        if resort || key == SortKey::HungAge || key == SortKey::Latency {
+            sort_rows(&mut rows, key, now);
+            resort = false;
+        }
+
+        let (height, _) = Terminal::size();
+        let mut lines = vec![
+            match problem {
+                Some(problem) => format!("mount_status_monitor top - {}", problem),
+                None => format!(
+                    "mount_status_monitor top - {} - l/p/s/a/g/n to sort, q to quit",
+                    source.describe()
+                ),
+            },
+            summary(&rows, key, now),
+            COLUMNS.to_owned(),
+        ];
+        lines.extend(
+            rows.iter()
+                .take(height.saturating_sub(HEADER_LINES))
+                .map(|row| format_row(row, now)),
+        );
+        terminal
+            .draw(lines)
+            .chain_err(|| "Unable to write to the terminal")?;
+
+        match terminal.key(seconds_of(refresh)) {
+            // q, Escape or Ctrl-C:
+            Some(b'q') | Some(0x1b) | Some(0x03) => return Ok(()),
+            Some(pressed) => {
+                if let Some(new_key) = SortKey::from_key(pressed) {
+                    key = new_key;
+                    resort = true;
+                }
+            }
+            None => {}
+        }
+    }
+}
+
+// Just enough JSON to read the control socket's replies:
+#[derive(Clone, Debug)]
+enum Json {
+    String(String),
+    Number(f64),
+    Object(Vec<(String, Json)>),
+    Other,
+}
+
+impl Json {
+    fn parse(text: &str) -> Option<Json> {
+        let mut parser = JsonParser {
+            chars: text.chars().collect(),
+            position: 0,
+        };
+        parser.value()
+    }
+}
+
+struct JsonParser {
+    chars: Vec<char>,
+    position: usize,
+}
+
+impl JsonParser {
+    fn peek(&mut self) -> Option<char> {
+        while self
+            .chars
+            .get(self.position)
+            .map_or(false, |c| c.is_whitespace())
+        {
+            self.position += 1;
+        }
+        self.chars.get(self.position).cloned()
+    }
+
+    fn expect(&mut self, c: char) -> Option<()> {
+        if self.peek()? == c {
+            self.position += 1;
+            Some(())
+        } else {
+            None
+        }
+    }
+
+    fn value(&mut self) -> Option<Json> {
+        match self.peek()? {
+            '{' => {
+                self.position += 1;
+                let mut fields = Vec::new();
+                if self.peek()? == '}' {
+                    self.position += 1;
+                    return Some(Json::Object(fields));
+                }
+                loop {
+                    let name = self.string()?;
+                    self.expect(':')?;
+                    fields.push((name, self.value()?));
+                    match self.peek()? {
+                        ',' => self.position += 1,
+                        '}' => {
+                            self.position += 1;
+                            return Some(Json::Object(fields));
+                        }
+                        _ => return None,
+                    }
+                }
+            }
+            '[' => {
+                self.position += 1;
+                if self.peek()? == ']' {
+                    self.position += 1;
+                    return Some(Json::Other);
+                }
+                loop {
+                    self.value()?;
+                    match self.peek()? {
+                        ',' => self.position += 1,
+                        ']' => {
+                            self.position += 1;
+                            return Some(Json::Other);
+                        }
+                        _ => return None,
+                    }
+                }
+            }
+            '"' => self.string().map(Json::String),
+            _ => {
+                let start = self.position;
+                while self
+                    .chars
+                    .get(self.position)
+                    .map_or(false, |&c| c.is_alphanumeric() || "+-.".contains(c))
+                {
+                    self.position += 1;
+                }
+                let token: String = self.chars[start..self.position].iter().collect();
+                match token.as_str() {
+                    "true" | "false" | "null" => Some(Json::Other),
+                    _ => token.parse().ok().map(Json::Number),
+                }
+            }
+        }
+    }
+
+    fn string(&mut self) -> Option<String> {
+        self.expect('"')?;
+        let mut value = String::new();
+        loop {
+            let c = *self.chars.get(self.position)?;
+            self.position += 1;
+            match c {
+                '"' => return Some(value),
+                '\\' => {
+                    let escaped = *self.chars.get(self.position)?;
+                    self.position += 1;
+                    value.push(match escaped {
+                        'n' => '\n',
+                        't' => '\t',
+                        'r' => '\r',
+                        'b' => '\u{8}',
+                        'f' => '\u{c}',
+                        'u' => {
+                            let hex: String = self
+                                .chars
+                                .get(self.position..self.position + 4)?
+                                .iter()
+                                .collect();
+                            self.position += 4;
+                            u32::from_str_radix(&hex, 16)
+                                .ok()
+                                .and_then(::std::char::from_u32)
+                                .unwrap_or('\u{fffd}')
+                        }
+                        other => other,
+                    });
+                }
+                c => value.push(c),
+            }
+        }
+    }
+}
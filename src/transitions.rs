@@ -0,0 +1,246 @@
+// Logging driven by changes of state rather than by every check
+//
+// A dead mount used to be logged on every cycle, which on a host with
+// thousands of mounts turns a storage outage into a syslog outage. Instead we
+// log once when a mount stops responding, once when it recovers, and
+// otherwise only a periodic one-line reminder of what is still broken. The
+// reminder interval is counted from when the first mount failed, so a steady
+// trickle of new failures doesn't keep postponing it. Failures are also
+// written to stderr, which is rate limited in the same way as syslog.
+
+use std::collections::{HashMap, HashSet};
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use crate::clock::Clock;
+use crate::logging::TokenBucket;
+use crate::{CheckOutcome, StatusKind};
+
+// The reminder lists at most this many mounts by name:
+const MAX_REMINDER_MOUNTS: usize = 10;
+
+pub struct TransitionLogger {
+    clock: Arc<dyn Clock>,
+    reminder_interval: Duration,
+    last_reminder: Instant,
+    // Each currently unhealthy mount and when it was first seen to fail:
+    unhealthy: HashMap<PathBuf, Instant>,
+    // None when rate limiting is disabled:
+    stderr_limit: Option<TokenBucket>,
+}
+
+impl TransitionLogger {
+    pub fn new(
+        reminder_interval: Duration,
+        lines_per_second: u32,
+        clock: Arc<dyn Clock>,
+    ) -> TransitionLogger {
+        TransitionLogger {
+            reminder_interval,
+            last_reminder: clock.now(),
+            unhealthy: HashMap::new(),
+            stderr_limit: if lines_per_second > 0 {
+                Some(TokenBucket::new(lines_per_second, clock.now()))
+            } else {
+                None
+            },
+            clock,
+        }
+    }
+
+    pub fn set_reminder_interval(&mut self, reminder_interval: Duration) {
+        self.reminder_interval = reminder_interval;
+    }
+
+    /// Report a mount whose check was already hung when we started
+    pub fn adopted(&mut self, mount_point: &Path, pid: u32, since: Instant) {
+        let msg = format!(
+            "Mount failed health-check (hung): {} (check {} has been hung for {} seconds)",
+            mount_point.display(),
+            pid,
+            self.clock.now().duration_since(since).as_secs()
+        );
+        let now = self.clock.now();
+        self.report_failure(&msg, now);
+        self.add_unhealthy(mount_point.to_owned(), since, now);
+    }
+
+    /// Log the changes of state in a cycle's outcomes, returning whether a
+    /// reminder of the mounts which are still failing was logged as well
+    pub fn record(&mut self, outcomes: &[CheckOutcome]) -> bool {
+        let now = self.clock.now();
+        for outcome in outcomes {
+            let path = outcome.mount_point.display();
+
+            match (outcome.previous, outcome.current) {
+                (previous, current) if previous == current => {}
+                (StatusKind::Alive, _) => self.mount_failed(outcome, now),
+                (previous, StatusKind::Alive) => {
+                    let down_for = self
+                        .unhealthy
+                        .remove(&outcome.mount_point)
+                        .map_or(0, |since| now.duration_since(since).as_secs());
+                    info!(
+                        "Mount recovered after {} seconds (was {}): {}",
+                        down_for,
+                        previous.name(),
+                        path
+                    );
+                }
+                (previous, current) => {
+                    warn!(
+                        "Mount is now {} instead of {}: {}",
+                        current.name(),
+                        previous.name(),
+                        path
+                    );
+                }
+            }
+        }
+
+        // Forget about anything which has been unmounted:
+        if !self.unhealthy.is_empty() {
+            let current: HashSet<&PathBuf> = outcomes.iter().map(|o| &o.mount_point).collect();
+            self.unhealthy.retain(|path, _| current.contains(path));
+        }
+
+        if !self.unhealthy.is_empty()
+            && now.duration_since(self.last_reminder) >= self.reminder_interval
+        {
+            self.remind(now);
+            return true;
+        }
+        false
+    }
+
+    fn mount_failed(&mut self, outcome: &CheckOutcome, now: Instant) {
+        let msg = format!(
+            "Mount failed health-check ({}): {}",
+            outcome.current.name(),
+            outcome.mount_point.display()
+        );
+        self.report_failure(&msg, now);
+        self.add_unhealthy(outcome.mount_point.clone(), now, now);
+    }
+
+    fn add_unhealthy(&mut self, mount_point: PathBuf, since: Instant, now: Instant) {
+        // The first failure starts the reminder interval. Later ones leave
+        // it alone so that the reminder still comes during constant churn:
+        if self.unhealthy.is_empty() {
+            self.last_reminder = now;
+        }
+        self.unhealthy.entry(mount_point).or_insert(since);
+    }
+
+    fn report_failure(&mut self, msg: &str, now: Instant) {
+        error!("{}", msg);
+
+        if let Some(ref mut bucket) = self.stderr_limit {
+            if !bucket.try_take(now) {
+                return;
+            }
+            let suppressed = bucket.take_suppressed();
+            if suppressed > 0 {
+                eprintln!(
+                    "Suppressed {} failure messages which exceeded the rate limit",
+                    suppressed
+                );
+            }
+        }
+        eprintln!("{}", msg);
+    }
+
+    fn remind(&mut self, now: Instant) {
+        let mut oldest: Vec<(&PathBuf, &Instant)> = self.unhealthy.iter().collect();
+        oldest.sort_by_key(|&(_, since)| *since);
+
+        let mut names: Vec<String> = oldest
+            .iter()
+            .take(MAX_REMINDER_MOUNTS)
+            .map(|&(path, since)| {
+                format!(
+                    "{} ({}s)",
+                    path.display(),
+                    now.duration_since(*since).as_secs()
+                )
+            })
+            .collect();
+        if oldest.len() > MAX_REMINDER_MOUNTS {
+            names.push(format!("and {} more", oldest.len() - MAX_REMINDER_MOUNTS));
+        }
+
+        warn!(
+            "{} mounts are still failing health-checks: {}",
+            oldest.len(),
+            names.join(", ")
+        );
+        self.last_reminder = now;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::path::PathBuf;
+    use std::sync::Arc;
+    use std::time::{Duration, SystemTime};
+
+    use super::TransitionLogger;
+    use crate::clock::{Clock, VirtualClock};
+    use crate::{CheckOutcome, StatusKind};
+
+    fn outcome(index: usize, previous: StatusKind, current: StatusKind) -> CheckOutcome {
+        CheckOutcome {
+            mount_point: PathBuf::from(format!("/mnt/{}", index)),
+            fs_type: "nfs".to_owned(),
+            source: format!("filer:/export/{}", index),
+            previous,
+            current,
+            check_duration: None,
+            timestamp: SystemTime::now(),
+        }
+    }
+
+    #[test]
+    fn reminder_is_not_postponed_by_new_failures() {
+        let clock = Arc::new(VirtualClock::new());
+        let start_time = clock.now();
+        let mut logger = TransitionLogger::new(Duration::from_secs(60), 0, clock.clone());
+
+        // Another mount fails every 10 seconds:
+        for cycle in 0..10 {
+            let outcomes: Vec<CheckOutcome> = (0..=cycle)
+                .map(|i| {
+                    if i == cycle {
+                        outcome(i, StatusKind::Alive, StatusKind::Hung)
+                    } else {
+                        outcome(i, StatusKind::Hung, StatusKind::Hung)
+                    }
+                })
+                .collect();
+            logger.record(&outcomes);
+            clock.sleep(Duration::from_secs(10));
+        }
+
+        assert_eq!(
+            logger.last_reminder.duration_since(start_time),
+            Duration::from_secs(60)
+        );
+    }
+
+    #[test]
+    fn reminder_interval_starts_with_the_first_failure() {
+        let clock = Arc::new(VirtualClock::new());
+        let mut logger = TransitionLogger::new(Duration::from_secs(60), 0, clock.clone());
+
+        logger.record(&[outcome(0, StatusKind::Alive, StatusKind::Alive)]);
+        clock.sleep(Duration::from_secs(300));
+        let failed_at = clock.now();
+        logger.record(&[outcome(0, StatusKind::Alive, StatusKind::Failed)]);
+        clock.sleep(Duration::from_secs(30));
+        logger.record(&[outcome(0, StatusKind::Failed, StatusKind::Failed)]);
+
+        // Nothing was failing before, so no reminder is due yet:
+        assert_eq!(logger.last_reminder, failed_at);
+    }
+}
@@ -0,0 +1,238 @@
+// Rolling availability and latency for each mount
+//
+// Whether a mount is up right now says nothing about how often it has been
+// down today, which is what an availability target is measured against, and
+// exporting every check so the time series database can work it out costs a
+// series per mount per check. With --availability-windows each mount instead
+// keeps fixed-size rings of time buckets covering the last 5 minutes, hour and
+// day, and the monitor exports the availability and latency percentiles over
+// each window already aggregated.
+//
+// Each bucket counts the checks made during its slice of time, how many of
+// them succeeded and a histogram of their durations with power-of-two bounds
+// from 1ms. A cycle in which a hung check is still running counts as a failed
+// check with no duration. A bucket is reused once its ring wraps around, which
+// is noticed from the sequence number of the time slice it was last written in,
+// so nothing needs to be cleared on a timer and a mount which is checked rarely
+// costs nothing to keep up to date. A window is made up of the current bucket,
+// however much of it has elapsed, and the ones before it, so the 5 minute
+// window covers somewhere between the last 4.5 and 5 minutes.
+//
+// Every mount costs under 2KB, which is why the windows are optional.
+// Percentiles are interpolated within a histogram bucket, so are only accurate
+// to within a factor of two, which is plenty for telling 5ms from 5s.
+
+use std::time::{Duration, Instant};
+
+pub struct Window {
+    pub name: &'static str,
+    buckets: usize,
+    bucket_width: Duration,
+}
+
+pub const WINDOWS: &[Window] = &[
+    Window {
+        name: "5m",
+        buckets: 10,
+        bucket_width: Duration::from_secs(30),
+    },
+    Window {
+        name: "1h",
+        buckets: 12,
+        bucket_width: Duration::from_secs(300),
+    },
+    Window {
+        name: "24h",
+        buckets: 24,
+        bucket_width: Duration::from_secs(3600),
+    },
+];
+
+// The total number of buckets in all of the rings:
+const RING_BUCKETS: usize = 10 + 12 + 24;
+
+// Durations up to 1ms, 2ms, 4ms and so on, with the last bucket holding
+// everything from 16.384s upwards:
+const LATENCY_BUCKETS: usize = 16;
+
+pub const QUANTILES: &[(&str, f64)] = &[("0.5", 0.5), ("0.9", 0.9), ("0.99", 0.99)];
+
+#[derive(Clone, Copy, Default)]
+struct Bucket {
+    // Which time slice since the origin the counts belong to:
+    sequence: u32,
+    checks: u16,
+    up: u16,
+    latency: [u16; LATENCY_BUCKETS],
+}
+
+/// A mount's rings of buckets
+pub struct MountWindows {
+    origin: Instant,
+    buckets: Box<[Bucket]>,
+}
+
+impl ::std::fmt::Debug for MountWindows {
+    fn fmt(&self, f: &mut ::std::fmt::Formatter) -> ::std::fmt::Result {
+        write!(f, "MountWindows {{ since: {:?} }}", self.origin)
+    }
+}
+
+/// Add a check's result to a mount's windows, starting them if need be
+pub fn record(
+    windows: &mut Option<Box<MountWindows>>,
+    now: Instant,
+    up: bool,
+    duration: Option<Duration>,
+) {
+    windows
+        .get_or_insert_with(|| Box::new(MountWindows::new(now)))
+        .record(now, up, duration);
+}
+
+impl MountWindows {
+    fn new(origin: Instant) -> MountWindows {
+        MountWindows {
+            origin,
+            buckets: vec![Bucket::default(); RING_BUCKETS].into_boxed_slice(),
+        }
+    }
+
+    // Each window's ring, in the order of WINDOWS, with the sequence number
+    // of the time slice which now falls in it:
+    fn rings(&self, now: Instant) -> Vec<(usize, usize, u32)> {
+        let elapsed = now.duration_since(self.origin).as_secs();
+        let mut start = 0;
+        WINDOWS
+            .iter()
+            .map(|window| {
+                let ring = (
+                    start,
+                    window.buckets,
+                    (elapsed / window.bucket_width.as_secs()) as u32,
+                );
+                start += window.buckets;
+                ring
+            })
+            .collect()
+    }
+
+    fn record(&mut self, now: Instant, up: bool, duration: Option<Duration>) {
+        let latency_bucket = duration.map(latency_bucket);
+        for (start, len, sequence) in self.rings(now) {
+            // Sequence numbers start at 1 so an unused bucket never matches:
+            let sequence = sequence + 1;
+            let bucket = &mut self.buckets[start + sequence as usize % len];
+            if bucket.sequence != sequence {
+                *bucket = Bucket {
+                    sequence,
+                    ..Bucket::default()
+                };
+            }
+            bucket.checks = bucket.checks.saturating_add(1);
+            if up {
+                bucket.up = bucket.up.saturating_add(1);
+            }
+            if let Some(index) = latency_bucket {
+                bucket.latency[index] = bucket.latency[index].saturating_add(1);
+            }
+        }
+    }
+
+    /// The totals for each window in WINDOWS as of now
+    pub fn totals(&self, now: Instant) -> Vec<WindowTotals> {
+        self.rings(now)
+            .into_iter()
+            .map(|(start, len, sequence)| {
+                let sequence = sequence + 1;
+                let mut totals = WindowTotals::default();
+                for bucket in &self.buckets[start..start + len] {
+                    // Only buckets written during the last len slices count:
+                    if bucket.sequence == 0
+                        || bucket.sequence > sequence
+                        || sequence - bucket.sequence >= len as u32
+                    {
+                        continue;
+                    }
+                    totals.checks += u64::from(bucket.checks);
+                    totals.up += u64::from(bucket.up);
+                    for (total, &count) in totals.latency.iter_mut().zip(bucket.latency.iter()) {
+                        *total += u64::from(count);
+                    }
+                }
+                totals
+            })
+            .collect()
+    }
+}
+
+fn latency_bucket(duration: Duration) -> usize {
+    let millis = duration.as_secs() * 1000 + u64::from(duration.subsec_millis());
+    // 0-1ms is bucket 0, 1-2ms bucket 1, 2-4ms bucket 2, and so on:
+    let index = 64 - millis.leading_zeros() as usize;
+    index.min(LATENCY_BUCKETS - 1)
+}
+
+// The range of durations held by a latency bucket, in seconds:
+fn latency_bounds(index: usize) -> (f64, f64) {
+    let lower = if index == 0 {
+        0.0
+    } else {
+        (1u64 << (index - 1)) as f64 / 1000.0
+    };
+    (lower, (1u64 << index) as f64 / 1000.0)
+}
+
+/// The checks which fell in a window, which can be added together to cover
+/// several mounts
+#[derive(Clone, Copy, Debug, Default)]
+pub struct WindowTotals {
+    pub checks: u64,
+    pub up: u64,
+    latency: [u64; LATENCY_BUCKETS],
+}
+
+impl WindowTotals {
+    // Used when metrics merge mounts which share their labels:
+    #[cfg(feature = "with_prometheus")]
+    pub fn add(&mut self, other: &WindowTotals) {
+        self.checks += other.checks;
+        self.up += other.up;
+        for (total, &count) in self.latency.iter_mut().zip(other.latency.iter()) {
+            *total += count;
+        }
+    }
+
+    /// The fraction of checks which succeeded, if there were any
+    pub fn availability(&self) -> Option<f64> {
+        if self.checks == 0 {
+            None
+        } else {
+            Some(self.up as f64 / self.checks as f64)
+        }
+    }
+
+    /// The estimated check duration in seconds below which a fraction q of
+    /// the timed checks fell
+    pub fn quantile(&self, q: f64) -> Option<f64> {
+        let timed: u64 = self.latency.iter().sum();
+        if timed == 0 {
+            return None;
+        }
+        let rank = q * timed as f64;
+        let mut below = 0u64;
+        for (index, &count) in self.latency.iter().enumerate() {
+            if count > 0 && (below + count) as f64 >= rank {
+                let (lower, upper) = latency_bounds(index);
+                // Nothing is known about the top bucket beyond where it starts:
+                if index == LATENCY_BUCKETS - 1 {
+                    return Some(lower);
+                }
+                let fraction = (rank - below as f64) / count as f64;
+                return Some(lower + (upper - lower) * fraction.max(0.0).min(1.0));
+            }
+            below += count;
+        }
+        None
+    }
+}